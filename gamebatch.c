@@ -0,0 +1,389 @@
+#include <stdlib.h>
+#include <string.h>
+#include "gamecore.h"
+#include "gamebatch.h"
+
+/*
+ * Everything but the auction runs as plain loops over the whole batch,
+ * which the compiler can vectorize. The auction is run game by game over
+ * small arrays of orders, drawing the same random numbers in the same
+ * order as gamecore does.
+ */
+
+#define RNG_MAX 0x7fffffff
+
+static const struct game_rules classic = RULES_CLASSIC;
+static const struct game_rules rich = RULES_RICH;
+
+/*as gamecore's, a copy of fn for every set of the registry*/
+#define BY_RULES(r, fn, ...) do { \
+	switch ((r)->set) { \
+	case classic_rules: fn(&classic, __VA_ARGS__); break; \
+	case rich_rules: fn(&rich, __VA_ARGS__); break; \
+	default: fn((r), __VA_ARGS__); \
+	} \
+} while (0)
+
+#define RULED static inline __attribute__((always_inline))
+
+static int rng_rand(unsigned long long *rng)
+{
+	*rng = *rng*6364136223846793005ULL + 1442695040888963407ULL;
+	return *rng >> 33;
+}
+
+/*fills the NULL terminated lists of the int arrays of a batch*/
+static void list_fields(struct batch *b, int **per_game[],
+	int **per_player[])
+{
+	int **g[] = { &b->id, &b->started, &b->month, &b->pl_count,
+		&b->winner, &b->level, &b->sell_n, &b->min_price, &b->buy_n,
+		&b->max_price, &b->units_sold, &b->min_sold, NULL };
+	int **p[] = { &b->status, &b->money, &b->material, &b->products,
+		&b->for_prod, &b->factories, &b->sell_count, &b->sell_price,
+		&b->buy_count, &b->buy_price, &b->sold, &b->bought, NULL };
+	int d;
+	memcpy(per_game, g, sizeof(g));
+	memcpy(per_player, p, sizeof(p) - sizeof(p[0]));
+	for (d=0; d<BATCH_BUILD_DAYS; d++)
+		per_player[sizeof(p)/sizeof(p[0]) - 1 + d] = &b->building[d];
+	per_player[sizeof(p)/sizeof(p[0]) - 1 + d] = NULL;
+}
+
+struct batch *batch_new(int games, int pl_n)
+{
+	struct batch *b = calloc(1, sizeof(struct batch));
+	int **per_game[BATCH_FIELDS], **per_player[BATCH_FIELDS], i;
+	b->games = games;
+	b->pl_n = pl_n;
+	b->rules = &classic;
+	list_fields(b, per_game, per_player);
+	for (i=0; per_game[i]; i++)
+		*per_game[i] = calloc(games, sizeof(int));
+	for (i=0; per_player[i]; i++)
+		*per_player[i] = calloc(games*pl_n, sizeof(int));
+	b->rng = calloc(games, sizeof(unsigned long long));
+	return b;
+}
+
+void batch_free(struct batch *b)
+{
+	int **per_game[BATCH_FIELDS], **per_player[BATCH_FIELDS], i;
+	list_fields(b, per_game, per_player);
+	for (i=0; per_game[i]; i++)
+		free(*per_game[i]);
+	for (i=0; per_player[i]; i++)
+		free(*per_player[i]);
+	free(b->rng);
+	free(b);
+}
+
+/*exchanges the places of games g and h in the batch*/
+static void swap_games(struct batch *b, int g, int h)
+{
+	int **per_game[BATCH_FIELDS], **per_player[BATCH_FIELDS], i, k, t;
+	unsigned long long r;
+	list_fields(b, per_game, per_player);
+	for (i=0; per_game[i]; i++) {
+		t = (*per_game[i])[g];
+		(*per_game[i])[g] = (*per_game[i])[h];
+		(*per_game[i])[h] = t;
+	}
+	for (i=0; per_player[i]; i++) {
+		int *a = *per_player[i] + g*b->pl_n;
+		int *c = *per_player[i] + h*b->pl_n;
+		for (k=0; k<b->pl_n; k++) {
+			t = a[k];
+			a[k] = c[k];
+			c[k] = t;
+		}
+	}
+	r = b->rng[g];
+	b->rng[g] = b->rng[h];
+	b->rng[h] = r;
+}
+
+/*the market of gamecore's change_level*/
+RULED void levels_by(const struct game_rules *R, struct batch *b)
+{
+	int g;
+	for (g=0; g<b->running; g++) {
+		int l;
+		if (b->month[g] == 1)
+			l = 3;
+		else {
+			int r = 1 + (int)(12.0*rng_rand(&b->rng[g])
+				/(RNG_MAX+1.0));
+			int sum;
+			for (l=0,sum=0; sum<r; l++)
+				sum += R->level_change[b->level[g]-1][l];
+		}
+		b->level[g] = l;
+		b->sell_n[g] = (int)(R->level_sell[l-1]*b->pl_count[g]);
+		b->min_price[g] = R->level_min[l-1];
+		b->buy_n[g] = (int)(R->level_buy[l-1]*b->pl_count[g]);
+		b->max_price[g] = R->level_max[l-1];
+	}
+}
+
+static void change_levels(struct batch *b)
+{
+	BY_RULES(b->rules, levels_by, b);
+}
+
+void batch_start(struct batch *b, unsigned seed)
+{
+	int n = b->games*b->pl_n, g, i, d;
+	for (g=0; g<b->games; g++) {
+		b->id[g] = g;
+		b->started[g] = 1;
+		b->month[g] = 1;
+		b->pl_count[g] = b->pl_n;
+		b->winner[g] = -1;
+		b->units_sold[g] = b->min_sold[g] = 0;
+		b->rng[g] = seed + g;
+	}
+	for (i=0; i<n; i++) {
+		b->status[i] = play;
+		b->money[i] = b->rules->money;
+		b->material[i] = b->rules->material;
+		b->for_prod[i] = 0;
+		b->products[i] = b->rules->products;
+		b->factories[i] = b->rules->factories;
+		b->sell_price[i] = b->buy_price[i] = -1;
+		b->sold[i] = b->bought[i] = 0;
+		for (d=0; d<BATCH_BUILD_DAYS; d++)
+			b->building[d][i] = 0;
+	}
+	b->running = b->games;
+	change_levels(b);
+}
+
+int batch_prod(struct batch *b, int i, int n)
+{
+	if (b->status[i] != play || n < 0 || b->money[i] < b->rules->prod_cost*n
+		|| b->material[i] < n || b->factories[i]-b->for_prod[i] < n)
+		return -1;
+	b->money[i] -= b->rules->prod_cost*n;
+	b->material[i] -= n;
+	b->for_prod[i] += n;
+	return 0;
+}
+
+int batch_sell(struct batch *b, int i, int count, int price)
+{
+	int g = i / b->pl_n;
+	if (b->status[i] != play || count < 0 || price < 0
+		|| b->sell_price[i] != -1 || b->products[i] < count
+		|| price > b->max_price[g])
+		return -1;
+	b->products[i] -= count;
+	b->sell_count[i] = count;
+	b->sell_price[i] = price;
+	return 0;
+}
+
+int batch_buy(struct batch *b, int i, int count, int price)
+{
+	int g = i / b->pl_n;
+	if (b->status[i] != play || count < 0 || price < 0
+		|| b->buy_price[i] != -1 || b->money[i] < count * price
+		|| price < b->min_price[g])
+		return -1;
+	b->money[i] -= count * price;
+	b->buy_count[i] = count;
+	b->buy_price[i] = price;
+	return 0;
+}
+
+int batch_build(struct batch *b, int i)
+{
+	if (b->status[i] != play || b->money[i] < b->rules->build_cost)
+		return -1;
+	b->money[i] -= b->rules->build_cost;
+	b->building[BATCH_BUILD_DAYS-1][i]++;
+	return 0;
+}
+
+struct order {
+	int player;		/* index into the batch */
+	int count;
+	int price;
+};
+
+static void satisfy(struct batch *b, struct order *o, int ammount,
+	int selling)
+{
+	int i = o->player, g = i / b->pl_n;
+	if (selling) {
+		b->money[i] += ammount * o->price;
+		b->products[i] += o->count - ammount;
+		if (ammount > 0) {
+			if (!b->units_sold[g] || o->price < b->min_sold[g])
+				b->min_sold[g] = o->price;
+			b->units_sold[g] += ammount;
+			b->sold[i] += ammount;
+		}
+	} else {
+		b->material[i] += ammount;
+		b->money[i] += (o->count-ammount) * o->price;
+		b->bought[i] += ammount;
+	}
+}
+
+static void take_out(struct order *q, int *n, int k)
+{
+	memmove(q+k, q+k+1, (*n-k-1)*sizeof(struct order));
+	(*n)--;
+}
+
+/*gamecore's auction and auc_chance over an array instead of a list*/
+static void auction(struct batch *b, int g, struct order *q, int n,
+	int possible_deals, int selling)
+{
+	while (n > 0) {
+		int best, participants, prod_n, i;
+		if (possible_deals == 0)
+			break;
+		best = q[0].price;
+		participants = prod_n = 0;
+		for (i=0; i<n && q[i].price == best; i++) {
+			participants++;
+			prod_n += q[i].count;
+		}
+		if (prod_n <= possible_deals) {
+			for (i=0; i<participants; i++) {
+				satisfy(b, &q[0], q[0].count, selling);
+				possible_deals -= q[0].count;
+				take_out(q, &n, 0);
+			}
+			continue;
+		}
+		while (possible_deals > 0) {
+			int r = 1 + (int)((float)(participants)
+				*rng_rand(&b->rng[g])/(RNG_MAX+1.0));
+			struct order *o = &q[r-1];
+			if (o->count <= possible_deals) {
+				satisfy(b, o, o->count, selling);
+				possible_deals -= o->count;
+			} else {
+				satisfy(b, o, possible_deals, selling);
+				possible_deals = 0;
+			}
+			take_out(q, &n, r-1);
+			participants--;
+		}
+	}
+	for (; n > 0; n--)
+		satisfy(b, &q[n-1], 0, selling);
+}
+
+/*
+ * The orders are put in the order gamecore's queues would hold them in
+ * if the players had placed them one after another.
+ */
+static int queue_orders(struct batch *b, int g, struct order *q,
+	int *count, int *price, int selling)
+{
+	int k, j, n = 0;
+	for (k=0; k<b->pl_n; k++) {
+		int i = g*b->pl_n + k;
+		if (price[i] == -1)
+			continue;
+		for (j=0; j<n && (selling ? price[i] > q[j].price
+			: price[i] < q[j].price); j++)
+			;
+		memmove(q+j+1, q+j, (n-j)*sizeof(struct order));
+		q[j].player = i;
+		q[j].count = count[i];
+		q[j].price = price[i];
+		price[i] = -1;
+		n++;
+	}
+	return n;
+}
+
+static void auctions(struct batch *b)
+{
+	struct order *q = malloc(b->pl_n*sizeof(struct order));
+	int g, n = b->running*b->pl_n, i;
+	for (i=0; i<n; i++)
+		b->sold[i] = b->bought[i] = 0;
+	for (g=0; g<b->running; g++) {
+		b->units_sold[g] = b->min_sold[g] = 0;
+		n = queue_orders(b, g, q, b->sell_count, b->sell_price, 1);
+		auction(b, g, q, n, b->buy_n[g], 1);
+		n = queue_orders(b, g, q, b->buy_count, b->buy_price, 0);
+		auction(b, g, q, n, b->sell_n[g], 0);
+	}
+	free(q);
+}
+
+/*written without branches, so that the loop can be vectorized*/
+RULED void accounting_by(const struct game_rules *R, struct batch *b)
+{
+	int n = b->running*b->pl_n, i;
+	int *money = b->money, *products = b->products;
+	int *material = b->material, *factories = b->factories;
+	int *for_prod = b->for_prod, *status = b->status;
+	int *b1 = b->building[0], *b2 = b->building[1];
+	int *b3 = b->building[2], *b4 = b->building[3];
+	int *b5 = b->building[4];
+	for (i=0; i<n; i++) {
+		int active = status[i] == play;
+		int p = products[i] + for_prod[i];
+		int m = money[i] - R->material_upkeep*material[i]
+			- R->product_upkeep*p - R->factory_upkeep*factories[i]
+			- R->build_cost*b2[i];
+		products[i] = active ? p : products[i];
+		for_prod[i] = active ? 0 : for_prod[i];
+		money[i] = active ? m : money[i];
+		factories[i] += active ? b1[i] : 0;
+		b1[i] = active ? b2[i] : b1[i];
+		b2[i] = active ? b3[i] : b2[i];
+		b3[i] = active ? b4[i] : b3[i];
+		b4[i] = active ? b5[i] : b4[i];
+		b5[i] = active ? 0 : b5[i];
+		status[i] = active && m < 0 ? bankrupt : status[i];
+	}
+}
+
+static void accounting(struct batch *b)
+{
+	BY_RULES(b->rules, accounting_by, b);
+}
+
+static void next_month(struct batch *b)
+{
+	int g = 0, k;
+	while (g < b->running) {
+		int *status = b->status + g*b->pl_n, n = 0, last = -1;
+		for (k=0; k<b->pl_n; k++) {
+			if (status[k] == play) {
+				n++;
+				last = k;
+			}
+		}
+		b->pl_count[g] = n;
+		if (n > 1) {
+			b->month[g]++;
+			g++;
+			continue;
+		}
+		b->winner[g] = last;
+		b->started[g] = 0;
+		for (k=0; k<b->pl_n; k++)
+			status[k] = off;
+		/*the games still going on are kept at the front*/
+		swap_games(b, g, --b->running);
+	}
+	change_levels(b);
+}
+
+int batch_month(struct batch *b)
+{
+	auctions(b);
+	accounting(b);
+	next_month(b);
+	return b->running;
+}
@@ -0,0 +1,83 @@
+#ifndef GAMEBATCH_H
+#define GAMEBATCH_H
+
+/*
+ * Many independent games played by the rules of gamecore in lockstep.
+ * Every field is an array over the batch: per game fields are indexed by
+ * the game, per player ones by game*pl_n + player. Every game has a
+ * random state of its own seeded as gamecore seeds a single game, so game
+ * g of a batch started with seed s goes exactly as a single game started
+ * with s+g would go with the same moves.
+ *
+ * A month is played by calling batch_prod/sell/buy/build for the players
+ * and then batch_month for all the games at once; every active player is
+ * taken to have made the turn. A player may place one sale and one
+ * purchase a month.
+ *
+ * The games still going on are kept in the first running places, so
+ * that the loops over the batch only go over them; a game that is over
+ * is moved behind them, and id tells which game of the batch is in a
+ * place.
+ */
+
+#include "gamerules.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BATCH_BUILD_DAYS 5
+#define BATCH_FIELDS 32
+
+struct batch {
+	int games;
+	int pl_n;
+	int running;		/* games not over yet */
+	const struct game_rules *rules;	/* classic unless set before batch_start */
+	/* per game */
+	int *id;		/* from 0 to games-1 */
+	int *started;
+	int *month;
+	int *pl_count;
+	int *winner;		/* -1 if nobody has won */
+	int *level;
+	int *sell_n;
+	int *min_price;
+	int *buy_n;
+	int *max_price;
+	int *units_sold;	/* at the last auction */
+	int *min_sold;
+	unsigned long long *rng;
+	/* per player */
+	int *status;
+	int *money;
+	int *material;
+	int *products;
+	int *for_prod;
+	int *factories;
+	int *building[BATCH_BUILD_DAYS];	/* ready in 1, 2, ... months */
+	int *sell_count, *sell_price;	/* price -1 if there is no order */
+	int *buy_count, *buy_price;
+	int *sold;		/* at the last auction */
+	int *bought;
+};
+
+struct batch *batch_new(int games, int pl_n);
+void batch_free(struct batch *b);
+/*game g is seeded with seed+g*/
+void batch_start(struct batch *b, unsigned seed);
+
+/*i is game*pl_n + player; these return -1 if the move is not allowed*/
+int batch_prod(struct batch *b, int i, int n);
+int batch_sell(struct batch *b, int i, int count, int price);
+int batch_buy(struct batch *b, int i, int count, int price);
+int batch_build(struct batch *b, int i);
+
+/*returns the number of games still going on*/
+int batch_month(struct batch *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,706 @@
+/*
+ * Microbenchmarks of the functions of gameserv and gamecore that every
+ * command or month goes through. gameserv.c is built right into this
+ * file, so that its functions can be called one by one on made-up
+ * games; players write to /dev/null. Every benchmark prints the time
+ * and the number of allocations per operation.
+ *
+ * With -s it soaks a room instead: synthetic players send their
+ * commands through the server's own parsing for millions of months and
+ * many games, while the memory of the process is watched.
+ */
+
+#include <stdint.h>
+#include <malloc.h>
+
+#define main gameserv_main
+#include "gameserv.c"
+#undef main
+
+#include <dirent.h>
+
+#define BENCH_NS 200000000LL
+#define BATCH 1000
+#define LIVE_MIN 4096
+#define EXPORT_MONTHS 2000
+#define SOAK_LINES 20
+#define SOAK_GAME_MONTHS 2000
+#define SOAK_GROWTH 1.0		/* bytes a month */
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+int counting = 0;
+long long allocs = 0, t_sum = 0, t_start = 0;
+int null_fd;
+
+/*
+ * While soaking, every block is remembered with the part of the server
+ * that allocated it, so that what stays allocated can be told apart.
+ */
+enum subsystem { sub_commands, sub_month, sub_games, sub_other, subsystems };
+const char *sub_names[] = { "commands", "month", "games", "other" };
+
+struct live_block {
+	void *ptr;
+	size_t size;
+	enum subsystem sub;
+};
+
+int tracking = 0;
+enum subsystem phase = sub_other;
+struct live_block *live = NULL;
+size_t live_cap = 0, live_n = 0;
+long long live_count[subsystems], live_bytes[subsystems];
+
+size_t live_slot(void *ptr)
+{
+	return ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL % live_cap;
+}
+
+void live_put(struct live_block *b)
+{
+	size_t i = live_slot(b->ptr);
+	while (live[i].ptr)
+		i = (i+1) % live_cap;
+	live[i] = *b;
+}
+
+void live_add(void *ptr, size_t size)
+{
+	struct live_block b, *old = live;
+	size_t i, old_cap = live_cap;
+	if (!tracking || !ptr)
+		return;
+	if (2*(live_n+1) > live_cap) {
+		live_cap = live_cap ? live_cap*2 : LIVE_MIN;
+		live = __libc_calloc(live_cap, sizeof(struct live_block));
+		for (i=0; i<old_cap; i++)
+			if (old[i].ptr)
+				live_put(&old[i]);
+		__libc_free(old);
+	}
+	b.ptr = ptr;
+	b.size = size;
+	b.sub = phase;
+	live_put(&b);
+	live_n++;
+	live_count[phase]++;
+	live_bytes[phase] += size;
+}
+
+/*blocks allocated before the soak began are not known, nor counted*/
+void live_remove(void *ptr)
+{
+	size_t i, j, k;
+	if (!live_n || !ptr)
+		return;
+	for (i=live_slot(ptr); live[i].ptr != ptr; i = (i+1) % live_cap)
+		if (!live[i].ptr)
+			return;
+	live_count[live[i].sub]--;
+	live_bytes[live[i].sub] -= live[i].size;
+	live_n--;
+	/*the blocks after the hole move back if their slot allows it*/
+	for (j = (i+1) % live_cap; live[j].ptr; j = (j+1) % live_cap) {
+		k = live_slot(live[j].ptr);
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			live[i] = live[j];
+			i = j;
+		}
+	}
+	live[i].ptr = NULL;
+}
+
+/*only the allocations made while a benchmark is timed are counted*/
+void *malloc(size_t n)
+{
+	void *ptr = __libc_malloc(n);
+	if (counting)
+		allocs++;
+	live_add(ptr, n);
+	return ptr;
+}
+
+void *calloc(size_t n, size_t size)
+{
+	void *ptr = __libc_calloc(n, size);
+	if (counting)
+		allocs++;
+	live_add(ptr, n*size);
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t n)
+{
+	void *new_ptr;
+	if (counting)
+		allocs++;
+	live_remove(ptr);
+	new_ptr = __libc_realloc(ptr, n);
+	live_add(new_ptr, n);
+	return new_ptr;
+}
+
+void free(void *ptr)
+{
+	live_remove(ptr);
+	__libc_free(ptr);
+}
+
+void bench_start(void)
+{
+	counting = 1;
+	t_start = now_ns();
+}
+
+void bench_stop(void)
+{
+	t_sum += now_ns() - t_start;
+	counting = 0;
+}
+
+/*a game of gamecore alone, everybody rich and playing*/
+struct game *bench_game(int n)
+{
+	struct game *g = game_new(n, NULL, NULL);
+	int k;
+	for (k=0; k<n; k++)
+		game_join(g, k);
+	game_start(g, 1);
+	for (k=0; k<n; k++) {
+		g->pl[k].money = 1000000000;
+		g->pl[k].products = 1000000000;
+	}
+	return g;
+}
+
+/*a room of gameserv whose players all subscribed to the delta feed*/
+struct player *bench_room(int n)
+{
+	struct player *p;
+	int k;
+	if (game)
+		game_free(game);
+	free(feed_last);
+	feed_last = NULL;
+	pl_n = n;
+	p = malloc(n*sizeof(struct player));
+	pl_init_all(p);
+	game = game_new(n, game_news, p);
+	for (k=0; k<n; k++) {
+		p[k].sd = null_fd;
+		p[k].subscribed = delta_feed;
+		game_join(game, k);
+	}
+	game_start(game, 1);
+	new_month(p);
+	for (k=0; k<n; k++)
+		game->pl[k].money = 1000000000;
+	return p;
+}
+
+const char *cmd_lines[] = { "turn", "sell 12 5500", "player 7" };
+
+void bench_cmd(int arg, long long *ops)
+{
+	char buf[BUF_SIZE];
+	int i, len = strlen(cmd_lines[arg]);
+	while (t_sum < BENCH_NS) {
+		bench_start();
+		for (i=0; i<BATCH; i++) {
+			char **cmd;
+			memcpy(buf, cmd_lines[arg], len+1);
+			cmd = make_cmd(buf, len+1);
+			delete_cmd(cmd);
+			free(cmd);
+		}
+		bench_stop();
+		*ops += BATCH;
+	}
+}
+
+const char *exec_lines[] = { "prod 0", "market", "player 1", "totals",
+	"nonsense", "history 50" };
+
+void bench_execute(int arg, long long *ops)
+{
+	struct player *p = bench_room(10);
+	char buf[BUF_SIZE];
+	char **cmd;
+	int i, k, len = strlen(exec_lines[arg]);
+	/*every month of the history with a sale or a purchase of everyone*/
+	past_reset();
+	for (i=0; i<PAST_MONTHS; i++) {
+		for (k=0; k<10; k++)
+			past_fill(k, k%2, 2, 500+k);
+		past_month();
+	}
+	memcpy(buf, exec_lines[arg], len+1);
+	cmd = make_cmd(buf, len+1);
+	while (t_sum < BENCH_NS) {
+		bench_start();
+		for (i=0; i<BATCH; i++)
+			execute(p, 0, cmd);
+		bench_stop();
+		*ops += BATCH;
+	}
+	delete_cmd(cmd);
+	free(cmd);
+	free(p);
+}
+
+/*fills the sell queue up to arg orders, one insertion an operation*/
+void bench_accept(int arg, long long *ops)
+{
+	struct game *g = bench_game(arg);
+	int i, max = g->st.max_price;
+	unsigned r = 1;
+	while (t_sum < BENCH_NS) {
+		bench_start();
+		for (i=0; i<arg; i++) {
+			r = r*1103515245 + 12345;
+			game_sell(g, i, 1, max - (r>>16)%100);
+		}
+		bench_stop();
+		*ops += arg;
+		g->st.buy_n = arg;
+		game_auction(g);
+	}
+	game_free(g);
+}
+
+/*
+ * A sale by each of 1000 players for half of the bank's need, arg per
+ * cent of them at the best price and the rest at prices of their own
+ */
+void bench_auction(int arg, long long *ops)
+{
+	int n = 1000, ties = n*arg/100, i;
+	struct game *g = bench_game(n);
+	int max = g->st.max_price;
+	while (t_sum < BENCH_NS) {
+		for (i=0; i<n; i++)
+			game_sell(g, i, 1, i < ties ? 0 : max - n + i);
+		g->st.buy_n = n/2;
+		bench_start();
+		game_auction(g);
+		bench_stop();
+		(*ops)++;
+	}
+	game_free(g);
+}
+
+/*a month of arg players who each sold and bought and made the turn*/
+void bench_end_month(int arg, long long *ops)
+{
+	struct player *p = bench_room(arg);
+	int k;
+	while (t_sum < BENCH_NS) {
+		for (k=0; k<arg; k++) {
+			game->pl[k].money = 1000000000;
+			game->pl[k].products = 2;
+			game_sell(game, k, 2, game->st.max_price - k%100);
+			game_buy(game, k, 2, game->st.min_price + k%100);
+			game_turn(game, k);
+		}
+		bench_start();
+		end_month(p);
+		bench_stop();
+		(*ops)++;
+	}
+	free(p);
+}
+
+void bench_change_level(int arg, long long *ops)
+{
+	struct game *g = bench_game(arg);
+	int i;
+	while (t_sum < BENCH_NS) {
+		bench_start();
+		for (i=0; i<BATCH; i++)
+			game_next_month(g);
+		bench_stop();
+		*ops += BATCH;
+	}
+	game_free(g);
+}
+
+/*the upkeep of 1000 players, by the classic rules or by a copy of them*/
+void bench_accounting(int arg, long long *ops)
+{
+	struct game *g = bench_game(1000);
+	struct game_rules custom = *rules_find("classic");
+	int i, k;
+	custom.set = custom_rules;
+	if (arg)
+		g->rules = &custom;
+	while (t_sum < BENCH_NS) {
+		for (k=0; k<1000; k++) {
+			g->pl[k].status = end_turn;
+			g->pl[k].money = 1000000000;
+			g->pl[k].products = 2;
+		}
+		bench_start();
+		for (i=0; i<BATCH; i++)
+			game_accounting(g);
+		bench_stop();
+		*ops += BATCH;
+	}
+	game_free(g);
+}
+
+void bench_notify_all(int arg, long long *ops)
+{
+	struct player *p = bench_room(arg);
+	while (t_sum < BENCH_NS) {
+		bench_start();
+		notify_all(p, "The month 2 has begun\n");
+		bench_stop();
+		(*ops)++;
+	}
+	free(p);
+}
+
+/*an exporter of -e that writes into a directory of its own*/
+void bench_exporter(char *dir)
+{
+	if (!mkdtemp(dir)) {
+		perror(dir);
+		exit(1);
+	}
+	exp_open(dir);
+	exp_start(1);
+}
+
+void bench_exporter_done(const char *dir)
+{
+	char name[PATH_MAX];
+	struct dirent *e;
+	DIR *d;
+	exporter = NULL;
+	if (!(d = opendir(dir)))
+		return;
+	while ((e = readdir(d)))
+		if (e->d_name[0] != '.') {
+			snprintf(name, sizeof(name), "%s/%s", dir, e->d_name);
+			unlink(name);
+		}
+	closedir(d);
+	rmdir(dir);
+}
+
+/*the next month of a room where every player has left an order*/
+void bench_next_record(int n)
+{
+	int k;
+	for (k=0; k<n; k++) {
+		game->pl[k].money += k;
+		rec_deal(k+1, k%2 ? hist_buy : hist_sell, 2, 5000 - k%100);
+	}
+	month_rec->orders = n;
+	game->month++;
+}
+
+/*
+ * What -e costs the game thread a month. The ring is emptied by hand
+ * instead of by the exporter thread, so that only the copy is timed,
+ * not the exporter's share of the CPU nor the wakeup of a sleeping one.
+ */
+void bench_exp_send(int arg, long long *ops)
+{
+	char dir[] = "/tmp/gamebench.XXXXXX";
+	struct player *p = bench_room(arg);
+	if (!mkdtemp(dir)) {
+		perror(dir);
+		exit(1);
+	}
+	exp_open(dir);
+	exporter->ring = calloc(1, sizeof(struct ring));
+	while (t_sum < BENCH_NS) {
+		bench_next_record(arg);
+		exporter->ring->tail = exporter->ring->head;
+		bench_start();
+		rec_month();
+		exp_send();
+		bench_stop();
+		(*ops)++;
+	}
+	free(exporter->ring);
+	bench_exporter_done(dir);
+	free(p);
+}
+
+/*months through the exporter into its files, a month an operation*/
+void bench_export(int arg, long long *ops)
+{
+	char dir[] = "/tmp/gamebench.XXXXXX";
+	struct player *p = bench_room(arg);
+	int i;
+	bench_exporter(dir);
+	bench_start();
+	for (i=0; i<EXPORT_MONTHS; i++) {
+		bench_next_record(arg);
+		rec_month();
+		exp_send();
+	}
+	exp_close();
+	bench_stop();
+	*ops = EXPORT_MONTHS;
+	bench_exporter_done(dir);
+	free(p);
+}
+
+/*the commands of a synthetic player, sloppy spacing and all*/
+int soak_commands(int k, char *buf)
+{
+	struct firm *f = &game->pl[k];
+	int len, to_prod = f->material < 2 ? f->material : 2;
+	len = sprintf(buf, "prod %d\nsell %d %d\nbuy  2 %d\n", to_prod,
+		f->products, game->st.max_price - k%7, game->st.min_price);
+	if (f->money >= 20000)
+		len += sprintf(buf+len, "build\n");
+	switch ((game->month + k) % 4) {
+	case 0:		len += sprintf(buf+len, "market\n"); break;
+	case 1:		len += sprintf(buf+len, "totals\n"); break;
+	case 2:		len += sprintf(buf+len, "player %d\n", k+1); break;
+	}
+	len += sprintf(buf+len, game->month % 3 ? "turn\n" : "turn  \r\n");
+	return len;
+}
+
+struct soak_sample {
+	long long month;
+	long long rss, in_use, live;
+};
+
+void soak_measure(struct soak_sample *m, long long month)
+{
+	struct mallinfo2 mi = mallinfo2();
+	long rss = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	int i;
+	if (!f || fscanf(f, "%*d %ld", &rss) != 1)
+		rss = 0;
+	if (f)
+		fclose(f);
+	m->month = month;
+	m->rss = rss * sysconf(_SC_PAGESIZE);
+	m->in_use = mi.uordblks;
+	m->live = 0;
+	for (i=0; i<subsystems; i++)
+		m->live += live_bytes[i];
+}
+
+void soak_print(struct soak_sample *m, int games)
+{
+	int i;
+	printf("%10lld %7d %10lld %10lld", m->month, games, m->rss/1024,
+		m->in_use/1024);
+	for (i=0; i<subsystems; i++)
+		printf(" %8lld/%-8lld", live_count[i], live_bytes[i]);
+	printf("\n");
+}
+
+double growth(long long from, long long to, struct soak_sample *a,
+	struct soak_sample *b)
+{
+	return (double)(to - from) / (b->month - a->month);
+}
+
+/*
+ * Plays month after month and game after game, and measures at the
+ * start of every game, when a room holds the same whatever went before.
+ * Fails if the memory grows after the first tenth of the months.
+ */
+int soak(long long months, int n)
+{
+	struct player *p;
+	struct soak_sample warm = { 0 }, last = { 0 }, now;
+	long long done = 0, next_line = 0;
+	int k, games = 0, warmed = 0;
+	double g_rss, g_use, g_live;
+	pl_n = n;
+	p = malloc(n*sizeof(struct player));
+	pl_init_all(p);
+	game = game_new(n, game_news, p);
+	printf("%10s %7s %10s %10s", "month", "games", "rss KB", "heap KB");
+	for (k=0; k<subsystems; k++)
+		printf(" %17s", sub_names[k]);
+	printf("\n");
+	tracking = 1;
+	while (done < months) {
+		soak_measure(&now, done);
+		if (!warmed && done >= months/10) {
+			warm = now;
+			warmed = 1;
+		}
+		if (warmed)
+			last = now;
+		if (done >= next_line) {
+			soak_print(&now, games);
+			next_line = done + months/SOAK_LINES;
+		}
+		phase = sub_games;
+		for (k=0; k<n; k++)
+			join(p, open("/dev/null", O_WRONLY));
+		games++;
+		while (game->started && done < months) {
+			phase = sub_commands;
+			for (k=0; k<n; k++) {
+				if (game->pl[k].status != play)
+					continue;
+				p[k].pos = soak_commands(k, p[k].buf);
+				run_commands(p, k);
+			}
+			phase = sub_month;
+			if (!game_waiting(game)) {
+				end_month(p);
+				done++;
+			}
+			/*clever games may never end*/
+			phase = sub_games;
+			if (game->started && game->month > SOAK_GAME_MONTHS) {
+				for (k=0; k<n; k++)
+					if (game->pl[k].status != off)
+						leave(p, k);
+				reset_game(p);
+			}
+		}
+	}
+	tracking = 0;
+	soak_measure(&now, done);
+	soak_print(&now, games);
+	if (!warmed || last.month == warm.month) {
+		printf("too few games to tell\n");
+		return 1;
+	}
+	g_rss = growth(warm.rss, last.rss, &warm, &last);
+	g_use = growth(warm.in_use, last.in_use, &warm, &last);
+	g_live = growth(warm.live, last.live, &warm, &last);
+	printf("growth from month %lld to %lld: rss %.3f, heap %.3f, "
+		"live %.3f bytes/month\n", warm.month, last.month, g_rss, g_use,
+		g_live);
+	if (g_rss > SOAK_GROWTH || g_use > SOAK_GROWTH
+		|| g_live > SOAK_GROWTH) {
+		printf("FAIL: memory grows\n");
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
+
+/*
+ * Several orders pipelined into one buffer, read whole and cut at every
+ * byte in two reads: every one of them has to be accepted. Returns the
+ * number of the cuts that went wrong.
+ */
+int check_pipelined(void)
+{
+	const char orders[] = "sell 1 5500\nbuy 2 600\nsell 1 5400 \n"
+		"buy 1 700\n";
+	char out[4096], *s;
+	struct player *p;
+	int cut, fd[2], n, accepted, bad = 0;
+	for (cut=0; cut<(int)sizeof(orders)-1; cut++) {
+		p = bench_room(2);
+		if (pipe(fd) == -1) {
+			perror("pipe");
+			exit(1);
+		}
+		p[0].sd = fd[1];
+		memcpy(p[0].buf, orders, cut);
+		p[0].pos = cut;
+		run_commands(p, 0);
+		memcpy(p[0].buf + p[0].pos, orders + cut,
+			sizeof(orders)-1 - cut);
+		p[0].pos += sizeof(orders)-1 - cut;
+		run_commands(p, 0);
+		close(fd[1]);
+		n = read(fd[0], out, sizeof(out)-1);
+		close(fd[0]);
+		out[n > 0 ? n : 0] = '\0';
+		accepted = 0;
+		for (s=out; (s = strstr(s, "Accepted.\n")); s++)
+			accepted++;
+		if (accepted != 4 || strstr(out, "Syntax error!")) {
+			printf("cut at %d: %d of 4 accepted\n%s", cut,
+				accepted, out);
+			bad++;
+		}
+		free(p);
+	}
+	return bad;
+}
+
+struct bench {
+	const char *name;
+	void (*fn)(int, long long *);
+	int arg;
+	const char *what;
+} benches[] = {
+	{ "make_cmd", bench_cmd, 0, "turn" },
+	{ "make_cmd", bench_cmd, 1, "sell 12 5500" },
+	{ "make_cmd", bench_cmd, 2, "player 7" },
+	{ "execute", bench_execute, 0, "prod 0" },
+	{ "execute", bench_execute, 1, "market" },
+	{ "execute", bench_execute, 2, "player 1" },
+	{ "execute", bench_execute, 3, "totals" },
+	{ "execute", bench_execute, 4, "nonsense" },
+	{ "execute", bench_execute, 5, "history 50" },
+	{ "accept_request", bench_accept, 10, "queue 10" },
+	{ "accept_request", bench_accept, 100, "queue 100" },
+	{ "accept_request", bench_accept, 1000, "queue 1000" },
+	{ "auction", bench_auction, 0, "1000 orders, no ties" },
+	{ "auction", bench_auction, 10, "1000 orders, 10% tie" },
+	{ "auction", bench_auction, 50, "1000 orders, 50% tie" },
+	{ "auction", bench_auction, 100, "1000 orders, all tie" },
+	{ "end_month", bench_end_month, 10, "10 players" },
+	{ "end_month", bench_end_month, 100, "100 players" },
+	{ "end_month", bench_end_month, 1000, "1000 players" },
+	{ "change_level", bench_change_level, 2, "2 players" },
+	{ "change_level", bench_change_level, 1000, "1000 players" },
+	{ "accounting", bench_accounting, 0, "classic rules" },
+	{ "accounting", bench_accounting, 1, "custom rules" },
+	{ "notify_all", bench_notify_all, 10, "10 players" },
+	{ "notify_all", bench_notify_all, 100, "100 players" },
+	{ "notify_all", bench_notify_all, 1000, "1000 players" },
+	{ "exp_send", bench_exp_send, 10, "10 players" },
+	{ "exp_send", bench_exp_send, 1000, "1000 players" },
+	{ "export", bench_export, 10, "10 players" },
+	{ "export", bench_export, 1000, "1000 players" },
+	{ NULL, NULL, 0, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	struct bench *b;
+	long long ops;
+	if (argc > 2 && strcmp(argv[1], "-s") == 0)
+		return soak(atoll(argv[2]), argc > 3 ? atoi(argv[3]) : 4);
+	if ((null_fd = open("/dev/null", O_WRONLY)) == -1) {
+		perror("/dev/null");
+		exit(1);
+	}
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		if (check_pipelined()) {
+			printf("FAIL: pipelined orders are lost\n");
+			return 1;
+		}
+		printf("ok\n");
+		return 0;
+	}
+	printf("%-16s %-24s %12s %12s\n", "function", "input", "ns/op",
+		"allocs/op");
+	for (b=benches; b->name; b++) {
+		if (argc > 1 && strcmp(argv[1], b->name) != 0)
+			continue;
+		ops = allocs = t_sum = 0;
+		b->fn(b->arg, &ops);
+		printf("%-16s %-24s %12.1f %12.2f\n", b->name, b->what,
+			(double)t_sum/ops, (double)allocs/ops);
+	}
+	return 0;
+}
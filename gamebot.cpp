@@ -4,9 +4,18 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include "gamering.h"
 
 enum type_t { no, num, k, id, str };
 const char *types[] = { "null", "number", "key", "identifier", "string" };
@@ -22,6 +31,7 @@ struct Lexem {
 	Lexem(const char *s, unsigned l, type_t t) : line(l), type(t)
 		{ str = new char[strlen(s)+1]; strcpy(str, s); }
 	Lexem(const Lexem& L);
+	Lexem& operator=(const Lexem& L);
 	~Lexem() { delete[] str; }
 	bool operator==(const char *s) { return (strcmp(str, s) == 0); }
 	bool operator!=(const char *s) { return (strcmp(str, s) != 0); }
@@ -162,6 +172,18 @@ struct auction_list {
 	auction_list *next;
 };
 
+/* a month of the server's history: its market and its auction */
+struct PastMonth {
+	int month;
+	int level;
+	int sell_n;
+	int min_price;
+	int buy_n;
+	int max_price;
+	int dropped;		/* fills the server left out of the month */
+	auction_list *fills;
+};
+
 class Player {
 protected:
 	int number;
@@ -181,17 +203,39 @@ public:
 	int GetFactories() const { return factories; }
 	int GetMaterial() const { return material; }
 	int GetNumber() const { return number; }
+	int GetBuilding() const { return building_factories; }
 	bool IsTurning() const { return makes_turn; }
 	void Print();
 	~Player() {}
 };
 	
-const int in_buf_size = 1024;
+const int in_buf_size = 65536;
 const int out_buf_size = 32;
 
+/* sum, min and max of every player field, then the last auction */
+const char *total_names[] = {
+	"?sum_money", "?min_money", "?max_money",
+	"?sum_production", "?min_production", "?max_production",
+	"?sum_material", "?min_material", "?max_material",
+	"?sum_factories", "?min_factories", "?max_factories",
+	"?sum_building", "?min_building", "?max_building",
+	"?units_sold", "?min_sold_price", "?max_sold_price",
+	"?units_bought", "?min_bought_price", "?max_bought_price", 0 };
+enum { totals_n = 21 };
+
+/* the market of a month back, then what a player got at its auction */
+const char *past_names[] = {
+	"?history_level", "?history_supply", "?history_material_price",
+	"?history_demand", "?history_production_price", "?history_dropped",
+	"?history_sold", "?history_sold_price",
+	"?history_bought", "?history_bought_price", 0 };
+enum { past_market_n = 6 };
+const int past_months = 100;	/* the most the server keeps */
+
 enum finished { not_yet, victory, defeat };
 class Robot: public Player {
 	int sd;
+	ring_pair *rings;
 	int position;
 	int turn;
 	int players_n;
@@ -199,16 +243,24 @@ class Robot: public Player {
 	auction_list *yesterday_auc;
 	Player **today_players, **yesterday_players;
 	Status *today_market;
+	int totals[totals_n];
+	int totals_turn;
+	PastMonth *past;
+	int past_n, past_asked, past_turn;
 	char in_buf[in_buf_size];
 	char out_buf[out_buf_size];
 public:
-	Robot(int fd, int n, int k): Player(n), sd(fd), position(0),
-		turn(1), players_n(k), is_finished(not_yet),
-		yesterday_auc(0), today_players(0), yesterday_players(0),
-		today_market(0)
+	Robot(int fd, int n, int k, bool shm = false): Player(n), sd(fd),
+		rings(0), position(0), turn(1), players_n(k),
+		is_finished(not_yet), yesterday_auc(0), today_players(0),
+		yesterday_players(0), today_market(0), totals_turn(0),
+		past(0), past_n(0), past_asked(0), past_turn(0)
 	{
+		memset(totals, 0, sizeof(totals));
 		memset(in_buf, 0, in_buf_size);
 		memset(out_buf, 0, out_buf_size);
+		if (shm)
+			UseRings();
 		Run();
 	}
 	void Produce(int k) { Send("prod", k); Update(); }
@@ -216,10 +268,10 @@ public:
 	void Sell(int k, int price) { Send("sell", k, price); Update(); }
 	void Build() { Send("build"); Update(); }
 	void EndTurn();
-	Status* MarketSituation();
 	Player* PlayerInfo(int number);
-	Player** AllPlayersInfo();
-	auction_list* AuctionResults();
+	int Total(int i);
+	int History(int n);
+	const PastMonth* Past(int k);
 	void Update();
 	void DeleteAuc(auction_list *ptr);
 	int GetTurn() const { return turn; }
@@ -232,10 +284,18 @@ public:
 private:
 	void Send(const char *command, int arg1 = 0, int arg2 = 0);
 	char* Recieve(const char *str1, const char *str2 = 0);
+	void ReadMore();
+	int ReadRing();
+	void UseRings();
 	void ShiftBuf(int from);
 	void DeletePlayersInfo(Player **p);
+	void DeleteHistory();
 	void Run();
-	void NewMonth();
+	void ReadDigest();
+	void Adopt(const Player *p);
+	char* ParseDigestPlayer(char *line, Player **players);
+	char* ParseDeltaPlayer(char *line, Player **players, bool *lost);
+	auction_list* ParseDigestAuction(char *line);
 };
 
 class IPNElem;
@@ -262,7 +322,7 @@ class SyntaxAnalizer {
 public:
 	SyntaxAnalizer(lexem_list *l): list(l), current(*list->l)
 		{ first = new IPNItem; cur_cmd = &first; }
-	void Run() { CompoundStatement(); printf("OK\n"); }
+	void Run() { CompoundStatement(); printf("OK\n"); fflush(stdout); }
 	IPNItem* GetIPN() { return first; }
 private:
 	void Next();
@@ -933,6 +993,20 @@ public:
 	virtual ~IPNFuncIsFinished() {}
 };
 
+class IPNFuncTotal: public IPNOperation {
+	int index;
+public:
+	IPNFuncTotal(int i): index(i) {}
+	virtual void Print() { printf("%s", total_names[index]); }
+	virtual IPNElem*
+		DoOperation(IPNItem **stack, VariableTable *vt,
+			Robot& bot) const
+	{
+		return new IPNInt(bot.Total(index));
+	}
+	virtual ~IPNFuncTotal() {}
+};
+
 class IPNFunc1: public IPNOperation {
 public:
 	virtual ~IPNFunc1() {}
@@ -951,6 +1025,84 @@ public:
 	}
 };
 
+class IPNFunc2: public IPNOperation {
+public:
+	virtual ~IPNFunc2() {}
+	virtual Int Perform(Robot& bot, Int op1, Int op2) const = 0;
+	virtual IPNElem*
+		DoOperation(IPNItem **stack, VariableTable *vt,
+			Robot& bot) const
+	{
+		IPNElem *operand2 = Pop(stack);
+		IPNInt *op2 = dynamic_cast<IPNInt*>(operand2);
+		if (!op2)
+			throw IPNExNotInt(operand2);
+		IPNElem *operand1 = Pop(stack);
+		IPNInt *op1 = dynamic_cast<IPNInt*>(operand1);
+		if (!op1)
+			throw IPNExNotInt(operand1);
+		Int res = Perform(bot, op1->Get(), op2->Get());
+		delete operand1;
+		delete operand2;
+		return new IPNInt(res);
+	}
+};
+
+class IPNFuncHistory: public IPNFunc1 {
+/* asks for the last op months at once, gives how many there are */
+public:
+	virtual void Print() { printf("?history"); }
+	virtual Int Perform(Robot& bot, Int op) const
+	{
+		return bot.History(op);
+	}
+	virtual ~IPNFuncHistory() {}
+};
+
+class IPNFuncPastMarket: public IPNFunc1 {
+/* op months back, 1 being the last auction */
+	int index;
+public:
+	IPNFuncPastMarket(int i): index(i) {}
+	virtual void Print() { printf("%s", past_names[index]); }
+	virtual Int Perform(Robot& bot, Int op) const
+	{
+		const PastMonth *m = bot.Past(op);
+		if (!m)
+			return 0;
+		switch (index) {
+		case 0:		return m->level;
+		case 1:		return m->sell_n;
+		case 2:		return m->min_price;
+		case 3:		return m->buy_n;
+		case 4:		return m->max_price;
+		default:	return m->dropped;
+		}
+	}
+	virtual ~IPNFuncPastMarket() {}
+};
+
+class IPNFuncPastFill: public IPNFunc2 {
+/* items and the price of one that player op2 got op1 months back */
+	int index;
+public:
+	IPNFuncPastFill(int i): index(i) {}
+	virtual void Print() { printf("%s", past_names[index]); }
+	virtual Int Perform(Robot& bot, Int op1, Int op2) const
+	{
+		const PastMonth *m = bot.Past(op1);
+		auc_act act = index < past_market_n+2 ? sold : bought;
+		bool price = (index - past_market_n) % 2 == 1;
+		for (auction_list *a = m ? m->fills : 0; a; a = a->next) {
+			if (a->auc->player == op2 && a->auc->action == act)
+				return price ? a->auc->cost/a->auc->ammount
+					: a->auc->ammount;
+		}
+		return 0;
+	}
+	virtual ~IPNFuncPastFill() {}
+};
+
 class IPNFuncMoney: public IPNFunc1 {
 public:
 	virtual void Print() { printf("?money"); }
@@ -1022,7 +1174,7 @@ public:
 			return 0;
 		Player *yest = (bot.GetYesterdayPlayers())[op-1];
 		Player *today = (bot.GetTodayPlayers())[op-1];
-		if (today) {
+		if (today && yest) {
 			Int old = yest->GetProducts();
 			Int new_a = today->GetProducts();
 			return new_a-old;
@@ -1122,18 +1274,22 @@ enum {bufsize = 128};
 int take_a_number(int sd, int *players_n)
 {
 	char buf[bufsize];
-	unsigned int n, k, rc;
-	const char *greeting;
-	rc = read(sd, buf, bufsize);
-	if (1 != sscanf(buf, greeting = "Welcome to my game!\n"
+	unsigned int n, k, rc = 0;
+	int len;
+	// the greeting may come in pieces
+	do {
+		if ((len = read(sd, buf+rc, bufsize-rc-1)) <= 0)
+			throw "can't join the game\n";
+		rc += len;
+		buf[rc] = '\0';
+	} while (!strstr(buf, "players\n") && rc < bufsize-1);
+	if (1 != sscanf(buf, "Welcome to my game!\n"
 		"Your number is %d\n"
 		"Type 'help' to get help\n",
-		&n))
+		&n) || !strstr(buf, "help\n"))
 	{
 		throw "can't join the game\n";
 	}
-	if (rc <= strlen(greeting))
-		read(sd, buf+rc, bufsize-rc);
 	if (2 != sscanf(strstr(buf, "help\n")+strlen("help\n"),
 		"Now there are %d/%d players",
 		&k, players_n))
@@ -1145,26 +1301,40 @@ int take_a_number(int sd, int *players_n)
 
 
 
-int validate(int argc, char **argv, sockaddr_in *addr)
+/* returns the index of the script in argv */
+int validate(int argc, char **argv, sockaddr_in *addr, sockaddr_un *uaddr)
 {
-	bool is_number(const char *);
+	int is_number(const char *);
+	const char *prefix = argc>=2 && strncmp(argv[1], "shm:", 4) == 0 ?
+		"shm:" : "unix:";
+	if (argc>=3 && strncmp(argv[1], prefix, strlen(prefix)) == 0) {
+		const char *path = argv[1]+strlen(prefix);
+		if (*path && strlen(path) < sizeof(uaddr->sun_path)) {
+			uaddr->sun_family = AF_UNIX;
+			strcpy(uaddr->sun_path, path);
+			return 2;
+		}
+	}
 	if (argc<4 || !inet_aton(argv[1], &(addr->sin_addr))
 		|| !is_number(argv[2]))
 	{
-		fprintf(stderr, "Usage: %s ip port file\n", argv[0]);
+		fprintf(stderr, "Usage: %s ip port file [pool]\n"
+			"       %s unix:/path file [pool]\n"
+			"       %s shm:/path file [pool]\n",
+			argv[0], argv[0], argv[0]);
 		exit(1);
 	}
 	addr->sin_family = AF_INET;
 	addr->sin_port = htons(atoi(argv[2]));
-	return 0;
+	return 3;
 }
 	
-int create_connection(sockaddr_in *addr)
+int create_connection(sockaddr *addr, socklen_t len)
 {
-	int sd = socket(AF_INET, SOCK_STREAM, 0);
+	int sd = socket(addr->sa_family, SOCK_STREAM, 0);
 	if (sd == -1)
 		throw "can't create socket\n";
-	if (connect(sd, (sockaddr *)addr, sizeof(*addr)) == -1)
+	if (connect(sd, addr, len) == -1)
 		throw "can't connect to the server\n";
 	return sd;
 }
@@ -1253,13 +1423,23 @@ void play_scenario(Robot& robot, const char *file)
 int main(int argc, char **argv)
 {
 	sockaddr_in addr;
+	sockaddr_un uaddr;
 	try {
-		validate(argc, argv, &addr);
-		int sd = create_connection(&addr);
+		int script = validate(argc, argv, &addr, &uaddr);
+		int sd = script == 2 ?
+			create_connection((sockaddr *)&uaddr, sizeof(uaddr)) :
+			create_connection((sockaddr *)&addr, sizeof(addr));
 		int players_n;
+		/* a matchmaking server seats the bot with its pool */
+		if (argc > script+1) {
+			char tag[64];
+			int len = snprintf(tag, sizeof(tag), "tag %s\n",
+				argv[script+1]);
+			write(sd, tag, len);
+		}
 		int num = take_a_number(sd, &players_n);
-		Robot robot(sd, num, players_n);
-		play_scenario(robot, argv[3]);
+		Robot robot(sd, num, players_n, strncmp(argv[1], "shm:", 4) == 0);
+		play_scenario(robot, argv[script]);
 	}
 	catch (const char *s) {
 		fprintf(stderr, "%s", s);
@@ -1276,6 +1456,19 @@ Lexem::Lexem(const Lexem& l)
 	type = l.type;
 }
 
+Lexem& Lexem::operator=(const Lexem& l)
+{
+	if (this != &l) {
+		char *s = new char[strlen(l.str)+1];
+		strcpy(s, l.str);
+		delete[] str;
+		str = s;
+		line = l.line;
+		type = l.type;
+	}
+	return *this;
+}
+
 Lexem* LexicalAnalizer::GetLexem()
 {
 	bool tmp = is_ready;
@@ -1687,7 +1880,8 @@ void SyntaxAnalizer::RelationExpression()
 void SyntaxAnalizer::RelExpr()
 {
 	if (IsRel()) {
-		const char *s = current.str;
+		Lexem op(current);
+		const char *s = op.str;
 		Next();
 		SumExpression();
 		if (strcmp(s, "==") == 0)
@@ -1804,7 +1998,8 @@ void SyntaxAnalizer::PrimeExpression()
 
 void SyntaxAnalizer::FunctionCall()
 {
-	char *s = current.str;
+	Lexem name(current);
+	const char *s = name.str;
 	Next();
 	if (current != "(")
 		throw Error(no_paren, current.line);
@@ -1849,8 +2044,26 @@ void SyntaxAnalizer::FunctionCall()
 		NewCmd(new IPNFuncResultProdSold);
 	else if (strcmp(s, "?result_prod_price") == 0)
 		NewCmd(new IPNFuncResultProdPrice);
-	else
-		throw Error(nonexistent_function, current.line);
+	else if (strcmp(s, "?history") == 0)
+		NewCmd(new IPNFuncHistory);
+	else if (strncmp(s, "?history_", strlen("?history_")) == 0) {
+		int i;
+		for (i=0; past_names[i] && strcmp(s, past_names[i]); i++)
+			;
+		if (!past_names[i])
+			throw Error(nonexistent_function, current.line);
+		if (i < past_market_n)
+			NewCmd(new IPNFuncPastMarket(i));
+		else
+			NewCmd(new IPNFuncPastFill(i));
+	} else {
+		int i;
+		for (i=0; total_names[i] && strcmp(s, total_names[i]); i++)
+			;
+		if (!total_names[i])
+			throw Error(nonexistent_function, current.line);
+		NewCmd(new IPNFuncTotal(i));
+	}
 }
 
 void SyntaxAnalizer::ArgList()
@@ -1980,6 +2193,14 @@ void Robot::Send(const char *command, int arg1, int arg2)
 		}
 	}
 	strcat(out_buf, "\n");
+	if (rings) {
+		while (!ring_write(&rings->in, out_buf, strlen(out_buf)))
+			sched_yield();
+		/*the server has gone to sleep in poll, so ring its socket*/
+		if (ring_sleeping(&rings->in))
+			write(sd, "\n", 1);
+		return;
+	}
 	write(sd, out_buf, strlen(out_buf));
 }
 	
@@ -2005,16 +2226,23 @@ char* Robot::Recieve(const char *str1, const char *str2)
 				is_finished = victory;
 				return 0;
 			}
-			int rc = read(sd, in_buf+position,
-				in_buf_size-position);
-			position += rc;
-			in_buf[position] = '\0';
+			ReadMore();
 		}
 	}
 	ShiftBuf(ptr-in_buf+strlen(str1));
 	return in_buf;
 }
 
+void Robot::ReadMore()
+{
+	int rc = rings ? ReadRing() :
+		read(sd, in_buf+position, in_buf_size-position-1);
+	if (rc <= 0)
+		throw "Connection closed\n";
+	position += rc;
+	in_buf[position] = '\0';
+}
+
 void Player::Print()
 {
 	printf("Player %d has: dollars product material factories "
@@ -2056,6 +2284,115 @@ Player* Robot::PlayerInfo(int n)
 	return 0;
 }
 
+int Robot::Total(int i)
+/* the server counts them once a month, so ask once a turn */
+{
+	const char *end_mark = "End of totals\n";
+	char *end, *line;
+	if (totals_turn == turn)
+		return totals[i];
+	Send("totals");
+	if (!Recieve("Totals of month %"))
+		return 0;
+	while (!(end = strstr(in_buf, end_mark)))
+		ReadMore();
+	*end = '\0';
+	line = in_buf;
+	for (int k=0; k<totals_n; k+=3) {
+		if (!(line = strstr(line, "\n%")) ||
+			3 != sscanf(line, "\n%% %*s %d %d %d", &totals[k],
+				&totals[k+1], &totals[k+2]))
+		{
+			throw "Error in totals\n";
+		}
+		line++;
+	}
+	ShiftBuf(end-in_buf+strlen(end_mark));
+	totals_turn = turn;
+	return totals[i];
+}
+
+int Robot::History(int n)
+/* the server keeps the months written out, so one question gets them all;
+ * they are taken line by line as they come, the buffer may not hold them */
+{
+	const char *end_mark = "End of history\n";
+	auction_list **last = 0;
+	char *line, *eol;
+	int pl, ammo, price;
+	char act;
+	bool done = false;
+	if (n < 1)
+		return 0;
+	if (n > past_months)
+		n = past_months;
+	if (past_turn == turn && past_asked >= n)
+		return past_n < n ? past_n : n;
+	Send("history", n);
+	if (!Recieve("History of the last months\n"))
+		return 0;
+	DeleteHistory();
+	past = new PastMonth[n];
+	while (!done) {
+		for (line = in_buf; !done && (eol = strchr(line, '\n'));
+			line = eol+1)
+		{
+			if (strncmp(line, end_mark, strlen(end_mark)) == 0) {
+				done = true;
+			} else
+			if (*line == '%') {
+				if (past_n == n)
+					throw "Error in history\n";
+				PastMonth *m = &past[past_n];
+				m->dropped = 0;
+				if (6 > sscanf(line,
+					"%% %d %d %d %d %d %d %d", &m->month,
+					&m->level, &m->sell_n, &m->min_price,
+					&m->buy_n, &m->max_price, &m->dropped))
+				{
+					throw "Error in history\n";
+				}
+				m->fills = 0;
+				last = &m->fills;
+				past_n++;
+			} else
+			if (last && 4 == sscanf(line, "%c%d %d %d", &act, &pl,
+				&ammo, &price))
+			{
+				*last = new auction_list;
+				(*last)->auc = new Auction(pl,
+					act=='s' ? sold : bought, ammo, ammo*price);
+				(*last)->next = 0;
+				last = &(*last)->next;
+			} else
+				throw "Error in history\n";
+		}
+		ShiftBuf(line-in_buf);
+		if (!done)
+			ReadMore();
+	}
+	past_asked = n;
+	past_turn = turn;
+	return past_n;
+}
+
+const PastMonth* Robot::Past(int k)
+/* k months back, 1 being the last auction; 0 if the game is younger */
+{
+	if (k < 1 || History(k) < k)
+		return 0;
+	return &past[past_n-k];
+}
+
+void Robot::DeleteHistory()
+{
+	for (int i=0; i<past_n; i++)
+		DeleteAuc(past[i].fills);
+	delete[] past;
+	past = 0;
+	past_n = 0;
+}
+
 void Robot::Update()
 {
 	Send("player", number);
@@ -2074,25 +2411,6 @@ void Robot::Update()
 	}
 }
 	
-Status* Robot::MarketSituation()
-{
-	Status *st = new Status;
-	Send("market");
-	Recieve("Current month is %");
-	if (1 != sscanf(in_buf, "%d", &st->month))
-		throw "Error in market\n";
-	Recieve("%");
-	if (1 != sscanf(in_buf, "%d", &st->pl_count))
-		throw "Error in market\n";
-	Recieve("%");
-	if (2 != sscanf(in_buf, "%d %d", &st->sell_n, &st->min_price))
-		throw "Error in market\n";
-	Recieve("%");
-	if (2 != sscanf(in_buf, "%d %d", &st->buy_n, &st->max_price))
-		throw "Error in market\n";
-	return st;
-}
-
 void Status::Print()
 {
 	printf("Current month is %d\n"
@@ -2122,32 +2440,6 @@ void Auction::Print()
 		"materials and spent", cost);
 }
 
-auction_list* Robot::AuctionResults()
-{
-	auction_list *first = 0, **last = &first;
-	int pl, ammo, mon;
-	while (Recieve("#", "The month")) {
-		if (3 == sscanf(in_buf, " Player %d sold %d products"
-			" and gained %d dollars\n", &pl, &ammo, &mon))
-		{
-			*last = new auction_list;
-			(*last)->auc = new Auction(pl, sold, ammo, mon);
-			(*last)->next = 0;
-			last = &(*last)->next;
-		} else
-		if (3 == sscanf(in_buf, " Player %d bought %d materials "
-			"and spent %d dollars\n", &pl, &ammo, &mon))
-		{
-			*last = new auction_list;
-			(*last)->auc = new Auction(pl, bought, ammo, mon);
-			(*last)->next = 0;
-			last = &(*last)->next;
-		} else
-			break;
-	}
-	return first;
-}
-			 
 void Robot::DeleteAuc(auction_list *ptr)
 {
 	if (ptr) {
@@ -2174,47 +2466,243 @@ void Robot::EndTurn()
 {
 	Send("turn");
 	makes_turn = false;
-	yesterday_auc = AuctionResults();
 	++turn;
-	if (is_finished == not_yet) {
-		Update();
-		DeletePlayersInfo(yesterday_players);
-		yesterday_players = today_players;
-		NewMonth();
-	} else if (is_finished == victory)
+	ReadDigest();
+	if (is_finished == victory)
 		printf("I am awesome\n");
-	else
+	else if (is_finished == defeat)
 		printf("I am loser\n");
 }
 
-void Robot::NewMonth()
-{
-	today_players = AllPlayersInfo();
-	today_market = MarketSituation();
-}
-
 void Robot::DeletePlayersInfo(Player **p)
 {
-	if (yesterday_players) {
+	if (p) {
 		for (int i=0; i<players_n; i++)
-			delete yesterday_players[i];
-		delete[] yesterday_players;
+			delete p[i];
+		delete[] p;
 	}
 }
 
-Player** Robot::AllPlayersInfo()
+/*
+ * The server pushes the state of the game at the start of every month,
+ * so nothing has to be asked for player by player. Most months only the
+ * changes since the previous month are sent.
+ */
+void Robot::ReadDigest()
 {
-	Player** players = new Player*[players_n];
+	const char *end_mark = "End of digest\n";
+	char *end, *line, kind[8] = "";
+	if (!Recieve("Digest of month %"))
+		return;
+	while (!(end = strstr(in_buf, end_mark)))
+		ReadMore();
+	*end = '\0';
+	Status *st = new Status;
+	line = in_buf;
+	if (1 > sscanf(line, "%d%7[^\n]", &st->month, kind) ||
+		!(line = strchr(line, '\n')) ||
+		5 != sscanf(line, "\n%% %d %d %d %d %d", &st->pl_count,
+			&st->sell_n, &st->min_price, &st->buy_n,
+			&st->max_price))
+	{
+		throw "Error in digest\n";
+	}
+	line = strchr(line+1, '\n')+1;
+	bool delta = strcmp(kind, " delta") == 0;
+	Player **players = new Player*[players_n];
 	for (int i=0; i<players_n; i++) {
-		players[i] = PlayerInfo(i+1);
+		if (delta && today_players && today_players[i])
+			players[i] = new Player(*today_players[i]);
+		else
+			players[i] = 0;
+	}
+	bool lost = false;
+	if (delta) {
+		while (isdigit(*line))
+			line = ParseDeltaPlayer(line, players, &lost);
+	} else {
+		while (strncmp(line, "Player ", strlen("Player ")) == 0)
+			line = ParseDigestPlayer(line, players);
+	}
+	if (lost) {
+		/* changes of a player never seen, so the whole digest */
+		DeletePlayersInfo(players);
+		delete st;
+		ShiftBuf(end-in_buf+strlen(end_mark));
+		Send("snapshot");
+		ReadDigest();
+		return;
+	}
+	DeleteAuc(yesterday_auc);
+	yesterday_auc = ParseDigestAuction(line);
+	DeletePlayersInfo(yesterday_players);
+	yesterday_players = today_players;
+	today_players = players;
+	delete today_market;
+	today_market = st;
+	ShiftBuf(end-in_buf+strlen(end_mark));
+}
+
+char* Robot::ParseDigestPlayer(char *line, Player **players)
+{
+	int n, mon, prod, mat, fact, build;
+	char mt;
+	if (1 != sscanf(line, "Player %d", &n) || n<1 || n>players_n)
+		throw "Error in digest\n";
+	if (6 == sscanf(line, "Player %*d %% %d %d %d %d %d %c",
+		&mon, &prod, &mat, &fact, &build, &mt))
+	{
+		players[n-1] = new Player(n, mon, prod, mat, fact, build,
+			mt=='y');
+		if (n == number)
+			Adopt(players[n-1]);
+	}
+	return strchr(line, '\n')+1;
+}
+
+/* sets *lost if the line changes a player whose fields are not known */
+char* Robot::ParseDeltaPlayer(char *line, Player **players, bool *lost)
+{
+	int n, k, told = 0;
+	char tok[16];
+	bool gone = false;
+	if (1 != sscanf(line, "%d%n", &n, &k) || n<1 || n>players_n)
+		throw "Error in digest\n";
+	Player *old = players[n-1];
+	int mon = old ? old->GetMoney() : 0;
+	int prod = old ? old->GetProducts() : 0;
+	int mat = old ? old->GetMaterial() : 0;
+	int fact = old ? old->GetFactories() : 0;
+	int build = old ? old->GetBuilding() : 0;
+	bool mt = old ? old->IsTurning() : false;
+	char *p = line+k;
+	while (1 == sscanf(p, "%*[ ]%15[^ \n]%n", tok, &k)) {
+		p += k;
+		told++;
+		switch (tok[0]) {
+		case 'm':	mon = atoi(tok+1); break;
+		case 'p':	prod = atoi(tok+1); break;
+		case 'r':	mat = atoi(tok+1); break;
+		case 'f':	fact = atoi(tok+1); break;
+		case 'b':	build = atoi(tok+1); break;
+		case 't':	mt = tok[1]=='y'; break;
+		default:	gone = true; /* bankrupt or left */
+		}
+	}
+	if (!old && !gone && told < 6)
+		*lost = true;
+	delete old;
+	players[n-1] = 0;
+	if (!gone && !*lost) {
+		players[n-1] = new Player(n, mon, prod, mat, fact, build, mt);
+		if (n == number)
+			Adopt(players[n-1]);
+	}
+	return strchr(line, '\n')+1;
+}
+
+void Robot::Adopt(const Player *p)
+{
+	money = p->GetMoney();
+	products = p->GetProducts();
+	material = p->GetMaterial();
+	factories = p->GetFactories();
+	building_factories = p->GetBuilding();
+	makes_turn = p->IsTurning();
+}
+
+auction_list* Robot::ParseDigestAuction(char *line)
+{
+	auction_list *first = 0, **last = &first;
+	int pl, ammo, mon;
+	char act;
+	while (*line) {
+		if (4 == sscanf(line, "%c%d %d %d", &act, &pl, &ammo, &mon)) {
+			/*the delta feed sends the price, not the sum*/
+			*last = new auction_list;
+			(*last)->auc = new Auction(pl, act=='s' ? sold : bought,
+				ammo, ammo*mon);
+			(*last)->next = 0;
+			last = &(*last)->next;
+		} else
+		if (3 == sscanf(line, "# Player %d sold %d products"
+			" and gained %d dollars\n", &pl, &ammo, &mon))
+		{
+			*last = new auction_list;
+			(*last)->auc = new Auction(pl, sold, ammo, mon);
+			(*last)->next = 0;
+			last = &(*last)->next;
+		} else
+		if (3 == sscanf(line, "# Player %d bought %d materials "
+			"and spent %d dollars\n", &pl, &ammo, &mon))
+		{
+			*last = new auction_list;
+			(*last)->auc = new Auction(pl, bought, ammo, mon);
+			(*last)->next = 0;
+			last = &(*last)->next;
+		}
+		line = strchr(line, '\n')+1;
+	}
+	return first;
+}
+
+static long long now_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* spins for a while and then sleeps on the futex until the server writes */
+int Robot::ReadRing()
+{
+	static long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	ring *r = &rings->out;
+	unsigned len = in_buf_size-position-1;
+	long long start = now_ns();
+	int rc;
+	while (len && !(rc = ring_read(r, in_buf+position, len))) {
+		/*with one CPU the server can't write while we spin*/
+		if ((cpus > 1 && now_ns() - start < RING_SPIN_NS)
+			|| !ring_sleep(r))
+			continue;
+		timespec ts = { 0, 100000000 };
+		rc = syscall(SYS_futex, &r->head, FUTEX_WAIT, r->tail, &ts, 0, 0);
+		ring_wake(r);
+		/*the server may be gone*/
+		char c;
+		if (rc == -1 && errno == ETIMEDOUT
+			&& recv(sd, &c, 1, MSG_DONTWAIT | MSG_PEEK) == 0)
+			return 0;
+	}
+	return len ? rc : 0;
+}
+
+void Robot::UseRings()
+{
+	char *name, *end;
+	Send("shm");
+	while (!(name = strstr(in_buf, "shm /")) || !(end = strchr(name, '\n'))) {
+		if (strstr(in_buf, "Can't use shared memory"))
+			throw "can't use shared memory\n";
+		ReadMore();
 	}
-	return players;
+	*end = '\0';
+	int fd = shm_open(name+4, O_RDWR, 0);
+	if (fd == -1)
+		throw "can't open shared memory\n";
+	void *p = mmap(0, sizeof(ring_pair), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		throw "can't map shared memory\n";
+	ShiftBuf(end+1-in_buf);
+	rings = (ring_pair *)p;
 }
 
 void Robot::Run()
 {
-	while (!makes_turn)
-		Update();
-	NewMonth();
+	Send("delta");
+	ReadDigest();
 }
 
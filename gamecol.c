@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gamecol.h"
+
+/*
+ * Prints the column files of the server's -e as CSV, or with -s how
+ * many rows, row groups and bytes a value every column of them has.
+ */
+
+struct col_sum {
+	long long rows, groups, bytes[COL_MAX];
+};
+
+/*returns -1 if the file is not a column file or is broken*/
+int read_file(const char *file, int csv, struct col_header *h,
+	struct col_sum *sum)
+{
+	struct col_group g;
+	unsigned char *in = NULL;
+	int *v[COL_MAX] = { NULL };
+	int i, r, len, size = 0, rows = 0, ok = -1;
+	FILE *f = fopen(file, "r");
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+	if (fread(h, sizeof(*h), 1, f) != 1
+		|| memcmp(h->magic, COL_MAGIC, 4) != 0
+		|| h->cols < 1 || h->cols > COL_MAX)
+		goto out;
+	if (csv == 1)
+		for (i=0; i<h->cols; i++)
+			printf("%.*s%c", COL_NAME, h->name[i],
+				i == h->cols-1 ? '\n' : ',');
+	while (fread(&g, sizeof(g), 1, f) == 1) {
+		if (g.rows < 1)
+			goto out;
+		if (g.rows > rows) {
+			rows = g.rows;
+			for (i=0; i<h->cols; i++)
+				v[i] = realloc(v[i], rows*sizeof(int));
+		}
+		for (i=0; i<h->cols; i++) {
+			len = g.len[i];
+			if (len < 0 || len > g.rows*5)
+				goto out;
+			if (len > size)
+				in = realloc(in, size = len);
+			if (fread(in, 1, len, f) != len
+				|| col_decode(in, len, v[i], g.rows) != len)
+				goto out;
+			sum->bytes[i] += len;
+		}
+		sum->rows += g.rows;
+		sum->groups++;
+		if (csv)
+			for (r=0; r<g.rows; r++)
+				for (i=0; i<h->cols; i++)
+					printf("%d%c", v[i][r],
+						i == h->cols-1 ? '\n' : ',');
+	}
+	ok = feof(f) ? 0 : -1;
+out:
+	if (ok == -1)
+		fprintf(stderr, "%s is broken\n", file);
+	fclose(f);
+	free(in);
+	for (i=0; i<COL_MAX; i++)
+		free(v[i]);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	struct col_header h, first;
+	struct col_sum sum;
+	int opt, i, summary = 0;
+	while ((opt = getopt(argc, argv, "s")) != -1) {
+		switch (opt) {
+		case 's':	summary = 1; break;
+		default:	argc = 0;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Usage: ./gamecol [-s] file ...\n");
+		return 1;
+	}
+	memset(&sum, 0, sizeof(sum));
+	for (i=optind; i<argc; i++) {
+		if (read_file(argv[i], summary ? 0 : 1 + (i > optind),
+			i == optind ? &first : &h, &sum) == -1)
+			return 1;
+		if (i > optind && (h.cols != first.cols
+			|| memcmp(h.name, first.name, sizeof(h.name)) != 0)) {
+			fprintf(stderr, "%s has other columns than %s\n",
+				argv[i], argv[optind]);
+			return 1;
+		}
+	}
+	if (!summary)
+		return 0;
+	printf("%lld rows in %lld groups\n", sum.rows, sum.groups);
+	for (i=0; i<first.cols; i++)
+		printf("%-*.*s %10lld bytes %5.2f a value\n", COL_NAME,
+			COL_NAME, first.name[i], sum.bytes[i],
+			sum.rows ? (double)sum.bytes[i]/sum.rows : 0.0);
+	return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef GAMECOL_H
+#define GAMECOL_H
+
+/*
+ * The column files written by the server's -e. A file holds one table:
+ * its header names the columns, then come row groups, each a
+ * col_group followed by the columns of its rows one after another.
+ * Every value of a column is stored as its difference from the value
+ * above it, zigzagged into a varint, so that runs of the same or
+ * slowly changing numbers take a byte a value.
+ */
+
+#define COL_MAGIC "GSC1"
+#define COL_MAX 12
+#define COL_NAME 16
+
+struct col_header {
+	char magic[4];
+	int cols;
+	char name[COL_MAX][COL_NAME];
+};
+
+struct col_group {
+	int rows;
+	int len[COL_MAX];	/* bytes of every column */
+};
+
+/*returns the number of bytes written, at most 5 a value*/
+static inline int col_encode(const int *v, int n, unsigned char *out)
+{
+	unsigned prev = 0, d;
+	int i, len = 0;
+	for (i=0; i<n; i++) {
+		d = (unsigned)v[i] - prev;
+		prev = v[i];
+		d = d << 1 ^ -(d >> 31);
+		while (d >= 0x80) {
+			out[len++] = d | 0x80;
+			d >>= 7;
+		}
+		out[len++] = d;
+	}
+	return len;
+}
+
+/*returns the number of bytes read or -1 if they run out*/
+static inline int col_decode(const unsigned char *in, int len, int *v, int n)
+{
+	unsigned prev = 0, d;
+	int i, pos = 0, shift;
+	for (i=0; i<n; i++) {
+		d = 0;
+		shift = 0;
+		do {
+			if (pos == len || shift > 28)
+				return -1;
+			d |= (unsigned)(in[pos] & 0x7f) << shift;
+			shift += 7;
+		} while (in[pos++] & 0x80);
+		prev += d >> 1 ^ -(d & 1);
+		v[i] = prev;
+	}
+	return pos;
+}
+
+#endif
@@ -0,0 +1,599 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gamecore.h"
+
+#define RNG_MAX 0x7fffffff
+#define RULES_LINE 256
+
+static const struct game_rules classic = RULES_CLASSIC;
+static const struct game_rules rich = RULES_RICH;
+static const struct game_rules *const registry[] = { &classic, &rich, NULL };
+
+/*
+ * Calls fn with a constant set for the sets of the registry, so that
+ * each of them gets a copy of fn with its numbers folded in.
+ */
+#define BY_RULES(r, fn, ...) do { \
+	switch ((r)->set) { \
+	case classic_rules: fn(&classic, __VA_ARGS__); break; \
+	case rich_rules: fn(&rich, __VA_ARGS__); break; \
+	default: fn((r), __VA_ARGS__); \
+	} \
+} while (0)
+
+#define RULED static inline __attribute__((always_inline))
+
+/*the state is a single word, so that it can be checkpointed*/
+static int rng_rand(struct game *g)
+{
+	g->rng = g->rng*6364136223846793005ULL + 1442695040888963407ULL;
+	return g->rng >> 33;
+}
+
+static void emit(struct game *g, enum game_ev type, int k, int a0, int a1)
+{
+	struct game_event e;
+	if (!g->event)
+		return;
+	e.type = type;
+	e.player = k;
+	e.a0 = a0;
+	e.a1 = a1;
+	(*g->event)(g, &e);
+}
+
+int game_building(struct build_f *ptr)
+{
+	int k;
+	for (k=0; ptr; k++)
+		ptr = ptr->next;
+	return k;
+}
+
+int game_queue(struct auc *ptr)
+{
+	int k;
+	for (k=0; ptr; k++)
+		ptr = ptr->next;
+	return k;
+}
+
+static struct build_f *del_build(struct build_f *ptr)
+{
+	struct build_f *tmp;
+	if (ptr) {
+		tmp = ptr->next;
+		free(ptr);
+		ptr = tmp;
+	}
+	return ptr;
+}
+
+static struct auc *delete_request(struct auc *ptr)
+{
+	struct auc *tmp;
+	tmp = ptr->next;
+	free(ptr->req);
+	free(ptr);
+	return tmp;
+}
+
+struct game *game_new(int pl_n, game_event_fn event, void *data)
+{
+	struct game *g = calloc(1, sizeof(struct game));
+	g->pl_n = pl_n;
+	g->pl = calloc(pl_n, sizeof(struct firm));
+	g->event = event;
+	g->data = data;
+	g->rules = &classic;
+	game_reset(g);
+	return g;
+}
+
+void game_free(struct game *g)
+{
+	game_reset(g);
+	free(g->pl);
+	free(g);
+}
+
+/*orders left by players who have all gone are not carried over*/
+void game_reset(struct game *g)
+{
+	int i;
+	g->started = g->month = g->pl_count = 0;
+	for (i=0; i<g->pl_n; i++) {
+		struct firm *f = &g->pl[i];
+		while (f->building)
+			f->building = del_build(f->building);
+		f->status = off;
+		f->money = g->rules->money;
+		f->material = g->rules->material;
+		f->for_prod = 0;
+		f->products = g->rules->products;
+		f->factories = g->rules->factories;
+	}
+	while (g->for_selling)
+		g->for_selling = delete_request(g->for_selling);
+	while (g->for_buying)
+		g->for_buying = delete_request(g->for_buying);
+}
+
+void game_set_rules(struct game *g, const struct game_rules *r)
+{
+	g->rules = r;
+	game_reset(g);
+}
+
+int game_seat(struct game *g)
+{
+	int i;
+	for (i=0; i<g->pl_n; i++) {
+		if (!g->pl[i].status)
+			return i;
+	}
+	return -1;
+}
+
+void game_join(struct game *g, int k)
+{
+	g->pl[k].status = play;
+	g->pl_count++;
+}
+
+void game_leave(struct game *g, int k)
+{
+	struct firm *f = &g->pl[k];
+	if (f->status != bankrupt)
+		g->pl_count--;
+	while (f->building)
+		f->building = del_build(f->building);
+	f->status = off;
+}
+
+RULED void market_by(const struct game_rules *R, struct game *g)
+{
+	struct market_status *old = &g->st;
+	int pl_count = g->pl_count;
+	int l;
+	if (g->month == 1)
+		old->level = 3;
+	else {
+		int r = 1 + (int)(12.0*rng_rand(g)/(RNG_MAX+1.0));
+		int i, sum;
+		for (i=0,sum=0; sum<r; i++)
+			sum += R->level_change[old->level-1][i];
+		old->level = i;
+	}
+	l = old->level-1;
+	old->sell_n = (int)(R->level_sell[l]*pl_count);
+	old->min_price = R->level_min[l];
+	old->buy_n = (int)(R->level_buy[l]*pl_count);
+	old->max_price = R->level_max[l];
+}
+
+static void change_level(struct game *g)
+{
+	BY_RULES(g->rules, market_by, g);
+}
+
+static void new_month(struct game *g)
+{
+	int i;
+	g->month++;
+	change_level(g);
+	for (i=0; i<g->pl_n; i++) {
+		if (g->pl[i].status == end_turn)
+			g->pl[i].status = play;
+	}
+	emit(g, gev_month, -1, g->month, 0);
+}
+
+void game_start(struct game *g, unsigned seed)
+{
+	g->started = 1;
+	g->rng = seed;
+	new_month(g);
+}
+
+static int playing(struct game *g, int k)
+{
+	return g->started && k >= 0 && k < g->pl_n
+		&& g->pl[k].status == play;
+}
+
+static int refuse(struct game *g, int k, enum game_lack what)
+{
+	emit(g, gev_refused, k, what, 0);
+	return -1;
+}
+
+int game_prod(struct game *g, int k, int n)
+{
+	struct firm *f = &g->pl[k];
+	if (!playing(g, k) || n < 0)
+		return -1;
+	if (f->money < g->rules->prod_cost*n)
+		return refuse(g, k, lack_money);
+	if (f->material < n)
+		return refuse(g, k, lack_material);
+	if (f->factories-f->for_prod < n)
+		return refuse(g, k, lack_factories);
+	f->money -= g->rules->prod_cost*n;
+	f->material -= n;
+	f->for_prod += n;
+	emit(g, gev_prod, k, n, 0);
+	return 0;
+}
+
+/*
+ * The bank takes sales from the cheapest and purchases from the
+ * dearest; a new order goes before the old ones with the same price.
+ */
+static int accept_request(struct game *g, struct auc **queue,
+	struct request *r, int selling)
+{
+	int k = r->player_n-1;
+	struct firm *f = &g->pl[k];
+	struct auc *tmp;
+	if ((selling && r->price > g->st.max_price)
+		|| (!selling && r->price < g->st.min_price)) {
+		if (selling)
+			f->products += r->count;
+		else
+			f->money += r->price * r->count;
+		free(r);
+		return refuse(g, k, lack_price);
+	}
+	while (*queue && (selling ? r->price > (*queue)->req->price
+		: r->price < (*queue)->req->price))
+		queue = &(*queue)->next;
+	tmp = malloc(sizeof(struct auc));
+	tmp->req = r;
+	tmp->next = *queue;
+	*queue = tmp;
+	emit(g, gev_accepted, k, 0, 0);
+	return 0;
+}
+
+static struct request *make_request(int k, int count, int price)
+{
+	struct request *r = malloc(sizeof(struct request));
+	r->player_n = k+1;
+	r->count = count;
+	r->price = price;
+	return r;
+}
+
+int game_sell(struct game *g, int k, int count, int price)
+{
+	struct firm *f = &g->pl[k];
+	if (!playing(g, k) || count < 0 || price < 0)
+		return -1;
+	if (f->products < count)
+		return refuse(g, k, lack_product);
+	f->products -= count;
+	emit(g, gev_sell, k, count, price);
+	return accept_request(g, &g->for_selling,
+		make_request(k, count, price), 1);
+}
+
+int game_buy(struct game *g, int k, int count, int price)
+{
+	struct firm *f = &g->pl[k];
+	if (!playing(g, k) || count < 0 || price < 0)
+		return -1;
+	if (f->money < count * price)
+		return refuse(g, k, lack_money);
+	f->money -= count * price;
+	emit(g, gev_buy, k, count, price);
+	return accept_request(g, &g->for_buying,
+		make_request(k, count, price), 0);
+}
+
+int game_build(struct game *g, int k)
+{
+	struct firm *f = &g->pl[k];
+	struct build_f **b = &f->building;
+	if (!playing(g, k))
+		return -1;
+	if (f->money < g->rules->build_cost)
+		return refuse(g, k, lack_money);
+	while (*b)
+		b = &(*b)->next;
+	*b = malloc(sizeof(struct build_f));
+	(*b)->days = 5;
+	(*b)->next = NULL;
+	f->money -= g->rules->build_cost;
+	emit(g, gev_build, k, game_building(f->building), 0);
+	return 0;
+}
+
+int game_turn(struct game *g, int k)
+{
+	if (!playing(g, k))
+		return -1;
+	g->pl[k].status = end_turn;
+	emit(g, gev_turn, k, 0, 0);
+	return 0;
+}
+
+int game_waiting(struct game *g)
+{
+	int i;
+	for (i=0; i<g->pl_n; i++) {
+		if (g->pl[i].status == play)
+			return 1;
+	}
+	return 0;
+}
+
+typedef void (*sat_ptr)(struct game *, struct request *, int);
+
+static void satisfy_buy(struct game *g, struct request *req, int ammount)
+{
+	struct firm *f = &g->pl[req->player_n-1];
+	f->material += ammount;
+	f->money += (req->count-ammount) * req->price;
+	if (ammount > 0)
+		emit(g, gev_bought, req->player_n-1, ammount, req->price);
+}
+
+static void satisfy_sell(struct game *g, struct request *req, int ammount)
+{
+	struct firm *f = &g->pl[req->player_n-1];
+	f->money += ammount * req->price;
+	f->products += req->count - ammount;
+	if (ammount > 0)
+		emit(g, gev_sold, req->player_n-1, ammount, req->price);
+}
+
+static struct auc *auc_chance(struct game *g, struct auc *queue,
+	int possible_deals, int participants, sat_ptr satisfy)
+{
+	int r = 1 + (int)((float)(participants)*rng_rand(g)/(RNG_MAX+1.0));
+	struct auc **tmp = &queue;
+	int i;
+	for (i=0; i<r-1; i++)
+		tmp = &(*tmp)->next;
+	if ((*tmp)->req->count <= possible_deals) {
+		(*satisfy)(g, (*tmp)->req, (*tmp)->req->count);
+		possible_deals -= (*tmp)->req->count;
+	} else {
+		(*satisfy)(g, (*tmp)->req, possible_deals);
+		possible_deals = 0;
+	}
+	(*tmp) = delete_request(*tmp);
+	if (possible_deals > 0) {
+		return auc_chance(g, queue, possible_deals, participants-1,
+			satisfy);
+	} else {
+		while (queue) {
+			(*satisfy)(g, queue->req, 0);
+			queue = delete_request(queue);
+		}
+	}
+	return queue;
+}
+
+static struct auc *auction(struct game *g, struct auc *queue,
+	int possible_deals, sat_ptr satisfy)
+{
+	int best, participants, prod_n, i;
+	struct auc *tmp = queue;
+	if (queue == NULL)
+		return queue;
+	if (possible_deals == 0) {
+		while (queue) {
+			(*satisfy)(g, queue->req, 0);
+			queue = delete_request(queue);
+		}
+		return queue;
+	}
+	best = queue->req->price;
+	participants = prod_n = 0;
+	while (tmp && tmp->req->price == best) {
+		participants++;
+		prod_n += tmp->req->count;
+		tmp = tmp->next;
+	}
+	if (prod_n <= possible_deals) {
+		for (i=0; i<participants; i++) {
+			(*satisfy)(g, queue->req, queue->req->count);
+			prod_n -= queue->req->count;
+			possible_deals -= queue->req->count;
+			queue = delete_request(queue);
+		}
+		return auction(g, queue, possible_deals, satisfy);
+	} else {
+		return auc_chance(g, queue, possible_deals, participants,
+			satisfy);
+	}
+}
+
+void game_auction(struct game *g)
+{
+	g->for_selling = auction(g, g->for_selling, g->st.buy_n,
+		satisfy_sell);
+	g->for_buying = auction(g, g->for_buying, g->st.sell_n,
+		satisfy_buy);
+}
+
+RULED void handle_building(const struct game_rules *R, struct firm *f)
+{
+	struct build_f **t = &f->building;
+	while (*t) {
+		(*t)->days--;
+		if ((*t)->days == 1)
+			f->money -= R->build_cost;
+		if ((*t)->days == 0) {
+			f->factories++;
+			*t = del_build(*t);
+		} else {
+			t = &((*t)->next);
+		}
+	}
+}
+
+RULED void accounting_by(const struct game_rules *R, struct game *g)
+{
+	int i;
+	for (i=0; i<g->pl_n; i++) {
+		struct firm *f = &g->pl[i];
+		if (f->status != end_turn)
+			continue;
+		f->products += f->for_prod;
+		f->for_prod = 0;
+		f->money -= R->material_upkeep*f->material
+			+ R->product_upkeep*f->products
+			+ R->factory_upkeep*f->factories;
+		handle_building(R, f);
+		if (f->money < 0) {
+			f->status = bankrupt;
+			g->pl_count--;
+			emit(g, gev_bankrupt, i, f->money, 0);
+		}
+	}
+}
+
+void game_accounting(struct game *g)
+{
+	BY_RULES(g->rules, accounting_by, g);
+}
+
+int game_next_month(struct game *g)
+{
+	int i;
+	if (g->pl_count == 0) {
+		emit(g, gev_over, -1, 0, 0);
+		g->started = 0;
+		return 0;
+	}
+	if (g->pl_count == 1 && g->started) {
+		for (i=0; i<g->pl_n; i++) {
+			if (g->pl[i].status == play
+				|| g->pl[i].status == end_turn) {
+				emit(g, gev_winner, i, 0, 0);
+				break;
+			}
+		}
+		g->started = 0;
+		return 0;
+	}
+	new_month(g);
+	return 1;
+}
+
+int game_end_month(struct game *g)
+{
+	game_auction(g);
+	game_accounting(g);
+	return game_next_month(g);
+}
+
+const struct game_rules *rules_find(const char *name)
+{
+	int i;
+	for (i=0; registry[i]; i++) {
+		if (strcmp(registry[i]->name, name) == 0)
+			return registry[i];
+	}
+	return NULL;
+}
+
+/*returns -1 if the line says nothing the rules know of*/
+static int rules_line(struct game_rules *r, const char *line)
+{
+	int l, n, i, sum, c[RULES_LEVELS];
+	char name[RULES_NAME];
+	double sell, buy;
+	int min, max;
+	if (sscanf(line, " name %15s %n", name, &n) == 1 && !line[n]) {
+		/*a journal by the name would be played by the registry's*/
+		if (rules_find(name))
+			return -1;
+		strcpy(r->name, name);
+		return 0;
+	}
+	if (sscanf(line, " start %d %d %d %d %n", &r->money, &r->material,
+		&r->products, &r->factories, &n) == 4 && !line[n])
+		return 0;
+	if (sscanf(line, " prod_cost %d %n", &r->prod_cost, &n) == 1
+		&& !line[n])
+		return 0;
+	if (sscanf(line, " build_cost %d %n", &r->build_cost, &n) == 1
+		&& !line[n])
+		return 0;
+	if (sscanf(line, " upkeep %d %d %d %n", &r->material_upkeep,
+		&r->product_upkeep, &r->factory_upkeep, &n) == 3 && !line[n])
+		return 0;
+	if (sscanf(line, " level %d %lf %d %lf %d %n", &l, &sell, &min, &buy,
+		&max, &n) == 5 && !line[n] && l >= 1 && l <= RULES_LEVELS
+		&& sell >= 0 && buy >= 0 && min >= 0 && max >= 0) {
+		r->level_sell[l-1] = sell;
+		r->level_min[l-1] = min;
+		r->level_buy[l-1] = buy;
+		r->level_max[l-1] = max;
+		return 0;
+	}
+	/*a month's level is drawn out of twelve*/
+	if (sscanf(line, " change %d %d %d %d %d %d %n", &l, &c[0], &c[1],
+		&c[2], &c[3], &c[4], &n) == 6 && !line[n]
+		&& l >= 1 && l <= RULES_LEVELS) {
+		for (i=0,sum=0; i<RULES_LEVELS; i++) {
+			if (c[i] < 0)
+				return -1;
+			sum += c[i];
+		}
+		if (sum != 12)
+			return -1;
+		memcpy(r->level_change[l-1], c, sizeof(c));
+		return 0;
+	}
+	return -1;
+}
+
+struct game_rules *rules_load(const char *file, int *bad_line)
+{
+	struct game_rules *r;
+	char line[RULES_LINE];
+	FILE *f = fopen(file, "r");
+	*bad_line = 0;
+	if (!f)
+		return NULL;
+	r = malloc(sizeof(struct game_rules));
+	*r = classic;
+	r->set = custom_rules;
+	strcpy(r->name, "custom");
+	while (fgets(line, sizeof(line), f)) {
+		++*bad_line;
+		if (line[strspn(line, " \t\r\n")] == '\0'
+			|| line[strspn(line, " \t")] == '#')
+			continue;
+		if (rules_line(r, line) == -1 || r->money < 0
+			|| r->material < 0 || r->products < 0
+			|| r->factories < 0 || r->prod_cost < 0
+			|| r->build_cost < 0) {
+			fclose(f);
+			free(r);
+			return NULL;
+		}
+	}
+	fclose(f);
+	*bad_line = 0;
+	return r;
+}
+
+const struct game_rules *rules_pick(const char *arg)
+{
+	const struct game_rules *r = rules_find(arg);
+	int line;
+	if (r || (r = rules_load(arg, &line)))
+		return r;
+	if (line)
+		fprintf(stderr, "%s: line %d is not a rule\n", arg, line);
+	else
+		fprintf(stderr, "no such rules: %s\n", arg);
+	return NULL;
+}
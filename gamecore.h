@@ -0,0 +1,133 @@
+#ifndef GAMECORE_H
+#define GAMECORE_H
+
+/*
+ * The rules of the game without any sockets. Players act by calling the
+ * game_* functions, which return -1 if the action is not allowed, and
+ * whatever comes of it is told to the event function of the game, if
+ * there is one. The server and the headless driver both play through it.
+ */
+
+#include "gamerules.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct build_f {
+	int days;
+	struct build_f *next;
+};
+
+enum st {
+	off = 0,
+	play = 1,
+	end_turn = 2,
+	bankrupt = -1,
+};
+
+struct firm {
+	enum st status;
+	int money;
+	int material;
+	int products;
+	int for_prod;
+	int factories;
+	struct build_f *building;
+};
+
+struct market_status {
+	int level;
+	int sell_n;
+	int min_price;
+	int buy_n;
+	int max_price;
+};
+
+struct request {
+	int player_n;
+	int price;
+	int count;
+};
+
+struct auc {
+	struct request *req;
+	struct auc *next;
+};
+
+enum game_ev {
+	gev_refused,	/* a0 is what the player lacks */
+	gev_accepted,	/* the bank has queued the order */
+	gev_prod,	/* a0 units are being made */
+	gev_sell,	/* a0 units offered for a1 dollars each */
+	gev_buy,	/* a0 units asked for for a1 dollars each */
+	gev_build,	/* a0 factories are being built now */
+	gev_turn,
+	gev_sold,	/* a0 units sold at the auction for a1 each */
+	gev_bought,	/* a0 units bought at the auction for a1 each */
+	gev_bankrupt,	/* a0 dollars left */
+	gev_month,	/* a0 is the new month */
+	gev_winner,
+	gev_over,	/* everybody has gone bust */
+};
+
+enum game_lack { lack_money, lack_material, lack_factories, lack_product,
+	lack_price };
+
+struct game_event {
+	enum game_ev type;
+	int player;		/* counted from 0, -1 for the whole game */
+	int a0, a1;
+};
+
+struct game;
+typedef void (*game_event_fn)(struct game *, const struct game_event *);
+
+struct game {
+	int pl_n;
+	int pl_count;		/* players neither gone nor bankrupt */
+	int started;
+	int month;
+	unsigned long long rng;
+	struct firm *pl;
+	struct market_status st;
+	struct auc *for_selling, *for_buying;
+	game_event_fn event;
+	void *data;
+	const struct game_rules *rules;
+};
+
+struct game *game_new(int pl_n, game_event_fn event, void *data);
+void game_free(struct game *g);
+void game_reset(struct game *g);
+/*the classic rules until told otherwise; resets the game*/
+void game_set_rules(struct game *g, const struct game_rules *r);
+
+/*returns -1 if every seat is taken*/
+int game_seat(struct game *g);
+void game_join(struct game *g, int k);
+void game_leave(struct game *g, int k);
+void game_start(struct game *g, unsigned seed);
+
+int game_prod(struct game *g, int k, int n);
+int game_sell(struct game *g, int k, int count, int price);
+int game_buy(struct game *g, int k, int count, int price);
+int game_build(struct game *g, int k);
+int game_turn(struct game *g, int k);
+
+/*returns 1 if somebody has not finished the turn yet*/
+int game_waiting(struct game *g);
+void game_auction(struct game *g);
+void game_accounting(struct game *g);
+/*returns 0 if the game is over*/
+int game_next_month(struct game *g);
+int game_end_month(struct game *g);
+
+int game_building(struct build_f *ptr);
+int game_queue(struct auc *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
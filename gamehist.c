@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "gamehist.h"
+
+/*
+ * Reads the store of finished games that the server keeps with -a:
+ * a summary of the store, the months of a game, one month in full or
+ * the balance of one player. With -g it fills a store with made-up
+ * games, with -b it measures how long it takes to find a month.
+ */
+
+#define SEGS 4096
+#define SAMPLES 1000000
+
+const char *dir;
+struct hist_game *games;
+int game_n;
+char *segs[SEGS];
+long long seg_size[SEGS];
+
+long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+void *map_file(const char *name, long long *size)
+{
+	struct stat st;
+	void *p;
+	int fd;
+	if ((fd = open(name, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		perror(name);
+		exit(1);
+	}
+	*size = st.st_size;
+	p = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)
+		: NULL;
+	if (p == MAP_FAILED) {
+		perror(name);
+		exit(1);
+	}
+	close(fd);
+	return p;
+}
+
+void open_store(void)
+{
+	char name[PATH_MAX];
+	struct hist_header *h;
+	long long size;
+	snprintf(name, sizeof(name), "%s/" HIST_INDEX, dir);
+	h = map_file(name, &size);
+	if (size < (long long)sizeof(*h)
+		|| memcmp(h->magic, HIST_MAGIC, 4) != 0) {
+		fprintf(stderr, "%s is not a game history\n", dir);
+		exit(1);
+	}
+	games = (struct hist_game *)(h + 1);
+	game_n = (size - sizeof(*h)) / sizeof(struct hist_game);
+}
+
+/*segments are mapped when they are first needed*/
+void *record(struct hist_ref *r)
+{
+	char name[PATH_MAX];
+	if (r->seg < 0 || r->seg >= SEGS) {
+		fprintf(stderr, "bad segment %d\n", r->seg);
+		exit(1);
+	}
+	if (!segs[r->seg]) {
+		snprintf(name, sizeof(name), "%s/" HIST_SEG, dir, r->seg);
+		segs[r->seg] = map_file(name, &seg_size[r->seg]);
+	}
+	if (r->off + r->len > seg_size[r->seg]) {
+		fprintf(stderr, "record past the end of segment %d\n", r->seg);
+		exit(1);
+	}
+	return segs[r->seg] + r->off;
+}
+
+/*returns NULL if there is no such game or month*/
+struct hist_month *find_month(int g, int m)
+{
+	struct hist_ref *months;
+	if (g < 0 || g >= game_n || m < 0 || m >= games[g].month_n)
+		return NULL;
+	months = record(&games[g].months);
+	return record(&months[m]);
+}
+
+struct hist_game *find_game(const char *arg)
+{
+	int g = atoi(arg);
+	if (g < 0 || g >= game_n) {
+		fprintf(stderr, "no game %s, the store has %d\n", arg, game_n);
+		exit(1);
+	}
+	return &games[g];
+}
+
+void print_summary(void)
+{
+	long long months = 0, won = 0;
+	int i, segments = 0;
+	for (i=0; i<game_n; i++) {
+		months += games[i].month_n;
+		won += games[i].winner != 0;
+		if (games[i].months.seg >= segments)
+			segments = games[i].months.seg+1;
+	}
+	printf("%d games, %lld months, %lld won, %d segments\n",
+		game_n, months, won, segments);
+	if (game_n)
+		printf("last game: room %d, %d players, ended %lld s\n",
+			games[game_n-1].room, games[game_n-1].players,
+			games[game_n-1].ended/1000000000);
+}
+
+void print_game(int g)
+{
+	struct hist_month *m;
+	int i;
+	printf("game %d: room %d, %d players, %d months, ", g, games[g].room,
+		games[g].players, games[g].month_n);
+	if (games[g].winner)
+		printf("won by %d\n", games[g].winner);
+	else
+		printf("no winner\n");
+	printf("month level   sell min_price    buy max_price orders "
+		"trades\n");
+	for (i=0; (m = find_month(g, i)); i++)
+		printf("%5d %5d %6d %9d %6d %9d %6d %6d\n", m->month, m->level,
+			m->sell_n, m->min_price, m->buy_n, m->max_price,
+			m->orders, m->trades);
+}
+
+void print_deals(const char *what, struct hist_deal *d, int n)
+{
+	int i;
+	for (i=0; i<n; i++)
+		printf("%s %d %s %d at %d\n", what, d[i].player,
+			d[i].side == hist_sell ? "sells" : "buys",
+			d[i].count, d[i].price);
+}
+
+void print_month(int g, int k)
+{
+	struct hist_month *m;
+	struct hist_firm *f;
+	int i;
+	if (!(m = find_month(g, k))) {
+		fprintf(stderr, "game %d has %d months\n", g, games[g].month_n);
+		exit(1);
+	}
+	printf("game %d, month %d, level %d\n", g, m->month, m->level);
+	printf("the bank sells %d at %d at least, buys %d at %d at most\n",
+		m->sell_n, m->min_price, m->buy_n, m->max_price);
+	printf("player status    money products material factories "
+		"building\n");
+	f = hist_firms(m);
+	for (i=0; i<m->players; i++)
+		printf("%6d %6d %8d %8d %8d %9d %8d\n", i+1, f[i].status,
+			f[i].money, f[i].products, f[i].material,
+			f[i].factories, f[i].building);
+	print_deals("order", hist_orders(m), m->orders);
+	print_deals("trade", hist_trades(m), m->trades);
+}
+
+void print_player(int g, int k)
+{
+	struct hist_month *m;
+	struct hist_firm *f;
+	int i;
+	if (k < 1 || k > games[g].players) {
+		fprintf(stderr, "game %d has %d players\n", g,
+			games[g].players);
+		exit(1);
+	}
+	printf("month    money products material factories building\n");
+	for (i=0; (m = find_month(g, i)); i++) {
+		f = &hist_firms(m)[k-1];
+		printf("%5d %8d %8d %8d %9d %8d\n", m->month, f->money,
+			f->products, f->material, f->factories, f->building);
+	}
+}
+
+/*writes made-up games straight into the files, without the server*/
+void generate(int n)
+{
+	char name[PATH_MAX];
+	char buf[sizeof(struct hist_month) + 4*sizeof(struct hist_firm)
+		+ 16*sizeof(struct hist_deal)];
+	struct hist_header h = { HIST_MAGIC, 0 };
+	struct hist_ref refs[10];
+	struct hist_game g;
+	struct hist_month *m = (struct hist_month *)buf;
+	long long off = 0;
+	FILE *index, *seg;
+	int i, j, k, len;
+	mkdir(dir, 0755);
+	snprintf(name, sizeof(name), "%s/" HIST_INDEX, dir);
+	if (access(name, F_OK) == 0) {
+		fprintf(stderr, "%s exists already\n", name);
+		exit(1);
+	}
+	index = fopen(name, "w");
+	snprintf(name, sizeof(name), "%s/" HIST_SEG, dir, h.seg);
+	seg = fopen(name, "w");
+	if (!index || !seg) {
+		perror(dir);
+		exit(1);
+	}
+	fwrite(&h, sizeof(h), 1, index);
+	memset(buf, 0, sizeof(buf));
+	srand(1);
+	for (i=0; i<n; i++) {
+		memset(&g, 0, sizeof(g));
+		g.players = 4;
+		g.month_n = 1 + rand() % 10;
+		for (j=0; j<=g.month_n; j++) {
+			m->month = j+1;
+			m->level = 1 + rand() % 5;
+			m->players = g.players;
+			m->orders = rand() % 9;
+			m->trades = rand() % (m->orders+1);
+			for (k=0; k<g.players; k++)
+				hist_firms(m)[k].money = rand() % 20000;
+			len = j < g.month_n ? (char *)(hist_trades(m)
+				+ m->trades) - buf : g.month_n*sizeof(*refs);
+			if (off + len > HIST_SEG_MAX) {
+				fclose(seg);
+				snprintf(name, sizeof(name), "%s/" HIST_SEG,
+					dir, ++h.seg);
+				if (!(seg = fopen(name, "w"))) {
+					perror(name);
+					exit(1);
+				}
+				off = 0;
+			}
+			if (j < g.month_n) {
+				refs[j].seg = h.seg;
+				refs[j].len = len;
+				refs[j].off = off;
+				fwrite(buf, len, 1, seg);
+			} else {
+				g.months.seg = h.seg;
+				g.months.len = len;
+				g.months.off = off;
+				fwrite(refs, len, 1, seg);
+			}
+			off += len;
+		}
+		g.ended = i;
+		g.winner = rand() % 2 ? 1 + rand() % g.players : 0;
+		fwrite(&g, sizeof(g), 1, index);
+	}
+	fseek(index, 0, SEEK_SET);
+	fwrite(&h, sizeof(h), 1, index);
+	if (fclose(seg) || fclose(index)) {
+		perror(dir);
+		exit(1);
+	}
+}
+
+int by_value(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+/*random months of random games, the segments mapped beforehand*/
+void bench(int n)
+{
+	long long *t, start, total, sum = 0;
+	struct hist_month *m;
+	int i, g;
+	if (!game_n) {
+		fprintf(stderr, "the store is empty\n");
+		exit(1);
+	}
+	srand(2);
+	for (i=0; i<game_n; i++)
+		if (!segs[games[i].months.seg]) {
+			struct hist_ref r = { games[i].months.seg, 0, 0 };
+			record(&r);
+		}
+	t = malloc(n*sizeof(*t));
+	start = now_ns();
+	for (i=0; i<n; i++) {
+		g = rand() % game_n;
+		m = find_month(g, rand() % games[g].month_n);
+		sum += m->level;
+	}
+	total = now_ns() - start;
+	for (i=0; i<n; i++) {
+		start = now_ns();
+		g = rand() % game_n;
+		m = find_month(g, rand() % games[g].month_n);
+		sum += m->level;
+		t[i] = now_ns() - start;
+	}
+	qsort(t, n, sizeof(*t), by_value);
+	printf("%d games, %d lookups: %.0f ns average, "
+		"p50 %lld ns, p99 %lld ns, max %lld ns (check %lld)\n",
+		game_n, n, (double)total/n, t[n/2], t[n*99/100], t[n-1], sum);
+	free(t);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, player = 0, make = 0, lookups = 0;
+	while ((opt = getopt(argc, argv, "p:g:b:")) != -1) {
+		switch (opt) {
+		case 'p':	player = atoi(optarg); break;
+		case 'g':	make = atoi(optarg); break;
+		case 'b':	lookups = atoi(optarg); break;
+		default:	argc = 0;
+		}
+	}
+	if (optind >= argc || optind+3 < argc || (player && optind+2 != argc)
+		|| ((make || lookups) && optind+1 != argc)
+		|| make < 0 || lookups < 0 || lookups > SAMPLES) {
+		fprintf(stderr, "Usage: ./gamehist dir [game [month]]\n"
+			"       ./gamehist -p player dir game\n"
+			"       ./gamehist -g games dir\n"
+			"       ./gamehist -b lookups dir\n");
+		return 1;
+	}
+	dir = argv[optind];
+	if (make) {
+		generate(make);
+		return 0;
+	}
+	open_store();
+	if (lookups)
+		bench(lookups);
+	else if (player)
+		print_player(find_game(argv[optind+1]) - games, player);
+	else if (optind+3 == argc)
+		print_month(find_game(argv[optind+1]) - games,
+			atoi(argv[optind+2]) - 1);
+	else if (optind+2 == argc)
+		print_game(find_game(argv[optind+1]) - games);
+	else
+		print_summary();
+	return 0;
+}
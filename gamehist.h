@@ -0,0 +1,87 @@
+#ifndef GAMEHIST_H
+#define GAMEHIST_H
+
+/*
+ * The store of finished games kept by the server's -a. Every month of a
+ * game is a record in a segment file "seg.<n>": the market, every
+ * player's balance after the accounting, the orders and the trades. When
+ * the game is over, the places of its months are written after them and
+ * the game gets the next entry of the file "index", whose position is
+ * the id of the game. A reader maps the index and the segments, so that
+ * a month of a game is found by two lookups in memory.
+ *
+ * Any number of rooms may write into the same store: a writer holds a
+ * lock on the index while it appends.
+ */
+
+#define HIST_MAGIC "GSH1"
+#define HIST_INDEX "index"
+#define HIST_SEG "seg.%d"
+#define HIST_SEG_MAX (256LL << 20)
+
+struct hist_header {
+	char magic[4];
+	int seg;		/* the segment being filled */
+};
+
+/*where a record is*/
+struct hist_ref {
+	int seg;
+	int len;
+	long long off;
+};
+
+struct hist_game {
+	long long ended;	/* ns since the epoch */
+	struct hist_ref months;	/* of a hist_ref for every month */
+	int room;
+	int players;
+	int month_n;
+	int winner;		/* 0 if nobody has won */
+};
+
+/*a month record is followed by its firms, orders and trades*/
+struct hist_month {
+	int month;
+	int level;
+	int sell_n, min_price;
+	int buy_n, max_price;
+	int players;
+	int orders;
+	int trades;
+};
+
+struct hist_firm {
+	int status;
+	int money;
+	int products;
+	int material;
+	int factories;
+	int building;
+};
+
+enum hist_side { hist_sell, hist_buy };
+
+struct hist_deal {
+	int player;		/* from 1 */
+	int side;
+	int count;
+	int price;
+};
+
+static inline struct hist_firm *hist_firms(struct hist_month *m)
+{
+	return (struct hist_firm *)(m + 1);
+}
+
+static inline struct hist_deal *hist_orders(struct hist_month *m)
+{
+	return (struct hist_deal *)(hist_firms(m) + m->players);
+}
+
+static inline struct hist_deal *hist_trades(struct hist_month *m)
+{
+	return hist_orders(m) + m->orders;
+}
+
+#endif
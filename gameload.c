@@ -0,0 +1,698 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * Plays many synthetic clients against a running server over loopback or
+ * a Unix socket and prints how the server coped as JSON. Every client
+ * speaks the text protocol like gamebot, following the fool or the
+ * clever script; they all live in one process around epoll.
+ */
+
+#define IN_SIZE 4096
+#define OUT_SIZE 512
+#define PLAN_SIZE 256
+#define CONNECT_WINDOW 64
+#define FORMING_ROOMS 32
+#define EVENTS 256
+
+enum policy { fool, clever };
+
+enum cl_state {
+	cl_idle, cl_waiting, cl_thinking, cl_totals,
+	cl_acting, cl_turned, cl_gone
+};
+
+enum cl_end { end_none, end_win, end_bankrupt, end_over, end_cut, end_drop };
+
+struct room {
+	int playing;
+	int month;		/* the last month begun */
+	long long last_turn;	/* when the last turn of the month left */
+};
+
+struct client {
+	int sd;
+	int room;
+	int number;		/* seat, from 1 */
+	enum policy policy;
+	enum cl_state state;
+	enum cl_end end;
+	char in[IN_SIZE];
+	int in_pos;
+	char out[OUT_SIZE];
+	int out_len, out_done;
+	int turn_out;		/* the turn is in the output buffer */
+	char plan[PLAN_SIZE];	/* the moves of the month not sent yet */
+	int plan_pos;
+	int pending;		/* answers waited for in lock-step */
+	int in_digest, in_totals;
+	/* what the client knows of the game */
+	int month, pl_count, sell_n, min_price, buy_n, max_price;
+	int money, products, material, factories;
+	int sold, bought;
+	int sum_products, units_sold, min_sold;
+	int fail;
+	long long wake;
+	struct client *next;	/* in the queue of thinking clients */
+};
+
+struct client *cl;
+struct room *rooms;
+int clients_n, room_size, rooms_n;
+int lockstep = 0, months_max = 0;
+long long think_ns = 0;
+enum policy policies[16];
+int policies_n = 0;
+struct sockaddr_storage addr;
+socklen_t addr_len;
+int epfd;
+
+struct client *think_head = NULL, *think_tail = NULL;
+int forming = 0, active = 0;
+long long commands = 0, bytes_in = 0, bytes_out = 0;
+/*orders the game refused, and commands the server could not take*/
+long long refused = 0, rejected = 0;
+long long t_start, t_connected = 0, t_play = 0;
+long long *samples = NULL;
+int samples_n = 0, samples_size = 0;
+int ends[end_drop+1];
+
+long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+void sample(long long ns)
+{
+	if (samples_n == samples_size) {
+		samples_size = samples_size ? samples_size*2 : 1024;
+		samples = realloc(samples, samples_size*sizeof(long long));
+	}
+	samples[samples_n++] = ns;
+}
+
+void watch(struct client *c, int op)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	if (c->out_done < c->out_len)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, op, c->sd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+void client_gone(struct client *c, enum cl_end why)
+{
+	if (c->state == cl_gone)
+		return;
+	close(c->sd);
+	c->state = cl_gone;
+	c->end = why;
+	ends[why]++;
+	active--;
+}
+
+void client_flush(struct client *c)
+{
+	int rc;
+	while (c->out_done < c->out_len) {
+		rc = write(c->sd, c->out+c->out_done, c->out_len-c->out_done);
+		if (rc == -1 && errno == EAGAIN)
+			break;
+		if (rc <= 0) {
+			client_gone(c, end_drop);
+			return;
+		}
+		c->out_done += rc;
+		bytes_out += rc;
+	}
+	if (c->out_done == c->out_len) {
+		c->out_done = c->out_len = 0;
+		if (c->turn_out) {
+			rooms[c->room].last_turn = now_ns();
+			c->turn_out = 0;
+		}
+	}
+	watch(c, EPOLL_CTL_MOD);
+}
+
+/*queues a command, sent by the next client_flush*/
+void client_say(struct client *c, const char *fmt, ...)
+{
+	va_list ap;
+	if (c->out_done) {
+		memmove(c->out, c->out+c->out_done, c->out_len-c->out_done);
+		c->out_len -= c->out_done;
+		c->out_done = 0;
+	}
+	va_start(ap, fmt);
+	c->out_len += vsnprintf(c->out+c->out_len, OUT_SIZE-c->out_len,
+		fmt, ap);
+	va_end(ap);
+	if (strncmp(c->out+c->out_len-5, "turn\n", 5) == 0)
+		c->turn_out = 1;
+}
+
+void client_start(struct client *c)
+{
+	int one = 1;
+	c->sd = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (c->sd == -1) {
+		perror("socket");
+		exit(1);
+	}
+	/*a full backlog makes a Unix socket fail at once, so wait for it*/
+	if (connect(c->sd, (struct sockaddr *)&addr, addr_len) == -1) {
+		perror("connect");
+		exit(1);
+	}
+	fcntl(c->sd, F_SETFL, fcntl(c->sd, F_GETFL) | O_NONBLOCK);
+	/*the commands of a month must not wait for the answers to totals*/
+	if (addr.ss_family == AF_INET)
+		setsockopt(c->sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	c->state = cl_waiting;
+	active++;
+	if (rooms_n > 1)
+		client_say(c, "tag load%d\n", c->room);
+	client_say(c, "delta\n");
+	watch(c, EPOLL_CTL_ADD);
+	client_flush(c);
+}
+
+/*writes the moves of the month into the plan as gamesim's strategies*/
+void plan_fool(struct client *c)
+{
+	int to_prod = 2, len = 0;
+	if (to_prod > c->material)
+		to_prod = c->material;
+	len += sprintf(c->plan+len, "prod %d\n", to_prod);
+	len += sprintf(c->plan+len, "sell %d %d\n", c->products,
+		c->max_price);
+	len += sprintf(c->plan+len, "buy 2 %d\n", c->min_price);
+	sprintf(c->plan+len, "turn\n");
+}
+
+void plan_clever(struct client *c)
+{
+	int to_sell_price = c->max_price;
+	int sold_min_price = c->min_sold;
+	int to_prod, to_buy, len = 0;
+	if (c->sold == 0 || (c->bought == 0 && c->material == 0))
+		c->fail++;
+	else
+		c->fail = 0;
+	if (sold_min_price == 0)
+		sold_min_price = 10000;
+	if (c->sum_products > c->buy_n) {
+		if (c->units_sold == c->buy_n)
+			to_sell_price = sold_min_price-1;
+		else
+			to_sell_price--;
+		to_sell_price -= c->fail*10;
+	}
+	/*the server can't even read a negative price*/
+	if (to_sell_price >= 0)
+		len += sprintf(c->plan+len, "sell %d %d\n", c->products,
+			to_sell_price);
+	for (to_prod=0; to_prod*(2300+c->min_price) < c->money
+		&& to_prod < c->factories; to_prod++)
+		;
+	if (to_prod > c->material)
+		to_prod = c->material;
+	len += sprintf(c->plan+len, "prod %d\n", to_prod);
+	c->money -= 2000*to_prod;
+	c->material -= to_prod;
+	to_buy = c->factories - c->material + to_prod;
+	if (to_buy > 0) {
+		len += sprintf(c->plan+len, "buy %d %d\n", to_buy,
+			c->min_price);
+		c->money -= to_buy*c->min_price;
+	}
+	if (c->money >= 20000)
+		len += sprintf(c->plan+len, "build\n");
+	sprintf(c->plan+len, "turn\n");
+}
+
+/*
+ * In lock-step the commands go one by one, and after a sale or purchase
+ * the next waits for the answer; the other commands are answered only
+ * when they are refused.
+ */
+void send_plan(struct client *c)
+{
+	char *line, *end;
+	if (!lockstep) {
+		for (line=c->plan; (end = strchr(line, '\n')); line = end+1) {
+			client_say(c, "%.*s", (int)(end-line+1), line);
+			commands++;
+		}
+		c->state = cl_turned;
+		client_flush(c);
+		return;
+	}
+	while (!c->pending && (end = strchr(c->plan+c->plan_pos, '\n'))) {
+		line = c->plan+c->plan_pos;
+		client_say(c, "%.*s", (int)(end-line+1), line);
+		commands++;
+		c->plan_pos = end+1 - c->plan;
+		if (strncmp(line, "sell", 4) == 0 || strncmp(line, "buy", 3) == 0)
+			c->pending = 1;
+		client_flush(c);
+		if (c->state == cl_gone)
+			return;
+	}
+	if (!c->plan[c->plan_pos])
+		c->state = cl_turned;
+}
+
+void act(struct client *c)
+{
+	if (c->policy == clever && c->state != cl_totals) {
+		c->state = cl_totals;
+		client_say(c, "totals\n");
+		commands++;
+		client_flush(c);
+		return;
+	}
+	if (c->policy == clever)
+		plan_clever(c);
+	else
+		plan_fool(c);
+	c->plan_pos = 0;
+	c->pending = 0;
+	c->state = cl_acting;
+	send_plan(c);
+}
+
+void month_begun(struct client *c)
+{
+	struct room *r = &rooms[c->room];
+	long long t = now_ns();
+	if (c->month > r->month) {
+		if (r->last_turn)
+			sample(t - r->last_turn);
+		r->month = c->month;
+		r->last_turn = 0;
+	}
+	if (months_max && c->month > months_max) {
+		client_gone(c, end_cut);
+		return;
+	}
+	if (!think_ns) {
+		act(c);
+		return;
+	}
+	c->state = cl_thinking;
+	c->wake = t + think_ns;
+	c->next = NULL;
+	if (think_tail)
+		think_tail->next = c;
+	else
+		think_head = c;
+	think_tail = c;
+}
+
+void digest_line(struct client *c, char *line)
+{
+	int n, a, b, k;
+	char tok[16], *p;
+	if (strcmp(line, "End of digest") == 0) {
+		c->in_digest = 0;
+		month_begun(c);
+	} else if (line[0] == '%') {
+		sscanf(line, "%% %d %d %d %d %d", &c->pl_count, &c->sell_n,
+			&c->min_price, &c->buy_n, &c->max_price);
+	} else if (sscanf(line, "Player %d %% %d %d %d %d", &n, &c->money,
+		&c->products, &c->material, &c->factories) == 5) {
+		/*only the line of the client itself has its number*/
+	} else if (sscanf(line, "# Player %d sold %d", &n, &a) == 2
+		|| sscanf(line, "s%d %d", &n, &a) == 2) {
+		if (n == c->number)
+			c->sold += a;
+	} else if (sscanf(line, "# Player %d bought %d", &n, &a) == 2
+		|| sscanf(line, "b%d %d %d", &n, &a, &b) == 3) {
+		if (n == c->number)
+			c->bought += a;
+	} else if (sscanf(line, "%d%n", &n, &k) == 1 && n == c->number) {
+		for (p=line+k; sscanf(p, " %15s%n", tok, &k) == 1; p += k) {
+			switch (tok[0]) {
+			case 'm':	c->money = atoi(tok+1); break;
+			case 'p':	c->products = atoi(tok+1); break;
+			case 'r':	c->material = atoi(tok+1); break;
+			case 'f':	c->factories = atoi(tok+1); break;
+			}
+		}
+	}
+}
+
+void totals_line(struct client *c, char *line)
+{
+	int a, b, d;
+	if (strcmp(line, "End of totals") == 0) {
+		c->in_totals = 0;
+		act(c);
+	} else if (sscanf(line, "%% product %d", &a) == 1)
+		c->sum_products = a;
+	else if (sscanf(line, "%% sold %d %d %d", &a, &b, &d) == 3) {
+		c->units_sold = a;
+		c->min_sold = b;
+	}
+}
+
+void client_line(struct client *c, char *line)
+{
+	struct room *r = &rooms[c->room];
+	int n;
+	if (c->in_digest) {
+		/*the player's own line is found by its number*/
+		if (sscanf(line, "Player %d", &n) == 1 && n != c->number)
+			return;
+		digest_line(c, line);
+		return;
+	}
+	if (c->in_totals) {
+		totals_line(c, line);
+		return;
+	}
+	if (sscanf(line, "Digest of month %%%d", &c->month) == 1) {
+		c->in_digest = 1;
+		c->sold = c->bought = 0;
+	} else if (strncmp(line, "Totals of month", 15) == 0)
+		c->in_totals = 1;
+	else if (sscanf(line, "Your number is %d", &c->number) == 1) {
+		t_connected = now_ns();
+	} else if (strcmp(line, "Let's play") == 0) {
+		if (!r->playing) {
+			r->playing = 1;
+			forming--;
+			if (!t_play)
+				t_play = now_ns();
+		}
+	} else if (strcmp(line, "Accepted.") == 0
+		|| strncmp(line, "Not enough", 10) == 0
+		|| strcmp(line, "Bank doesn't accept it") == 0
+		|| strcmp(line, "Syntax error!") == 0
+		|| strcmp(line, "Illegal command") == 0) {
+		if (line[0] == 'N' || line[0] == 'B')
+			refused++;
+		else if (line[0] != 'A')
+			rejected++;
+		if (c->pending) {
+			c->pending = 0;
+			send_plan(c);
+		}
+	} else if (strncmp(line, "YOU ARE BANKRUPT", 16) == 0)
+		client_gone(c, end_bankrupt);
+	else if (strcmp(line, "You are winner!") == 0)
+		client_gone(c, end_win);
+	else if (strcmp(line, "Game over :(") == 0)
+		client_gone(c, end_over);
+	else if (strncmp(line, "Sorry", 5) == 0) {
+		fprintf(stderr, "client %d: %s\n", (int)(c-cl), line);
+		client_gone(c, end_drop);
+	}
+}
+
+void client_read(struct client *c)
+{
+	int rc, i, from;
+	rc = read(c->sd, c->in+c->in_pos, IN_SIZE-c->in_pos);
+	if (rc == -1 && errno == EAGAIN)
+		return;
+	if (rc <= 0) {
+		client_gone(c, end_drop);
+		return;
+	}
+	bytes_in += rc;
+	c->in_pos += rc;
+	for (i=0,from=0; i<c->in_pos && c->state != cl_gone; i++) {
+		if (c->in[i] != '\n')
+			continue;
+		c->in[i] = '\0';
+		client_line(c, c->in+from);
+		from = i+1;
+	}
+	if (c->state == cl_gone)
+		return;
+	/*a line longer than the buffer is not one the clients care about*/
+	if (from == 0 && c->in_pos == IN_SIZE)
+		from = IN_SIZE;
+	memmove(c->in, c->in+from, c->in_pos-from);
+	c->in_pos -= from;
+}
+
+/*
+ * Starts a few clients at a time, reading between them, and keeps the
+ * number of rooms waiting for players within the pools of a matchmaker
+ */
+void open_clients(int *next)
+{
+	int n;
+	for (n=0; *next < clients_n && n < CONNECT_WINDOW; n++) {
+		struct client *c = &cl[*next];
+		if (c->room != (*next ? cl[*next-1].room : -1)) {
+			if (forming >= FORMING_ROOMS)
+				return;
+			forming++;
+		}
+		client_start(c);
+		(*next)++;
+	}
+}
+
+void wake_thinkers(void)
+{
+	long long t = now_ns();
+	while (think_head && think_head->wake <= t) {
+		struct client *c = think_head;
+		think_head = c->next;
+		if (!think_head)
+			think_tail = NULL;
+		if (c->state == cl_thinking)
+			act(c);
+	}
+}
+
+int wait_ms(void)
+{
+	long long d;
+	if (!think_head)
+		return 1000;
+	d = think_head->wake - now_ns();
+	return d <= 0 ? 0 : (d + 999999) / 1000000;
+}
+
+/*the CPU time of the process and its rooms in ns, -1 if it can't tell*/
+long long server_cpu(int pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long ut, st, cut, cst;
+	long long sum;
+	FILE *f;
+	int child;
+	sprintf(path, "/proc/%d/stat", pid);
+	if (!(f = fopen(path, "r")))
+		return -1;
+	p = fgets(buf, sizeof(buf), f) ? strrchr(buf, ')') : NULL;
+	fclose(f);
+	if (!p || sscanf(p, ") %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+		"%llu %llu %llu %llu", &ut, &st, &cut, &cst) != 4)
+		return -1;
+	sum = (ut+st+cut+cst) * (1000000000LL / sysconf(_SC_CLK_TCK));
+	sprintf(path, "/proc/%d/task/%d/children", pid, pid);
+	if ((f = fopen(path, "r"))) {
+		while (fscanf(f, "%d", &child) == 1) {
+			long long c = server_cpu(child);
+			if (c > 0)
+				sum += c;
+		}
+		fclose(f);
+	}
+	return sum;
+}
+
+int compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+long long percentile(int pc)
+{
+	if (!samples_n)
+		return 0;
+	return samples[(samples_n-1) * pc / 100];
+}
+
+void report(long long cpu)
+{
+	long long t_end = now_ns();
+	double connect_s = (t_connected - t_start) / 1e9;
+	double play_s = t_play ? (t_end - t_play) / 1e9 : 0;
+	int i;
+	qsort(samples, samples_n, sizeof(long long), compare_ll);
+	printf("{\n  \"clients\": %d,\n  \"room_size\": %d,\n"
+		"  \"rooms\": %d,\n  \"policies\": [", clients_n, room_size,
+		rooms_n);
+	for (i=0; i<policies_n; i++)
+		printf("%s\"%s\"", i ? ", " : "",
+			policies[i] == fool ? "fool" : "clever");
+	printf("],\n  \"mode\": \"%s\",\n  \"think_ms\": %lld,\n",
+		lockstep ? "lockstep" : "pipelined", think_ns/1000000);
+	printf("  \"connect_s\": %.6f,\n  \"connects_per_s\": %.0f,\n",
+		connect_s, connect_s > 0 ? clients_n / connect_s : 0);
+	printf("  \"play_s\": %.6f,\n  \"commands\": %lld,\n"
+		"  \"commands_per_s\": %.0f,\n", play_s, commands,
+		play_s > 0 ? commands / play_s : 0);
+	printf("  \"months\": %d,\n  \"month_end_us\": { \"p50\": %.1f, "
+		"\"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f },\n",
+		samples_n, percentile(50) / 1e3, percentile(90) / 1e3,
+		percentile(99) / 1e3, percentile(100) / 1e3);
+	printf("  \"bytes_in_per_month\": %.0f,\n"
+		"  \"bytes_out_per_month\": %.0f,\n",
+		samples_n ? (double)bytes_in / samples_n : 0,
+		samples_n ? (double)bytes_out / samples_n : 0);
+	if (cpu >= 0 && samples_n)
+		printf("  \"server_cpu_us_per_month\": %.1f,\n",
+			cpu / 1e3 / samples_n);
+	else
+		printf("  \"server_cpu_us_per_month\": null,\n");
+	printf("  \"refused\": %lld,\n  \"rejected\": %lld,\n",
+		refused, rejected);
+	printf("  \"wins\": %d,\n  \"bankrupt\": %d,\n  \"lost\": %d,\n"
+		"  \"cut\": %d,\n  \"dropped\": %d\n}\n", ends[end_win],
+		ends[end_bankrupt], ends[end_over], ends[end_cut],
+		ends[end_drop]);
+}
+
+/*returns the index of the number of clients in argv*/
+int set_address(int argc, char **argv, int i)
+{
+	struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+	struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+	if (i < argc && strncmp(argv[i], "unix:", 5) == 0
+		&& strlen(argv[i]+5) < sizeof(un->sun_path)) {
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, argv[i]+5);
+		addr_len = sizeof(*un);
+		return i+1;
+	}
+	if (i+1 >= argc || !inet_aton(argv[i], &in->sin_addr))
+		return -1;
+	in->sin_family = AF_INET;
+	in->sin_port = htons(atoi(argv[i+1]));
+	addr_len = sizeof(*in);
+	return i+2;
+}
+
+int main(int argc, char **argv)
+{
+	struct epoll_event ev[EVENTS];
+	struct rlimit rl;
+	int opt, i, n, next = 0, pid = 0;
+	long long cpu = -1;
+	while ((opt = getopt(argc, argv, "g:lt:k:p:")) != -1) {
+		switch (opt) {
+		case 'g':	room_size = atoi(optarg); break;
+		case 'l':	lockstep = 1; break;
+		case 't':	think_ns = atoll(optarg) * 1000000; break;
+		case 'k':	months_max = atoi(optarg); break;
+		case 'p':	pid = atoi(optarg); break;
+		default:	argc = 0;
+		}
+	}
+	i = argc ? set_address(argc, argv, optind) : -1;
+	if (i == -1 || i >= argc || (clients_n = atoi(argv[i])) < 1
+		|| room_size < 0) {
+		fprintf(stderr, "Usage: ./gameload [-g room_size] [-l] "
+			"[-t think_ms] [-k months] [-p server_pid]\n"
+			"                  ip port clients [policy ...]\n"
+			"       ./gameload [options] unix:/path clients "
+			"[policy ...]\n"
+			"policies: fool clever (fool by default)\n");
+		return 1;
+	}
+	for (i++; i < argc && policies_n < 16; i++) {
+		if (strcmp(argv[i], "fool") && strcmp(argv[i], "clever")) {
+			fprintf(stderr, "no such policy: %s\n", argv[i]);
+			return 1;
+		}
+		policies[policies_n++] = argv[i][0] == 'f' ? fool : clever;
+	}
+	if (!policies_n)
+		policies[policies_n++] = fool;
+	if (!room_size || room_size > clients_n)
+		room_size = clients_n;
+	rooms_n = (clients_n + room_size-1) / room_size;
+	/*every client takes a descriptor*/
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	cl = calloc(clients_n, sizeof(struct client));
+	rooms = calloc(rooms_n, sizeof(struct room));
+	for (i=0; i<clients_n; i++) {
+		cl[i].room = i / room_size;
+		cl[i].policy = policies[i % room_size % policies_n];
+	}
+	if ((epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	if (pid)
+		cpu = server_cpu(pid);
+	t_start = now_ns();
+	open_clients(&next);
+	while (active > 0 || next < clients_n) {
+		n = epoll_wait(epfd, ev, EVENTS, wait_ms());
+		if (n == -1 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (i=0; i<n; i++) {
+			struct client *c = ev[i].data.ptr;
+			if (c->state == cl_gone)
+				continue;
+			if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				client_read(c);
+			if (c->state != cl_gone && (ev[i].events & EPOLLOUT))
+				client_flush(c);
+		}
+		wake_thinkers();
+		open_clients(&next);
+	}
+	if (pid) {
+		long long end = server_cpu(pid);
+		cpu = cpu >= 0 && end >= 0 ? end - cpu : -1;
+	}
+	report(cpu);
+	/*the clients only send what the server should take*/
+	if (refused)
+		fprintf(stderr, "warning: %lld orders refused by the game\n",
+			refused);
+	if (rejected) {
+		fprintf(stderr, "%lld commands rejected by the server, the "
+			"games are not the ones played\n", rejected);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef GAMERING_H
+#define GAMERING_H
+
+#include <string.h>
+
+/*
+ * A bot on the same host may talk to the server through a pair of
+ * single-producer single-consumer rings in shared memory instead of its
+ * socket. A consumer that has nothing to read spins for a while and
+ * then sets "sleeping"; a producer that sees it set wakes it up.
+ */
+
+#define RING_SIZE (1 << 20)
+#define RING_SPIN_NS 50000
+
+struct ring {
+	unsigned head;		/* written by the producer only */
+	char pad1[60];
+	unsigned tail;		/* written by the consumer only */
+	int sleeping;
+	char pad2[56];
+	char data[RING_SIZE];
+};
+
+struct ring_pair {
+	struct ring in;		/* from the bot to the server */
+	struct ring out;	/* from the server to the bot */
+};
+
+/* returns 0 if there is no room for the whole message */
+static inline int ring_write(struct ring *r, const char *buf, unsigned len)
+{
+	unsigned head = r->head;
+	unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	unsigned i = head % RING_SIZE, n;
+	if (RING_SIZE - (head - tail) < len)
+		return 0;
+	n = RING_SIZE - i < len ? RING_SIZE - i : len;
+	memcpy(r->data + i, buf, n);
+	memcpy(r->data, buf + n, len - n);
+	__atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static inline unsigned ring_read(struct ring *r, char *buf, unsigned len)
+{
+	unsigned tail = r->tail;
+	unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	unsigned i = tail % RING_SIZE, n;
+	if (len > head - tail)
+		len = head - tail;
+	n = RING_SIZE - i < len ? RING_SIZE - i : len;
+	memcpy(buf, r->data + i, n);
+	memcpy(buf + n, r->data, len - n);
+	__atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+	return len;
+}
+
+static inline int ring_empty(struct ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail;
+}
+
+/* the producer has to wake the consumer up if this returns 1 */
+static inline int ring_sleeping(struct ring *r)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&r->sleeping, __ATOMIC_RELAXED);
+}
+
+/* returns 0 if something has come and the consumer must not sleep */
+static inline int ring_sleep(struct ring *r)
+{
+	__atomic_store_n(&r->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!ring_empty(r)) {
+		__atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+static inline void ring_wake(struct ring *r)
+{
+	__atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef GAMERULES_H
+#define GAMERULES_H
+
+/*
+ * The numbers of the economy. Every file that plays the rules keeps a
+ * copy of the sets of the registry made from the initializers below and
+ * has the accounting and the market compiled once for each of them, so
+ * that their numbers are folded in; any other set, such as one loaded
+ * from a file, is played by a copy that reads the numbers from the set.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RULES_LEVELS 5
+#define RULES_NAME 16
+
+enum rules_set { custom_rules, classic_rules, rich_rules };
+
+struct game_rules {
+	enum rules_set set;
+	char name[RULES_NAME];
+	/* a firm at the start */
+	int money, material, products, factories;
+	int prod_cost;		/* of a unit made */
+	int build_cost;		/* paid at the start and a month before the end */
+	int material_upkeep, product_upkeep, factory_upkeep;
+	/* chances out of 12 of the next month's level, level by level */
+	int level_change[RULES_LEVELS][RULES_LEVELS];
+	/* the bank's market at every level, per active player */
+	double level_sell[RULES_LEVELS];
+	int level_min[RULES_LEVELS];
+	double level_buy[RULES_LEVELS];
+	int level_max[RULES_LEVELS];
+};
+
+#define RULES_MARKET \
+	{ { 4, 4, 2, 1, 1 }, \
+	  { 3, 4, 3, 1, 1 }, \
+	  { 1, 3, 4, 3, 1 }, \
+	  { 1, 1, 3, 4, 3 }, \
+	  { 1, 1, 2, 4, 4 } }, \
+	{ 1, 1.5, 2, 2.5, 3 }, \
+	{ 800, 650, 500, 400, 300 }, \
+	{ 3, 2.5, 2, 1.5, 1 }, \
+	{ 6500, 6000, 5500, 5000, 4500 }
+
+/*the game as it has always been played*/
+#define RULES_CLASSIC { classic_rules, "classic", \
+	10000, 4, 2, 2, 2000, 2500, 300, 500, 1000, RULES_MARKET }
+
+/*twice the money and a factory more to start with: longer games*/
+#define RULES_RICH { rich_rules, "rich", \
+	20000, 4, 2, 3, 2000, 2500, 300, 500, 1000, RULES_MARKET }
+
+/*returns NULL if there is no set of that name in the registry*/
+const struct game_rules *rules_find(const char *name);
+
+/*
+ * A file of rules starts from the classic ones and changes those it
+ * names, a line each:
+ *	name N
+ *	start money material products factories
+ *	prod_cost N
+ *	build_cost N
+ *	upkeep material products factories
+ *	level L sell min_price buy max_price
+ *	change L c1 c2 c3 c4 c5
+ * Lines starting with # are left out. Returns NULL and the number of
+ * the bad line, 0 if the file cannot be opened; the set is malloc'd.
+ */
+struct game_rules *rules_load(const char *file, int *bad_line);
+
+/*a name from the registry or else a file; NULL after saying why*/
+const struct game_rules *rules_pick(const char *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,69 +1,84 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include "gamestat.h"
+#include "gamering.h"
+#include "gamecore.h"
+#include "gamehist.h"
+#include "gamecol.h"
 
 #define BUF_SIZE 128
-#define AUC_RES_SIZE 500
+#define AUC_LINE 100
+#define MARKET_SIZE 256
+#define TRACE_SIZE 4096
+#define LOG_RING_SIZE 8192
+#define LOG_RINGS 16
+#define LOG_BATCH 256
+#define LOG_SLEEP_NS 10000000
+#define EXP_SLEEP_NS 1000000
+#define EXP_WAIT_NS 100000000
+#define EXP_GROUP_ROWS 65536
+#define EXP_FILE_GROUPS 16
+#define JOURNAL_BUF 1024
+#define SPEC_MAX 10000
+#define SPEC_QUEUE 64
+#define SPEC_FEED 256
+#define HANDOVER_FDS 250
+#define LISTENERS 3
+#define SHM_POLL_NS 100000
+#define URING_ENTRIES 4096
+#define URING_BUFS 4096
+#define URING_BUF_SIZE 512
+#define URING_BGID 1
+#define URING_BATCH 64
+#define POOLS 64
+#define TAG_SIZE 16
+#define TAG_WAIT_MS 20
+#define ROOMS_MAX 1024
 
-int pl_count, pl_n;
-int started = 0, month = 0;
+int pl_n;
+struct game *game = NULL;
+const struct game_rules *rules = NULL;	/* classic unless -f says */
+int room_id = 0, room_slot = 0;
+int match_wait = 0;
+int snapshot_months = 10;
+volatile sig_atomic_t quit = 0;
+int use_uring = 0;
+char *seed_arg = NULL;	/* -d, the seed of the first game */
 
-struct build_f {
-	int days;
-	struct build_f *next;
-};
-
-enum st {
-	off = 0,
-	play = 1,
-	end_turn = 2,
-	bankrupt = -1,
-};
+enum feed_mode { no_feed, full_feed, delta_feed };
 
 struct player {
 	int sd;
-	enum st status;
 	char buf[BUF_SIZE];
 	int pos;
-	int money;
-	int material;
-	int products;
-	int for_prod;
-	int factories;
-	struct build_f *building;
+	enum feed_mode subscribed;
+	int fed;		/* the month of the last digest it got whole */
+	struct ring_pair *rings;
+	char *shm_name;
 };
 
-enum bank_mode { sell, buy, do_auction, market_info, market_change };
-
-struct request {
-	int player_n;
-	struct player *pl;
-	int price;
-	int count;
-};
-
-struct market_status {
-	int level;
-	int sell_n;
-	int min_price;
-	int buy_n;
-	int max_price;
-};
-
-struct auc {
-	struct request *req;
-	struct auc *next;
-};
-
-typedef void (*sat_ptr)(struct request *, int, char *);
-
 int is_number(char *str)
 {
 	int i;
@@ -116,7 +131,7 @@ struct list *make_list(char *buf, int n)
 		else {
 			ptr->str[i] = '\0';
 			if (buf[i+1]!='\0') {
-				ptr->next = make_list(&buf[i+1], n-i);
+				ptr->next = make_list(&buf[i+1], n-i-1);
 				break;
 			}
 		}
@@ -159,6 +174,9 @@ char **make_cmd(char *buf, int n)
 		cmd[i] = p->str;
 		p = p->next;
 	}
+	/*blanks at the end of the line leave empty words behind*/
+	for (; p; p = p->next)
+		free(p->str);
 	cmd[len] = NULL;
 	delete_list(cmd0);
 	return cmd;
@@ -175,29 +193,16 @@ void pl_init_all(struct player *p)
 {
 	int i;
 	for (i=0; i<pl_n; i++) {
-		p[i].status = off;
 		p[i].pos = 0;
 		p[i].sd = 0;
-		p[i].money = 10000;
-		p[i].material = 4;
-		p[i].for_prod = 0;
-		p[i].products = 2;
-		p[i].factories = 2;
-		p[i].building = NULL;
+		p[i].subscribed = no_feed;
+		p[i].fed = 0;
+		p[i].rings = NULL;
+		p[i].shm_name = NULL;
 		memset(p[i].buf, 0, BUF_SIZE);
 	}
 }
 
-int find_free_index(struct player *p)
-{
-	int i;
-	for (i=0; i<pl_n; i++) {
-		if (!p[i].status)
-			return i;
-	}
-	return -1;
-}
-
 int create_listening_socket(int port)
 {
 	struct sockaddr_in addr;
@@ -215,696 +220,4122 @@ int create_listening_socket(int port)
 		perror("bind");
 		exit(1);
 	}
-	if (listen(ls, 5) == -1) {
+	if (listen(ls, SOMAXCONN) == -1) {
 		perror("listen");
 		exit(1);
 	}
 	return ls;
 }
 
-void print_msg(struct player *p, const char *msg)
+struct trace_ev {
+	const char *name;
+	long long start;
+	long long dur;
+	int month;
+};
+
+struct trace_buf {
+	FILE *f;
+	const char *file;
+	int n;
+	struct trace_ev ev[TRACE_SIZE];
+};
+
+struct trace_buf *trace = NULL;
+
+long long now_ns(void)
 {
-	void end(struct player *);
-	if (write(p->sd, msg, strlen(msg)) == -1 && errno == EPIPE)
-		end(p);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
 }
 
-void notify_all(struct player *p, const char *mes)
+void trace_open(const char *file)
 {
-	int i;
-	for (i=0; i<pl_n; i++) {
-		if (p[i].status != off)
-			print_msg(&p[i], mes);
+	trace = malloc(sizeof(struct trace_buf));
+	if (!(trace->f = fopen(file, "w"))) {
+		perror(file);
+		exit(1);
 	}
+	trace->file = file;
+	trace->n = 0;
+	/*the closing bracket is optional in the JSON array format*/
+	fprintf(trace->f, "[\n");
 }
 
-char *how_many_players(void)
+/*every room started by the matchmaker has a trace file of its own*/
+void trace_room(void)
 {
-	static char status[42];
-	sprintf(status, "Now there are %d/%d players\n", pl_count, pl_n);
-	return status;
+	char *name;
+	if (!trace)
+		return;
+	name = malloc(strlen(trace->file)+16);
+	sprintf(name, "%s.%d", trace->file, room_id);
+	fclose(trace->f);
+	free(trace);
+	trace_open(name);
 }
 
-void end(struct player *p)
+void trace_flush(void)
 {
-	struct build_f *del_build(struct build_f *);
-	p->pos = 0;
-	if (p->status != bankrupt)
-		pl_count--;
-	if (p->building)
-		while (p->building)
-			p->building = del_build(p->building);
-	p->status = off;
-	shutdown(p->sd, 2);
-	close(p->sd);
+	int i;
+	if (!trace)
+		return;
+	for (i=0; i<trace->n; i++) {
+		struct trace_ev *e = &trace->ev[i];
+		fprintf(trace->f, "{\"name\":\"%s\",\"ph\":\"X\","
+			"\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,"
+			"\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"room\":%d,\"month\":%d}},\n",
+			e->name, e->start/1000, e->start%1000,
+			e->dur/1000, e->dur%1000, (int)getpid(),
+			room_id, room_id, e->month);
+	}
+	trace->n = 0;
+	fflush(trace->f);
 }
 
-void greet(struct player *p, int k)
+/*
+ * With -q the rooms share the CPU by deficit round robin. At every turn
+ * a room has the quantum added to its deficit and spends it on the
+ * slices of a long piece of work (a batch of commands, an auction, a
+ * broadcast), so that a huge room's month-end does not hold back the
+ * other rooms on the host. Once the deficit is spent the room yields,
+ * and every yield is a round of the others that earns it one more
+ * quantum. A slice that overran leaves the room in debt, down to
+ * DEFICIT_CAP quanta, which its next turns pay off; a room that has
+ * waited for its players keeps its debt but no credit.
+ */
+#define DEFICIT_CAP 4
+long long quantum = 0, deficit, slice_mark;
+
+/*a turn begins when the room is woken by its players*/
+void slice_start(void)
 {
-	char *n = how_many_players();
-	char *str = malloc(42);
-	sprintf(str, "Your number is %d\n", k+1);
-	print_msg(&p[k], "Welcome to my game!\n");
-	print_msg(&p[k], str);
-	print_msg(&p[k], "Type 'help' to get help\n");
-	notify_all(p, n);
-	free(str);
+	if (!quantum)
+		return;
+	slice_mark = now_ns();
+	if (deficit > 0)
+		deficit = 0;
+	deficit += quantum;
 }
 
-void print_market(struct player *p, int k, struct market_status *m)
+/*called between two slices of work*/
+void slice_end(void)
 {
-	char *str=malloc(150);
-	sprintf(str, "Current month is %%%d\n"
-		"Players still active:\n"
-		"%% \t     %d\n"
-		"bank sells: items min.price\n"
-		"%% \t     %d       %d\n"
-		"bank buys: items max.price\n"
-		"%% \t     %d       %d\n",
-		 month, pl_count, m->sell_n, m->min_price,
-		 m->buy_n, m->max_price);
-	print_msg(&p[k], str);
-	free(str);
+	long long t;
+	if (!quantum)
+		return;
+	t = now_ns();
+	deficit -= t - slice_mark;
+	slice_mark = t;
+	if (deficit > 0)
+		return;
+	if (deficit < -DEFICIT_CAP*quantum)
+		deficit = -DEFICIT_CAP*quantum;
+	while (deficit <= 0) {
+		sched_yield();
+		deficit += quantum;
+	}
+	slice_mark = now_ns();
 }
 
-int building_factories(struct build_f *ptr)
+/*returns 0 when tracing is off*/
+long long trace_begin(void)
 {
-	int k;
-	for (k=0; ptr; k++)
-		ptr = ptr->next;
-	return k;
+	return trace ? now_ns() : 0;
 }
 
-void print_player(struct player *p, int k, char **cmd)
+void trace_end(const char *name, long long start, int mon)
 {
-	int i;
-	if (cmd[1]==NULL || !is_number(cmd[1]) || cmd[2]!=NULL) {
-		print_msg(&p[k], "Syntax error!\n");
+	struct trace_ev *e;
+	if (!trace)
 		return;
+	e = &trace->ev[trace->n];
+	e->name = name;
+	e->start = start;
+	e->dur = now_ns() - start;
+	e->month = mon;
+	if (++trace->n == TRACE_SIZE)
+		trace_flush();
+}
+
+enum log_code { ev_join, ev_leave, ev_month, ev_prod, ev_sell, ev_buy,
+	ev_build, ev_turn, ev_sold, ev_bought, ev_bankrupt, ev_winner };
+
+const char *log_names[] = { "join", "leave", "month", "prod", "sell",
+	"buy", "build", "turn", "sold", "bought", "bankrupt", "winner" };
+
+struct log_rec {
+	long long ts;
+	short room;
+	short player;
+	short code;
+	short nargs;
+	int arg[3];
+};
+
+struct log_ring {
+	unsigned head;
+	char pad1[60];
+	unsigned tail;
+	char pad2[60];
+	unsigned long dropped;
+	struct log_rec rec[LOG_RING_SIZE];
+};
+
+struct logger {
+	int fd;
+	int rings;
+	struct log_ring *ring[LOG_RINGS];
+	pthread_mutex_t lock;
+	pthread_t thread;
+	volatile int stop;
+	unsigned long reported;
+	char out[LOG_BATCH*128];
+};
+
+struct logger *logger = NULL;
+__thread struct log_ring *log_ring = NULL;
+
+/*
+ * Called from the logger thread only: every ring has a single producer
+ * (its thread) and this thread is the single consumer.
+ */
+int log_drain(struct log_ring *r, char *out, int *len)
+{
+	unsigned tail = r->tail;
+	unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	int n = 0;
+	while (tail != head && n < LOG_BATCH) {
+		struct log_rec *e = &r->rec[tail % LOG_RING_SIZE];
+		time_t sec = e->ts / 1000000000LL;
+		struct tm tm;
+		int i;
+		localtime_r(&sec, &tm);
+		*len += strftime(out + *len, 32, "%F %T", &tm);
+		*len += sprintf(out + *len, ".%06lld room %d player %d %s",
+			e->ts % 1000000000LL / 1000, e->room, e->player,
+			log_names[e->code]);
+		for (i=0; i<e->nargs; i++)
+			*len += sprintf(out + *len, " %d", e->arg[i]);
+		out[(*len)++] = '\n';
+		tail++;
+		n++;
 	}
-	i = atoi(cmd[1]);
-	if (1<=i && i<=pl_n && p[i-1].status!=off) {
-		char *str = malloc(256);
-		if (p[i-1].status == bankrupt)
-			sprintf(str, "Player %d is a bankrupt\n", i);
-		else
-			sprintf(str, "Player %d has: dollars product "
-				"material factories building; makes turn\n"
-				"%% \t      %d \t %d \t %d\t  %d \t   %d"
-				"\t     %s \n",
-				i, p[i-1].money, p[i-1].products,
-				p[i-1].material, p[i-1].factories,
-				building_factories(p[i-1].building),
-				(p[i-1].status==play) ? "yes" : "no");
-		print_msg(&p[k], str);
-		free(str);
-	} else {
-		print_msg(&p[k], "There is no such player\n");
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	return n;
+}
+
+void *log_thread(void *arg)
+{
+	struct logger *l = arg;
+	for (;;) {
+		int i, n = 0, len = 0, rings;
+		unsigned long dropped = 0;
+		int stop = l->stop;
+		pthread_mutex_lock(&l->lock);
+		rings = l->rings;
+		pthread_mutex_unlock(&l->lock);
+		for (i=0; i<rings; i++) {
+			n += log_drain(l->ring[i], l->out, &len);
+			dropped += __atomic_load_n(&l->ring[i]->dropped,
+				__ATOMIC_RELAXED);
+			if (len && write(l->fd, l->out, len) == -1)
+				perror("log");
+			len = 0;
+		}
+		if (dropped != l->reported) {
+			len = sprintf(l->out, "logger dropped %lu records\n",
+				dropped - l->reported);
+			write(l->fd, l->out, len);
+			l->reported = dropped;
+		}
+		if (n == 0) {
+			struct timespec ts = { 0, LOG_SLEEP_NS };
+			if (stop)
+				break;
+			nanosleep(&ts, NULL);
+		}
 	}
-}	
+	return NULL;
+}
 
-void request_prod(struct player *p, int k, char **cmd)
+void log_open(const char *file)
 {
-	int i;
-	if (cmd[1]==NULL || !is_number(cmd[1]) || cmd[2]!=NULL
-		|| (i = atoi(cmd[1])) < 0) {
-		print_msg(&p[k], "Syntax error!\n");
-		return;
+	logger = malloc(sizeof(struct logger));
+	if ((logger->fd = open(file, O_WRONLY | O_CREAT | O_APPEND,
+		0644)) == -1) {
+		perror(file);
+		exit(1);
 	}
-	if (p[k].money < 2000*i) {
-		print_msg(&p[k], "Not enough money\n");
-		return;
+	logger->rings = 0;
+	logger->stop = 0;
+	logger->reported = 0;
+	pthread_mutex_init(&logger->lock, NULL);
+	if (pthread_create(&logger->thread, NULL, log_thread, logger)) {
+		fprintf(stderr, "can't start the logger\n");
+		exit(1);
 	}
-	if (p[k].material < i) {
-		print_msg(&p[k], "Not enough material\n");
+}
+
+void log_close(void)
+{
+	if (!logger)
 		return;
-	}
-	if (p[k].factories-p[k].for_prod < i) {
-		print_msg(&p[k], "Not enough factories\n");
+	logger->stop = 1;
+	pthread_join(logger->thread, NULL);
+	close(logger->fd);
+}
+
+/*a forked room has no logger thread and no ring of its own yet*/
+void log_fork(void)
+{
+	if (!logger)
 		return;
+	log_ring = NULL;
+	logger->rings = 0;
+	logger->stop = 0;
+	pthread_mutex_init(&logger->lock, NULL);
+	if (pthread_create(&logger->thread, NULL, log_thread, logger)) {
+		fprintf(stderr, "can't start the logger\n");
+		exit(1);
 	}
-	p[k].money -= 2000*i;
-	p[k].material -= i;
-	p[k].for_prod += i;
 }
 
-struct auc *accept_request(struct auc *queue, struct request *r,
-	enum bank_mode mode, struct market_status *st)
+struct log_ring *log_attach(void)
 {
-	if ((mode == sell && r->price > st->max_price)
-		|| (mode == buy && r->price < st->min_price)) {
-		if (mode == sell)
-			r->pl->products += r->count;
-		else
-			r->pl->money += r->price * r->count;
-		print_msg(r->pl, "Bank doesn't accept it\n");
+	struct log_ring *r = calloc(1, sizeof(struct log_ring));
+	pthread_mutex_lock(&logger->lock);
+	if (logger->rings == LOG_RINGS) {
+		pthread_mutex_unlock(&logger->lock);
 		free(r);
-		return queue;
-	}
-	if (queue == NULL) {
-		print_msg(r->pl, "Accepted.\n");
-		queue = malloc(sizeof(struct auc));
-		queue->req = r;
-		queue->next = NULL;
-	} else if (mode == sell && r->price > queue->req->price )
-		queue->next = accept_request(queue->next, r, sell, st);
-	else if (mode == buy && r->price < queue->req->price )
-		queue->next = accept_request(queue->next, r, buy, st);
-	else {
-		print_msg(r->pl, "Accepted.\n");
-		struct auc *tmp = malloc(sizeof(struct auc));
-		tmp->next = queue;
-		tmp->req = r;
-		return tmp;
-	}
-	return queue;
-}
-		
-void change_level(struct market_status *old)
-{
-	const int level_change[5][5] = {
-		{ 4, 4, 2, 1, 1 },
-		{ 3, 4, 3, 1, 1 },
-		{ 1, 3, 4, 3, 1 },
-		{ 1, 1, 3, 4, 3 },
-		{ 1, 1, 2, 4, 4 },
-	};
-	if (month == 1)
-		old->level = 3;
-	else {
-		int r = 1 + (int)(12.0*rand()/(RAND_MAX+1.0));
-		int i, sum;
-		for (i=0,sum=0; sum<r; i++)
-			sum += level_change[old->level-1][i];
-		old->level = i;
-	}
-	switch (old->level) {
-	case 1:
-		old->sell_n = pl_count;
-		old->min_price = 800;
-		old->buy_n = 3*pl_count;
-		old->max_price = 6500;
-		break;
-	case 2:
-		old->sell_n = (int)(1.5*pl_count);
-		old->min_price = 650;
-		old->buy_n = (int)(2.5*pl_count);
-		old->max_price = 6000;
-		break;
-	case 3:
-		old->sell_n = 2*pl_count;
-		old->min_price = 500;
-		old->buy_n = 2*pl_count;
-		old->max_price = 5500;
-		break;
-	case 4:
-		old->sell_n = (int)(2.5*pl_count);
-		old->min_price = 400;
-		old->buy_n = (int)(1.5*pl_count);
-		old->max_price = 5000;
-		break;
-	case 5:
-		old->sell_n = 3*pl_count;
-		old->min_price = 300;
-		old->buy_n = pl_count;
-		old->max_price = 4500;
-		break;
+		return NULL;
 	}
+	logger->ring[logger->rings++] = r;
+	pthread_mutex_unlock(&logger->lock);
+	return r;
 }
 
-struct auc *delete_request(struct auc *ptr)
+/*never blocks: a full ring only counts the record as dropped*/
+void log_event(enum log_code code, int player, int nargs,
+	int a0, int a1, int a2)
 {
-	struct auc *tmp;
-	tmp = ptr->next;
-	free(ptr->req);
-	free(ptr);
-	return tmp;
+	struct log_ring *r;
+	struct log_rec *e;
+	struct timespec ts;
+	unsigned head;
+	if (!logger)
+		return;
+	if (!(r = log_ring) && !(r = log_ring = log_attach()))
+		return;
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)
+		== LOG_RING_SIZE) {
+		__atomic_store_n(&r->dropped, r->dropped+1, __ATOMIC_RELAXED);
+		return;
+	}
+	e = &r->rec[head % LOG_RING_SIZE];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	e->ts = ts.tv_sec*1000000000LL + ts.tv_nsec;
+	e->room = room_id;
+	e->player = player;
+	e->code = code;
+	e->nargs = nargs;
+	e->arg[0] = a0;
+	e->arg[1] = a1;
+	e->arg[2] = a2;
+	__atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
 }
 
-void satisfy_buy(struct request *req, int ammount, char *auc_res)
+/*
+ * -a and -e both take every month as it is after the accounting, laid
+ * out as in gamehist.h. The game thread puts it together once.
+ */
+struct month_rec {
+	struct hist_deal *deals;	/* the orders, then the trades */
+	int deal_n, deal_size, orders;
+	char *buf;
+	int len, size;
+};
+
+struct month_rec *month_rec = NULL;
+
+void rec_deal(int player, int side, int count, int price)
 {
-	if (ammount>0) {
-		char *str = malloc(100);
-		sprintf(str, "# Player %d bought %d materials "
-			"and spent %d dollars\n",
-			req->player_n, ammount, req->price*ammount);
-		strcat(auc_res, str);
-		free(str);
+	struct month_rec *r = month_rec;
+	struct hist_deal *d;
+	if (!r)
+		return;
+	if (r->deal_n == r->deal_size) {
+		r->deal_size = r->deal_size ? r->deal_size*2 : 64;
+		r->deals = realloc(r->deals,
+			r->deal_size*sizeof(struct hist_deal));
 	}
-	req->pl->material += ammount;
-	req->pl->money += (req->count-ammount) * req->price;
+	d = &r->deals[r->deal_n++];
+	d->player = player;
+	d->side = side;
+	d->count = count;
+	d->price = price;
 }
 
-void satisfy_sell(struct request *req, int ammount, char *auc_res)
+/*the orders are taken before the auction eats them up*/
+void rec_orders(void)
 {
-	if (ammount>0) {
-		char *str = malloc(100);
-		sprintf(str, "# Player %d sold %d products "
-			"and gained %d dollars\n",
-			req->player_n, ammount, req->price*ammount);
-		strcat(auc_res, str);
-		free(str);
-	}
-	req->pl->money += ammount * req->price;
-	req->pl->products += req->count - ammount;
+	struct auc *a;
+	if (!month_rec)
+		return;
+	month_rec->deal_n = 0;
+	for (a=game->for_selling; a; a=a->next)
+		rec_deal(a->req->player_n, hist_sell, a->req->count,
+			a->req->price);
+	for (a=game->for_buying; a; a=a->next)
+		rec_deal(a->req->player_n, hist_buy, a->req->count,
+			a->req->price);
+	month_rec->orders = month_rec->deal_n;
 }
 
-
-struct auc *auc_chance(struct auc *queue, int possible_deals,
-	int participants, sat_ptr satisfy, char *auc_res)
+void rec_month(void)
 {
-	int r = 1 + (int)((float)(participants)*rand()/(RAND_MAX+1.0));
-	struct auc **tmp = &queue;
+	struct month_rec *r = month_rec;
+	struct hist_month *hm;
+	struct hist_firm *f;
 	int i;
-	for (i=0; i<r-1; i++)
-		tmp = &(*tmp)->next;
-	if ((*tmp)->req->count <= possible_deals) {
-		(*satisfy)((*tmp)->req, (*tmp)->req->count, auc_res);
-		possible_deals -= (*tmp)->req->count;
-	} else {
-		(*satisfy)((*tmp)->req, possible_deals, auc_res);
-		possible_deals = 0;
+	if (!r)
+		return;
+	r->len = sizeof(struct hist_month) + pl_n*sizeof(struct hist_firm)
+		+ r->deal_n*sizeof(struct hist_deal);
+	if (r->len > r->size) {
+		r->size = r->len*2;
+		r->buf = realloc(r->buf, r->size);
 	}
-	(*tmp) = delete_request(*tmp);
-	if (possible_deals > 0) {
-		return auc_chance(queue, possible_deals, participants-1,
-			satisfy, auc_res);
-	} else {
-		while (queue) {
-			(*satisfy)(queue->req, 0, NULL);
-			queue = delete_request(queue);
-		}
+	hm = (struct hist_month *)r->buf;
+	hm->month = game->month;
+	hm->level = game->st.level;
+	hm->sell_n = game->st.sell_n;
+	hm->min_price = game->st.min_price;
+	hm->buy_n = game->st.buy_n;
+	hm->max_price = game->st.max_price;
+	hm->players = pl_n;
+	hm->orders = r->orders;
+	hm->trades = r->deal_n - r->orders;
+	f = hist_firms(hm);
+	for (i=0; i<pl_n; i++) {
+		struct firm *pl = &game->pl[i];
+		f[i].status = pl->status;
+		f[i].money = pl->money;
+		f[i].products = pl->products;
+		f[i].material = pl->material;
+		f[i].factories = pl->factories;
+		f[i].building = game_building(pl->building);
 	}
-	return queue;
+	memcpy(hist_orders(hm), r->deals,
+		r->deal_n*sizeof(struct hist_deal));
+	r->deal_n = r->orders = 0;
 }
-	
-struct auc *auction(struct auc *queue, int possible_deals,
-	sat_ptr satisfy, char *auc_res)
-{
-	int best, participants, prod_n, i;
-	struct auc *tmp = queue;
-	if (queue == NULL)
-		return queue;
-	if (possible_deals == 0) {
-		while (queue) {
-			(*satisfy)(queue->req, 0, NULL);
-			queue = delete_request(queue);
-		}
-		return queue;
-	}
-	best = queue->req->price;
-	participants = prod_n = 0;
-	while (tmp && tmp->req->price == best) {
-		participants++;
-		prod_n += tmp->req->count;
-		tmp = tmp->next;
-	}
-	if (prod_n <= possible_deals) {
-		for (i=0; i<participants; i++) {
-			(*satisfy)(queue->req, queue->req->count, auc_res);
-			prod_n -= queue->req->count;
-			possible_deals -= queue->req->count;
-			queue = delete_request(queue);
-		}
-		return auction(queue, possible_deals, satisfy, auc_res);
-	} else {
-		return auc_chance(queue, possible_deals, participants,
-			satisfy, auc_res);
-	}
+
+void rec_want(void)
+{
+	if (!month_rec)
+		month_rec = calloc(1, sizeof(struct month_rec));
 }
 
-void bank(enum bank_mode mode, struct player *p, int k, struct request *req)
+/*
+ * With -a every month of a game goes into the store of finished games
+ * (gamehist.h). The game thread only gathers the month into a message;
+ * a thread of its own appends the messages to the store.
+ */
+struct hist_msg {
+	struct hist_msg *next;
+	int len;			/* 0 if the game is over */
+	struct hist_game game;
+	char data[];
+};
+
+struct historian {
+	int fd;				/* of the index */
+	char *dir;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t thread;
+	int stop;
+	struct hist_msg *first, *last;
+	/* the writer's own */
+	int seg, seg_fd;
+	struct hist_ref *months;
+	int month_n, month_size;
+	/* the game thread's own */
+	int months_sent, winner;
+};
+
+struct historian *hist = NULL;
+
+/*returns where the record has gone; called by the writer thread only*/
+struct hist_ref hist_append(struct historian *h, const void *data, int len)
 {
-	static struct market_status st;
-	static struct auc *for_selling = NULL, *for_buying = NULL;
-	static char auc_res[AUC_RES_SIZE];
-	auc_res[0] = '\0';
-	switch (mode) {
-	case sell:
-		for_selling = accept_request(for_selling, req, sell, &st);
-		break;
-	case buy:
-		for_buying = accept_request(for_buying, req, buy, &st);
-		break;
-	case market_change:
-		change_level(&st);
-		break;
-	case market_info:
-		print_market(p, k, &st);
-		break;
-	case do_auction:
-		for_selling = auction(for_selling, st.buy_n,
-			satisfy_sell, auc_res);
-		for_buying = auction(for_buying, st.sell_n,
-			satisfy_buy, auc_res);
-		notify_all(p, auc_res);
-		break;
+	struct hist_header hdr;
+	struct hist_ref ref;
+	struct stat st;
+	char name[PATH_MAX];
+	flock(h->fd, LOCK_EX);
+	pread(h->fd, &hdr, sizeof(hdr), 0);
+	if (h->seg != hdr.seg || h->seg_fd == -1) {
+		if (h->seg_fd != -1)
+			close(h->seg_fd);
+		snprintf(name, sizeof(name), "%s/" HIST_SEG, h->dir, hdr.seg);
+		h->seg_fd = open(name, O_RDWR | O_CREAT, 0644);
+		h->seg = hdr.seg;
 	}
+	fstat(h->seg_fd, &st);
+	if (st.st_size > 0 && st.st_size + len > HIST_SEG_MAX) {
+		close(h->seg_fd);
+		h->seg = ++hdr.seg;
+		pwrite(h->fd, &hdr, sizeof(hdr), 0);
+		snprintf(name, sizeof(name), "%s/" HIST_SEG, h->dir, hdr.seg);
+		h->seg_fd = open(name, O_RDWR | O_CREAT, 0644);
+		st.st_size = 0;
+	}
+	if (h->seg_fd == -1 || pwrite(h->seg_fd, data, len, st.st_size) != len)
+		perror("history");
+	flock(h->fd, LOCK_UN);
+	ref.seg = h->seg;
+	ref.len = len;
+	ref.off = st.st_size;
+	return ref;
 }
 
-void request_for_bank(struct player *p, int k, char **cmd)
+void hist_write(struct historian *h, struct hist_msg *m)
 {
-	struct request *r;
-	int count, price;
-	if (cmd[1]==NULL || !is_number(cmd[1]) || cmd[2]==NULL
-		|| !is_number(cmd[2]) || cmd[3]!=NULL
-		|| (count = atoi(cmd[1])) < 0
-		|| (price = atoi(cmd[2])) < 0) {
-		print_msg(&p[k], "Syntax error!\n");
+	struct stat st;
+	if (m->len) {
+		if (h->month_n == h->month_size) {
+			h->month_size = h->month_size ? h->month_size*2 : 64;
+			h->months = realloc(h->months,
+				h->month_size*sizeof(struct hist_ref));
+		}
+		h->months[h->month_n++] = hist_append(h, m->data, m->len);
 		return;
 	}
-	r = malloc(sizeof(struct request));
-	r->price = price;
-	r->count = count;
-	r->pl = &p[k];
-	r->player_n = k+1;
-	if (cmd[0][0]=='s') {
-		if (p[k].products >= r->count) {
-			p[k].products -= r->count;
-			bank(sell, p, k, r);
-		} else {
-			print_msg(&p[k], "Not enough product\n");
-			free(r);
-		}
-	} else {
-		if (p[k].money >= r->count * r->price) {
-			p[k].money -= r->price * r->count;
-			bank(buy, p, k, r);
-		} else {
-			print_msg(&p[k], "Not enough money\n");
-			free(r);
+	m->game.months = hist_append(h, h->months,
+		h->month_n*sizeof(struct hist_ref));
+	m->game.month_n = h->month_n;
+	h->month_n = 0;
+	flock(h->fd, LOCK_EX);
+	fstat(h->fd, &st);
+	if (pwrite(h->fd, &m->game, sizeof(m->game), st.st_size)
+		!= sizeof(m->game))
+		perror("history");
+	flock(h->fd, LOCK_UN);
+}
+
+void *hist_thread(void *arg)
+{
+	struct historian *h = arg;
+	struct hist_msg *m, *next;
+	for (;;) {
+		pthread_mutex_lock(&h->lock);
+		while (!h->first && !h->stop)
+			pthread_cond_wait(&h->wake, &h->lock);
+		m = h->first;
+		h->first = h->last = NULL;
+		pthread_mutex_unlock(&h->lock);
+		if (!m)
+			break;
+		for (; m; m = next) {
+			next = m->next;
+			hist_write(h, m);
+			free(m);
 		}
 	}
+	return NULL;
 }
 
-struct build_f *build(struct player *p, struct build_f *building)
+void hist_start(void)
 {
-	if (!building) {
-		if (p->money >= 2500) {
-			building = malloc(sizeof(struct build_f));
-			building->days = 5;
-			p->money -= 2500;
-			building->next = NULL;
-		} else {
-			print_msg(p, "Not enough money\n");
-		}
-	} else
-		build(p, building->next);
-	return building;
+	hist->first = hist->last = NULL;
+	hist->stop = 0;
+	hist->seg_fd = -1;
+	hist->month_n = 0;
+	pthread_mutex_init(&hist->lock, NULL);
+	pthread_cond_init(&hist->wake, NULL);
+	if (pthread_create(&hist->thread, NULL, hist_thread, hist)) {
+		fprintf(stderr, "can't start the history writer\n");
+		exit(1);
+	}
 }
 
-void execute(struct player *p, int k, char **cmd)
+void hist_open(const char *dir)
 {
-	if (strcmp(cmd[0], "help") == 0) {
-		print_msg(&p[k], "market \t\t information about market \n"
-			"player N \t information about player N\n"
-			"prod N \t\t make N units of product\n"
-			"buy N P \t try to buy N units of material "
-				"for P dollars \n"
-			"sell N P \t try to sell N units of product "
-				"for P dollars \n"
-			"build \t\t start building new factory\n"
-			"turn \t\t finish all the actions for this turn\n"
-			"help \t\t get help about commands\n");
-		return;
+	struct hist_header hdr = { HIST_MAGIC, 0 };
+	char name[PATH_MAX];
+	struct stat st;
+	hist = calloc(1, sizeof(struct historian));
+	hist->dir = strdup(dir);
+	mkdir(dir, 0755);
+	snprintf(name, sizeof(name), "%s/" HIST_INDEX, dir);
+	if ((hist->fd = open(name, O_RDWR | O_CREAT, 0644)) == -1) {
+		perror(name);
+		exit(1);
 	}
-	if (started) {
-		if (p[k].status == play) {
-			if (strcmp(cmd[0], "prod") == 0) {
-				request_prod(p, k, cmd);
-				return;
-			}
-			else if (strcmp(cmd[0], "buy") == 0
-					|| strcmp(cmd[0], "sell") == 0) {
-				request_for_bank(p, k, cmd);
-				return;
-			}
-			else if (strcmp(cmd[0], "build") == 0) {
-				p[k].building = build(&p[k], p[k].building);
-				return;
-			}
-			else if (strcmp(cmd[0], "turn") == 0) {
-				p[k].status = end_turn;
-				return;
-			}
-		}
-		if (strcmp(cmd[0], "market") == 0)
-			bank(market_info, p, k, NULL);
-		else if (strcmp(cmd[0], "player") == 0)
-			print_player(p, k, cmd);
-		else
-			print_msg(&p[k], "Illegal command\n");
-	} else {
-		print_msg(&p[k], "Game hasn't begun\n");
+	flock(hist->fd, LOCK_EX);
+	fstat(hist->fd, &st);
+	if (st.st_size == 0)
+		write(hist->fd, &hdr, sizeof(hdr));
+	else if (pread(hist->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+		|| memcmp(hdr.magic, HIST_MAGIC, 4) != 0) {
+		fprintf(stderr, "%s is not a game history\n", dir);
+		exit(1);
 	}
+	flock(hist->fd, LOCK_UN);
+	rec_want();
+	hist_start();
 }
 
-int recieve(struct player *p)
+/*a forked room has no writer thread yet*/
+void hist_fork(void)
 {
-	int rc, buflen;
-	char *ptr;
-	ptr = p->buf + p->pos;
-	buflen = BUF_SIZE - p->pos;
-	rc = read(p->sd, ptr, buflen);
-	if (rc != -1)
-		p->pos += rc;
-	return rc;
+	if (hist)
+		hist_start();
 }
-	
-void check_buf(struct player *p)
+
+void hist_send(struct hist_msg *m)
 {
-	if (p->pos+10 > BUF_SIZE)
-		p->pos = 0;
+	m->next = NULL;
+	pthread_mutex_lock(&hist->lock);
+	if (hist->last)
+		hist->last->next = m;
+	else
+		hist->first = m;
+	hist->last = m;
+	pthread_cond_signal(&hist->wake);
+	pthread_mutex_unlock(&hist->lock);
 }
 
-struct build_f *del_build(struct build_f *ptr)
+void hist_month(void)
 {
-	struct build_f *tmp;
-	if (ptr) {
-		tmp = ptr->next;
-		free(ptr);
-		ptr = tmp;
-	}
-	return ptr;
+	struct hist_msg *m;
+	if (!hist)
+		return;
+	m = malloc(sizeof(struct hist_msg) + month_rec->len);
+	m->len = month_rec->len;
+	memcpy(m->data, month_rec->buf, month_rec->len);
+	hist->months_sent++;
+	hist_send(m);
 }
 
-void handle_building(struct player *p)
+/*a game that has had a month goes into the index*/
+void hist_end(void)
 {
-	struct build_f **t = &p->building;
-	while (*t) {
-		(*t)->days--;
-		if ((*t)->days == 1)
-			p->money -= 2500;
-		if ((*t)->days == 0) {
-			p->factories++;
-			*t = del_build(*t);
-		} else {
-			t = &((*t)->next);
-		}
-	}
-} 
+	struct hist_msg *m;
+	struct timespec ts;
+	if (!hist || !hist->months_sent)
+		return;
+	m = calloc(1, sizeof(struct hist_msg));
+	clock_gettime(CLOCK_REALTIME, &ts);
+	m->game.ended = ts.tv_sec*1000000000LL + ts.tv_nsec;
+	m->game.room = room_id;
+	m->game.players = pl_n;
+	m->game.winner = hist->winner;
+	hist->months_sent = hist->winner = 0;
+	hist_send(m);
+}
 
-void new_month(struct player *p)
+void hist_close(void)
+{
+	if (!hist)
+		return;
+	hist_end();
+	pthread_mutex_lock(&hist->lock);
+	hist->stop = 1;
+	pthread_cond_signal(&hist->wake);
+	pthread_mutex_unlock(&hist->lock);
+	pthread_join(hist->thread, NULL);
+}
+
+/*
+ * With -e the months also go to an exporter thread through a ring, as
+ * a col_msg followed by the month record. The exporter spreads them
+ * over three tables (the market, the firms and the orders and trades)
+ * and writes each as column files of gamecol.h into the directory. A
+ * file is named <table>.<room>.<n> once it is complete and has
+ * <table>.<room>.<n>.part while it is written.
+ */
+enum exp_tables { exp_months, exp_firms, exp_deals, exp_tables };
+
+const char *exp_names[exp_tables] = { "months", "firms", "deals" };
+const char *exp_cols[exp_tables][COL_MAX] = {
+	{ "room", "game", "month", "level", "sell_n", "min_price",
+		"buy_n", "max_price", NULL },
+	{ "room", "game", "month", "player", "status", "money",
+		"products", "material", "factories", "building", NULL },
+	{ "room", "game", "month", "player", "trade", "side", "count",
+		"price", NULL }
+};
+
+struct col_msg {
+	int len;			/* of the month record */
+	int room;
+	int game;
+};
+
+struct exp_table {
+	int cols;
+	int rows;
+	int *col[COL_MAX];
+	FILE *f;
+	int groups, file_n;
+	char name[PATH_MAX];
+};
+
+struct exporter {
+	char *dir;
+	int group_rows, file_groups;
+	struct ring *ring;
+	pthread_t thread;
+	volatile int stop;
+	int wait;			/* rather than drop a month */
+	unsigned long dropped;
+	int game;
+	/* the exporter's own */
+	struct exp_table t[exp_tables];
+	char *msg;
+	unsigned char *out;
+	long long rows;
+};
+
+struct exporter *exporter = NULL;
+
+void exp_file(struct exp_table *t, int k, int room)
+{
+	struct col_header h;
+	char name[PATH_MAX+8];
+	int fd, i;
+	for (;; t->file_n++) {
+		snprintf(t->name, sizeof(t->name), "%s/%s.%d.%d",
+			exporter->dir, exp_names[k], room, t->file_n);
+		snprintf(name, sizeof(name), "%s.part", t->name);
+		if (access(t->name, F_OK) == 0)
+			continue;
+		if ((fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644)) != -1)
+			break;
+		if (errno != EEXIST) {
+			perror(name);
+			exit(1);
+		}
+	}
+	t->f = fdopen(fd, "w");
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, COL_MAGIC, 4);
+	h.cols = t->cols;
+	for (i=0; i<t->cols; i++)
+		strcpy(h.name[i], exp_cols[k][i]);
+	fwrite(&h, sizeof(h), 1, t->f);
+	t->groups = 0;
+}
+
+void exp_rotate(struct exp_table *t)
+{
+	char name[PATH_MAX+8];
+	snprintf(name, sizeof(name), "%s.part", t->name);
+	if (fclose(t->f) == EOF || rename(name, t->name) == -1)
+		perror(t->name);
+	t->f = NULL;
+	t->file_n++;
+}
+
+void exp_flush(struct exp_table *t, int k)
+{
+	struct col_group g;
+	unsigned char *out = exporter->out;
+	int i, len = 0;
+	if (!t->rows)
+		return;
+	if (!t->f)
+		exp_file(t, k, t->col[0][0]);
+	memset(&g, 0, sizeof(g));
+	g.rows = t->rows;
+	for (i=0; i<t->cols; i++) {
+		g.len[i] = col_encode(t->col[i], t->rows, out + len);
+		len += g.len[i];
+	}
+	if (fwrite(&g, sizeof(g), 1, t->f) != 1
+		|| fwrite(out, 1, len, t->f) != len)
+		perror(t->name);
+	t->rows = 0;
+	if (++t->groups == exporter->file_groups)
+		exp_rotate(t);
+}
+
+/*returns the row to fill in; the room changes only with a new file*/
+int exp_row(int k, const struct col_msg *c, int month)
+{
+	struct exp_table *t = &exporter->t[k];
+	if (t->rows == exporter->group_rows
+		|| (t->rows && t->col[0][0] != c->room))
+		exp_flush(t, k);
+	if (t->f && t->col[0][0] != c->room)
+		exp_rotate(t);
+	t->col[0][t->rows] = c->room;
+	t->col[1][t->rows] = c->game;
+	t->col[2][t->rows] = month;
+	exporter->rows++;
+	return t->rows++;
+}
+
+void exp_month(const struct col_msg *c, struct hist_month *m)
+{
+	struct exp_table *t = exporter->t;
+	struct hist_firm *f = hist_firms(m);
+	struct hist_deal *d = hist_orders(m);
+	int i, r;
+	r = exp_row(exp_months, c, m->month);
+	t[exp_months].col[3][r] = m->level;
+	t[exp_months].col[4][r] = m->sell_n;
+	t[exp_months].col[5][r] = m->min_price;
+	t[exp_months].col[6][r] = m->buy_n;
+	t[exp_months].col[7][r] = m->max_price;
+	for (i=0; i<m->players; i++) {
+		r = exp_row(exp_firms, c, m->month);
+		t[exp_firms].col[3][r] = i+1;
+		t[exp_firms].col[4][r] = f[i].status;
+		t[exp_firms].col[5][r] = f[i].money;
+		t[exp_firms].col[6][r] = f[i].products;
+		t[exp_firms].col[7][r] = f[i].material;
+		t[exp_firms].col[8][r] = f[i].factories;
+		t[exp_firms].col[9][r] = f[i].building;
+	}
+	for (i=0; i<m->orders+m->trades; i++) {
+		r = exp_row(exp_deals, c, m->month);
+		t[exp_deals].col[3][r] = d[i].player;
+		t[exp_deals].col[4][r] = i >= m->orders;
+		t[exp_deals].col[5][r] = d[i].side;
+		t[exp_deals].col[6][r] = d[i].count;
+		t[exp_deals].col[7][r] = d[i].price;
+	}
+}
+
+void *exp_thread(void *arg)
+{
+	struct exporter *x = arg;
+	struct col_msg c;
+	int k, stop;
+	for (;;) {
+		stop = x->stop;
+		if (ring_empty(x->ring)) {
+			struct timespec ts = { 0, EXP_WAIT_NS };
+			if (stop)
+				break;
+			if (ring_sleep(x->ring)) {
+				syscall(SYS_futex, &x->ring->head, FUTEX_WAIT,
+					x->ring->tail, &ts, 0, 0);
+				ring_wake(x->ring);
+			}
+			continue;
+		}
+		ring_read(x->ring, (char *)&c, sizeof(c));
+		/*the month may still be on its way*/
+		while (__atomic_load_n(&x->ring->head, __ATOMIC_ACQUIRE)
+			- x->ring->tail < c.len)
+			sched_yield();
+		ring_read(x->ring, x->msg, c.len);
+		exp_month(&c, (struct hist_month *)x->msg);
+	}
+	for (k=0; k<exp_tables; k++) {
+		exp_flush(&x->t[k], k);
+		if (x->t[k].f)
+			exp_rotate(&x->t[k]);
+	}
+	return NULL;
+}
+
+void exp_start(int wait)
+{
+	struct exporter *x = exporter;
+	int i, k;
+	x->wait = wait;
+	x->stop = 0;
+	x->dropped = 0;
+	x->game = 0;
+	x->rows = 0;
+	x->ring = calloc(1, sizeof(struct ring));
+	x->msg = malloc(RING_SIZE);
+	x->out = malloc(x->group_rows*5*COL_MAX);
+	for (k=0; k<exp_tables; k++) {
+		struct exp_table *t = &x->t[k];
+		memset(t, 0, sizeof(*t));
+		while (exp_cols[k][t->cols])
+			t->cols++;
+		for (i=0; i<t->cols; i++)
+			t->col[i] = malloc(x->group_rows*sizeof(int));
+	}
+	if (pthread_create(&x->thread, NULL, exp_thread, x)) {
+		fprintf(stderr, "can't start the exporter\n");
+		exit(1);
+	}
+}
+
+void exp_open(const char *dir)
+{
+	exporter = calloc(1, sizeof(struct exporter));
+	exporter->dir = strdup(dir);
+	exporter->group_rows = EXP_GROUP_ROWS;
+	exporter->file_groups = EXP_FILE_GROUPS;
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		perror(dir);
+		exit(1);
+	}
+	rec_want();
+}
+
+/*a forked room starts an exporter of its own*/
+void exp_fork(void)
+{
+	if (exporter)
+		exp_start(0);
+}
+
+/*never blocks, unless told to wait: a full ring drops the month*/
+void exp_send(void)
+{
+	struct col_msg c;
+	struct timespec ts = { 0, EXP_SLEEP_NS };
+	if (!exporter)
+		return;
+	c.len = month_rec->len;
+	c.room = room_id;
+	c.game = exporter->game;
+	if (sizeof(c) + c.len > RING_SIZE) {
+		exporter->dropped++;
+		return;
+	}
+	while (RING_SIZE - (exporter->ring->head - __atomic_load_n(
+		&exporter->ring->tail, __ATOMIC_ACQUIRE)) < sizeof(c) + c.len) {
+		if (!exporter->wait) {
+			exporter->dropped++;
+			return;
+		}
+		nanosleep(&ts, NULL);
+	}
+	ring_write(exporter->ring, (char *)&c, sizeof(c));
+	ring_write(exporter->ring, month_rec->buf, c.len);
+	if (ring_sleeping(exporter->ring))
+		syscall(SYS_futex, &exporter->ring->head, FUTEX_WAKE, 1,
+			NULL, 0, 0);
+}
+
+void exp_end(void)
+{
+	if (exporter)
+		exporter->game++;
+}
+
+void exp_close(void)
+{
+	if (!exporter)
+		return;
+	exporter->stop = 1;
+	syscall(SYS_futex, &exporter->ring->head, FUTEX_WAKE, 1, NULL, 0, 0);
+	pthread_join(exporter->thread, NULL);
+	if (exporter->dropped)
+		fprintf(stderr, "exporter dropped %lu months\n",
+			exporter->dropped);
+}
+
+struct game_stats *stats = NULL;
+long long month_end_ns = 0;
+
+void stats_open(const char *name)
+{
+	int fd;
+	if ((fd = shm_open(name, O_CREAT | O_RDWR, 0644)) == -1) {
+		perror(name);
+		exit(1);
+	}
+	if (ftruncate(fd, sizeof(struct game_stats)) == -1) {
+		perror("ftruncate");
+		exit(1);
+	}
+	stats = mmap(NULL, sizeof(struct game_stats),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (stats == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+	memset(stats, 0, sizeof(struct game_stats));
+	stats->rooms = 1;
+	__atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+}
+
+enum jr_type { jr_join, jr_leave, jr_month, jr_seed, jr_drop, jr_prod,
+	jr_sell, jr_buy, jr_build, jr_turn, jr_subscribe, jr_delta,
+	jr_snapshot };
+
+struct jr_header {
+	char magic[4];
+	int players;
+	int room;
+	int snapshot_months;
+	char rules[RULES_NAME];	/* GSJ2 had none and is classic */
+};
+
+struct jr_rec {
+	unsigned char type;
+	unsigned char ntok;
+	unsigned short player;
+	int arg[2];
+};
+
+struct journal {
+	int fd;
+	struct player *base;
+	int active;
+	int writes;
+	int n;
+	struct jr_rec buf[JOURNAL_BUF];
+	/*replay only*/
+	struct jr_rec *next, *end;
+	unsigned seed;
+};
+
+struct journal *journal = NULL;
+
+void journal_flush(void)
+{
+	if (!journal || journal->fd == -1 || !journal->n)
+		return;
+	if (write(journal->fd, journal->buf,
+		journal->n*sizeof(struct jr_rec)) == -1)
+		perror("journal");
+	journal->n = 0;
+}
+
+/*a game taken over from another process goes on in the same journal*/
+void journal_open(const char *file, struct player *p, int append)
+{
+	struct jr_header h = { { 'G', 'S', 'J', '3' }, pl_n, room_id,
+		snapshot_months };
+	char *name = malloc(strlen(file)+16);
+	sprintf(name, "%s.%d", file, room_id);
+	journal = malloc(sizeof(struct journal));
+	if ((journal->fd = open(name, O_WRONLY | O_CREAT |
+		(append ? O_APPEND : O_TRUNC), 0644)) == -1) {
+		perror(name);
+		exit(1);
+	}
+	strcpy(h.rules, game->rules->name);
+	if (lseek(journal->fd, 0, SEEK_END) == 0)
+		write(journal->fd, &h, sizeof(h));
+	journal->base = p;
+	journal->active = journal->n = 0;
+	journal->next = journal->end = NULL;
+	free(name);
+}
+
+void journal_rec(enum jr_type type, int k, int ntok, int a0, int a1)
+{
+	struct jr_rec *r;
+	if (!journal || journal->fd == -1)
+		return;
+	r = &journal->buf[journal->n];
+	r->type = type;
+	r->ntok = ntok;
+	r->player = k;
+	r->arg[0] = a0;
+	r->arg[1] = a1;
+	if (++journal->n == JOURNAL_BUF)
+		journal_flush();
+}
+
+/*
+ * Everything written to players between journal_begin() and
+ * journal_end() is counted, so that a write failing with EPIPE can be
+ * failed again at the same place during replay.
+ */
+void journal_begin(enum jr_type type, int k, int ntok, int a0, int a1)
+{
+	if (!journal)
+		return;
+	journal_rec(type, k, ntok, a0, a1);
+	journal->active = 1;
+	journal->writes = 0;
+}
+
+void journal_end(void)
+{
+	if (journal)
+		journal->active = 0;
+}
+
+int token_arg(char *tok)
+{
+	if (!tok || !is_number(tok))
+		return -1;
+	return atoi(tok);
+}
+
+const char *jr_cmds[] = { "prod", "sell", "buy", "build", "turn",
+	"subscribe", "delta", "snapshot" };
+
+void journal_cmd(struct player *p, int k, char **cmd)
+{
+	int i, ntok;
+	if (!journal)
+		return;
+	for (i=0; i<8; i++) {
+		if (strcmp(cmd[0], jr_cmds[i]) == 0)
+			break;
+	}
+	if (i == 8)
+		return;
+	/*subscribing changes what the player is sent even before the game*/
+	if (jr_prod+i < jr_subscribe && (!game->started
+		|| game->pl[k].status != play))
+		return;
+	for (ntok=1; ntok<4 && cmd[ntok]; ntok++)
+		;
+	journal_begin(jr_prod+i, k, ntok, token_arg(cmd[1]),
+		ntok > 2 ? token_arg(cmd[2]) : -1);
+}
+
+/*returns 1 if the write to p has to fail*/
+int journal_write(struct player *p)
+{
+	struct jr_rec *r;
+	if (!journal || !journal->active)
+		return 0;
+	journal->writes++;
+	if (journal->fd != -1)
+		return 0;
+	for (r=journal->next; r<journal->end; r++) {
+		if (r->type == jr_drop && r->player == p - journal->base
+			&& r->arg[0] == journal->writes)
+			return 1;
+	}
+	return 0;
+}
+
+void journal_drop(struct player *p)
+{
+	if (journal)
+		journal_rec(jr_drop, p - journal->base, 0,
+			journal->active ? journal->writes : -1, 0);
+}
+
+unsigned game_seed(void)
+{
+	static unsigned games = 0;
+	unsigned seed;
+	if (journal && journal->fd == -1)
+		return journal->seed;
+	if (seed_arg)
+		seed = strtoul(seed_arg, NULL, 10) + games++;
+	else
+		seed = time(NULL) ^ getpid() << 16 ^ games++ * 2654435761U;
+	journal_rec(jr_seed, 0, 0, seed, 0);
+	return seed;
+}
+
+/*returns 0 if the message has not gone out whole*/
+int print_msg(struct player *p, const char *msg)
+{
+	void end(struct player *);
+	void uring_write(int, const char *, int);
+	int len = strlen(msg);
+	if (journal_write(p)) {
+		end(p);
+		return 0;
+	}
+	if (p->sd < 0)
+		return 0;
+	if (p->rings) {
+		/*a bot that lets its ring fill up is as good as gone*/
+		if (!ring_write(&p->rings->out, msg, len)) {
+			journal_drop(p);
+			end(p);
+			return 0;
+		} else if (ring_sleeping(&p->rings->out)) {
+			syscall(SYS_futex, &p->rings->out.head, FUTEX_WAKE, 1,
+				NULL, NULL, 0);
+		}
+		return 1;
+	}
+	if (use_uring) {
+		uring_write(p->sd, msg, len);
+		return 1;
+	}
+	if (write(p->sd, msg, len) != len) {
+		if (errno == EPIPE) {
+			journal_drop(p);
+			end(p);
+		}
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * A bot on the same host may ask to go on through a pair of rings in
+ * shared memory. The socket stays open: the server learns from it that
+ * the bot has gone, and the bot rings it when the server sleeps.
+ */
+int shm_count = 0;
+long long last_poll = 0;
+
+void shm_attach(struct player *p)
+{
+	char name[40], msg[48];
+	struct ring_pair *rings = MAP_FAILED;
+	int fd;
+	if (p->rings) {
+		print_msg(p, "You are in shared memory already\n");
+		return;
+	}
+	sprintf(name, "/gameserv.%d.%d", (int)getpid(), p->sd);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd != -1 && ftruncate(fd, sizeof(struct ring_pair)) != -1)
+		rings = mmap(NULL, sizeof(struct ring_pair),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fd != -1)
+		close(fd);
+	if (rings == MAP_FAILED) {
+		if (fd != -1)
+			shm_unlink(name);
+		print_msg(p, "Can't use shared memory\n");
+		return;
+	}
+	sprintf(msg, "shm %s\n", name);
+	print_msg(p, msg);
+	p->rings = rings;
+	p->shm_name = strdup(name);
+	shm_count++;
+}
+
+/*returns -1 if the segment is gone*/
+int shm_map(struct player *p, const char *name)
+{
+	struct ring_pair *rings = MAP_FAILED;
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd == -1)
+		return -1;
+	rings = mmap(NULL, sizeof(struct ring_pair), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (rings == MAP_FAILED)
+		return -1;
+	p->rings = rings;
+	p->shm_name = strdup(name);
+	shm_count++;
+	return 0;
+}
+
+void shm_detach(struct player *p)
+{
+	if (!p->rings)
+		return;
+	munmap(p->rings, sizeof(struct ring_pair));
+	shm_unlink(p->shm_name);
+	free(p->shm_name);
+	p->rings = NULL;
+	p->shm_name = NULL;
+	shm_count--;
+}
+
+int shm_pending(struct player *p)
+{
+	int i;
+	for (i=0; i<pl_n; i++) {
+		if (p[i].rings && game->pl[i].status != off
+			&& !ring_empty(&p[i].rings->in))
+			return 1;
+	}
+	return 0;
+}
+
+/*returns 1 if a bot has spoken within the spin time*/
+int shm_spin(struct player *p)
+{
+	static int cpus = 0;
+	long long start = now_ns();
+	/*with one CPU the bot can't write while we spin*/
+	if (!cpus)
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 2)
+		return shm_pending(p);
+	do {
+		if (shm_pending(p))
+			return 1;
+	} while (now_ns() - start < RING_SPIN_NS);
+	return 0;
+}
+
+/*returns 0 if a bot has spoken while we were going to sleep*/
+int shm_sleep(struct player *p)
+{
+	int i;
+	for (i=0; i<pl_n; i++) {
+		if (p[i].rings && game->pl[i].status != off
+			&& !ring_sleep(&p[i].rings->in))
+			return 0;
+	}
+	return 1;
+}
+
+void shm_wake(struct player *p)
+{
+	int i;
+	for (i=0; i<pl_n; i++) {
+		if (p[i].rings)
+			ring_wake(&p[i].rings->in);
+	}
+}
+
+/*
+ * While the bots keep talking through their rings the sockets are only
+ * polled every SHM_POLL_NS, so a message in a ring costs no system call.
+ */
+int wait_events(struct player *p, struct pollfd *fds, int n)
+{
+	int rc, timeout = -1;
+	if (shm_count) {
+		if (shm_spin(p) && now_ns() - last_poll < SHM_POLL_NS)
+			return 0;
+		if (!shm_sleep(p))
+			timeout = 0;
+	}
+	rc = poll(fds, n, timeout);
+	last_poll = now_ns();
+	if (shm_count)
+		shm_wake(p);
+	return rc;
+}
+
+/*
+ * A broadcast is formatted once and shared by the queues of all the
+ * spectators; the last one to send it frees it.
+ */
+struct bcast {
+	int refs;
+	int len;
+	char text[1];
+};
+
+struct spectator {
+	int sd;
+	unsigned head, tail;
+	int off;
+	unsigned long dropped;
+	struct bcast *q[SPEC_QUEUE];
+};
+
+struct spectator *spec = NULL;
+int spec_ls = -1, spec_count = 0, spec_top = 0;
+
+char *upgrade_path = NULL, *unix_path = NULL;
+int up_ls = -1, un_ls = -1;
+
+/*
+ * The spectators have a thread of their own at the lowest priority, so
+ * that they get only the CPU time the players leave. The game thread
+ * hands it every broadcast through a ring and rings a pipe; the thread
+ * queues it to the spectators and accepts, reads and writes them by a
+ * poll set of its own. Outside of the thread only the ring is touched,
+ * and the spectators themselves while it is stopped for a handover.
+ */
+struct watch {
+	pthread_t thread;
+	int running;
+	volatile int stop;
+	int wake[2];
+	struct bcast *feed[SPEC_FEED];
+	unsigned head, tail;	/*the game thread's and the watcher's*/
+	unsigned long lost;	/*broadcasts that found the ring full*/
+	int month, pl_count;	/*for the welcome*/
+} watch;
+
+void spec_init(int ls)
+{
+	int i;
+	spec_ls = ls;
+	spec = malloc(SPEC_MAX*sizeof(struct spectator));
+	for (i=0; i<SPEC_MAX; i++)
+		spec[i].sd = -1;
+}
+
+void release(struct bcast *b)
+{
+	if (--b->refs == 0)
+		free(b);
+}
+
+void spec_close(struct spectator *s)
+{
+	while (s->head != s->tail)
+		release(s->q[s->head++ % SPEC_QUEUE]);
+	close(s->sd);
+	s->sd = -1;
+	__atomic_store_n(&spec_count, spec_count-1, __ATOMIC_RELAXED);
+	while (spec_top > 0 && spec[spec_top-1].sd == -1)
+		spec_top--;
+}
+
+/*a spectator that falls behind loses messages, never the players*/
+void spec_push(struct spectator *s, struct bcast *b)
+{
+	if (s->tail - s->head == SPEC_QUEUE) {
+		s->dropped++;
+		return;
+	}
+	s->q[s->tail++ % SPEC_QUEUE] = b;
+	b->refs++;
+}
+
+struct bcast *make_bcast(const char *mes)
+{
+	int len = strlen(mes);
+	struct bcast *b = malloc(sizeof(struct bcast)+len);
+	b->refs = 0;
+	b->len = len;
+	memcpy(b->text, mes, len);
+	return b;
+}
+
+int watched(void)
+{
+	return __atomic_load_n(&spec_count, __ATOMIC_RELAXED);
+}
+
+/*called by the game thread, never waits for the spectators*/
+void spectate(const char *mes)
+{
+	unsigned head = watch.head;
+	__atomic_store_n(&watch.month, game->month, __ATOMIC_RELAXED);
+	__atomic_store_n(&watch.pl_count, game->pl_count, __ATOMIC_RELAXED);
+	if (!watch.running || !watched())
+		return;
+	if (head - __atomic_load_n(&watch.tail, __ATOMIC_ACQUIRE)
+		== SPEC_FEED) {
+		watch.lost++;
+		return;
+	}
+	watch.feed[head % SPEC_FEED] = make_bcast(mes);
+	__atomic_store_n(&watch.head, head+1, __ATOMIC_RELEASE);
+	write(watch.wake[1], "", 1);
+}
+
+/*the broadcasts handed over go into the queues of all the spectators*/
+void watch_drain(void)
+{
+	unsigned tail = watch.tail;
+	unsigned head = __atomic_load_n(&watch.head, __ATOMIC_ACQUIRE);
+	int i;
+	for (; tail != head; tail++) {
+		struct bcast *b = watch.feed[tail % SPEC_FEED];
+		for (i=0; i<spec_top; i++) {
+			if (spec[i].sd != -1)
+				spec_push(&spec[i], b);
+		}
+		if (!b->refs)
+			free(b);
+	}
+	__atomic_store_n(&watch.tail, tail, __ATOMIC_RELEASE);
+}
+
+void spec_flush(struct spectator *s)
+{
+	while (s->head != s->tail) {
+		struct bcast *b = s->q[s->head % SPEC_QUEUE];
+		int rc = write(s->sd, b->text + s->off, b->len - s->off);
+		if (rc == -1) {
+			if (errno != EAGAIN)
+				spec_close(s);
+			return;
+		}
+		s->off += rc;
+		if (s->off < b->len)
+			return;
+		s->off = 0;
+		s->head++;
+		release(b);
+	}
+}
+
+/*returns -1 if there are too many spectators*/
+int spec_add(int fd)
+{
+	int i;
+	for (i=0; i<SPEC_MAX && spec[i].sd != -1; i++)
+		;
+	if (i == SPEC_MAX) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	spec[i].sd = fd;
+	spec[i].head = spec[i].tail = 0;
+	spec[i].off = 0;
+	spec[i].dropped = 0;
+	__atomic_store_n(&spec_count, spec_count+1, __ATOMIC_RELAXED);
+	if (i >= spec_top)
+		spec_top = i+1;
+	return i;
+}
+
+void spec_welcome(int fd)
+{
+	char str[128];
+	int i;
+	if ((i = spec_add(fd)) == -1)
+		return;
+	sprintf(str, "Welcome to my game!\nYou are a spectator\n"
+		"Current month is %%%d\nNow there are %d/%d players\n",
+		__atomic_load_n(&watch.month, __ATOMIC_RELAXED),
+		__atomic_load_n(&watch.pl_count, __ATOMIC_RELAXED), pl_n);
+	spec_push(&spec[i], make_bcast(str));
+}
+
+void spec_accept(void)
+{
+	int fd;
+	if ((fd = accept(spec_ls, NULL, NULL)) != -1)
+		spec_welcome(fd);
+}
+
+/*fds[0] is the wake pipe, fds[1] the watch port, then every spectator*/
+void *watch_thread(void *arg)
+{
+	struct pollfd *fds = malloc((2+SPEC_MAX)*sizeof(struct pollfd));
+	char buf[BUF_SIZE];
+	int i;
+	/*on Linux the nice value is the thread's own*/
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+	while (!watch.stop) {
+		watch_drain();
+		fds[0].fd = watch.wake[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = spec_ls;
+		fds[1].events = POLLIN;
+		for (i=0; i<spec_top; i++) {
+			fds[2+i].fd = spec[i].sd;
+			fds[2+i].events = POLLIN;
+			if (spec[i].head != spec[i].tail)
+				fds[2+i].events |= POLLOUT;
+		}
+		if (poll(fds, 2+spec_top, -1) == -1)
+			continue;
+		if (fds[0].revents)
+			while (read(watch.wake[0], buf, BUF_SIZE) > 0)
+				;
+		if (fds[1].revents)
+			spec_accept();
+		for (i=0; i<spec_top; i++) {
+			struct spectator *s = &spec[i];
+			short ev = fds[2+i].revents;
+			if (s->sd == -1 || !ev)
+				continue;
+			if (ev & (POLLIN | POLLHUP | POLLERR)) {
+				if (read(s->sd, buf, BUF_SIZE) <= 0) {
+					spec_close(s);
+					continue;
+				}
+			}
+			if (ev & POLLOUT)
+				spec_flush(s);
+		}
+	}
+	free(fds);
+	return NULL;
+}
+
+void watch_start(void)
+{
+	sigset_t set, old;
+	if (spec_ls == -1 || watch.running)
+		return;
+	if (!watch.wake[0]) {
+		if (pipe(watch.wake) == -1) {
+			perror("pipe");
+			exit(1);
+		}
+		fcntl(watch.wake[0], F_SETFL, O_NONBLOCK);
+		fcntl(watch.wake[1], F_SETFL, O_NONBLOCK);
+	}
+	watch.stop = 0;
+	/*the signals must stop the game thread's wait, not this one's*/
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	if (pthread_create(&watch.thread, NULL, watch_thread, NULL)) {
+		fprintf(stderr, "can't start the spectators' thread\n");
+		exit(1);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	watch.running = 1;
+}
+
+/*the spectators are the caller's then, with what was queued sent*/
+void watch_stop(void)
+{
+	int i;
+	if (!watch.running)
+		return;
+	watch.stop = 1;
+	write(watch.wake[1], "", 1);
+	pthread_join(watch.thread, NULL);
+	watch.running = 0;
+	watch_drain();
+	for (i=0; i<spec_top; i++) {
+		if (spec[i].sd != -1)
+			spec_flush(&spec[i]);
+	}
+}
+
+void notify_all(struct player *p, const char *mes)
+{
+	int i;
+	long long t = trace_begin();
+	for (i=0; i<pl_n; i++) {
+		if (game->pl[i].status != off) {
+			print_msg(&p[i], mes);
+			slice_end();
+		}
+	}
+	spectate(mes);
+	trace_end("notify_all", t, game->month);
+}
+
+char *how_many_players(void)
+{
+	static char status[42];
+	sprintf(status, "Now there are %d/%d players\n", game->pl_count, pl_n);
+	return status;
+}
+
+void disconnect(int sd)
+{
+	void uring_close(int);
+	if (use_uring) {
+		uring_close(sd);
+		return;
+	}
+	shutdown(sd, 2);
+	close(sd);
+}
+void end(struct player *p)
+{
+	struct player *base = game->data;
+	p->pos = 0;
+	game_leave(game, p - base);
+	shm_detach(p);
+	disconnect(p->sd);
+}
+
+void greet(struct player *p, int k)
+{
+	char *n = how_many_players();
+	char *str = malloc(42);
+	sprintf(str, "Your number is %d\n", k+1);
+	print_msg(&p[k], "Welcome to my game!\n");
+	print_msg(&p[k], str);
+	print_msg(&p[k], "Type 'help' to get help\n");
+	notify_all(p, n);
+	free(str);
+}
+
+void market_text(char *str, struct market_status *m)
+{
+	sprintf(str, "Current month is %%%d\n"
+		"Players still active:\n"
+		"%% \t     %d\n"
+		"bank sells: items min.price\n"
+		"%% \t     %d       %d\n"
+		"bank buys: items max.price\n"
+		"%% \t     %d       %d\n",
+		 game->month, game->pl_count, m->sell_n, m->min_price,
+		 m->buy_n, m->max_price);
+}
+
+void print_market(struct player *p, int k, struct market_status *m)
+{
+	char *str=malloc(MARKET_SIZE);
+	market_text(str, m);
+	print_msg(&p[k], str);
+	free(str);
+}
+
+void print_player(struct player *p, int k, char **cmd)
+{
+	int i;
+	if (cmd[1]==NULL || !is_number(cmd[1]) || cmd[2]!=NULL) {
+		print_msg(&p[k], "Syntax error!\n");
+		return;
+	}
+	i = atoi(cmd[1]);
+	if (1<=i && i<=pl_n && game->pl[i-1].status!=off) {
+		struct firm *f = &game->pl[i-1];
+		char *str = malloc(256);
+		if (f->status == bankrupt)
+			sprintf(str, "Player %d is a bankrupt\n", i);
+		else
+			sprintf(str, "Player %d has: dollars product "
+				"material factories building; makes turn\n"
+				"%% \t      %d \t %d \t %d\t  %d \t   %d"
+				"\t     %s \n",
+				i, f->money, f->products,
+				f->material, f->factories,
+				game_building(f->building),
+				(f->status==play) ? "yes" : "no");
+		print_msg(&p[k], str);
+		free(str);
+	} else {
+		print_msg(&p[k], "There is no such player\n");
+	}
+}	
+
+/*what the subscribers were told about every player this month*/
+struct feed_state {
+	enum st status;
+	int money;
+	int products;
+	int material;
+	int factories;
+	int building;
+};
+
+struct feed_state *feed_last = NULL;
+
+/*
+ * Brings what is known about player i up to date and, if str is not
+ * NULL, writes there a line with the fields that have changed.
+ * Returns the length of the line.
+ */
+int feed_player(struct player *p, int i, char *str)
+{
+	struct feed_state n, *f;
+	struct firm *pl = &game->pl[i];
+	int len = 0, all;
+	if (!feed_last)
+		feed_last = calloc(pl_n, sizeof(struct feed_state));
+	f = &feed_last[i];
+	n.status = pl->status;
+	n.money = pl->money;
+	n.products = pl->products;
+	n.material = pl->material;
+	n.factories = pl->factories;
+	n.building = game_building(pl->building);
+	if (memcmp(f, &n, sizeof(n)) == 0)
+		return 0;
+	/*the subscribers know nothing of a new player of the seat*/
+	all = f->status == off || f->status == bankrupt;
+	if (str) {
+		len = sprintf(str, "%d", i+1);
+		if (n.status == off)
+			len += sprintf(str+len, " -");
+		else if (n.status == bankrupt)
+			len += sprintf(str+len, " x");
+		else {
+			if (all || n.money != f->money)
+				len += sprintf(str+len, " m%d", n.money);
+			if (all || n.products != f->products)
+				len += sprintf(str+len, " p%d", n.products);
+			if (all || n.material != f->material)
+				len += sprintf(str+len, " r%d", n.material);
+			if (all || n.factories != f->factories)
+				len += sprintf(str+len, " f%d", n.factories);
+			if (all || n.building != f->building)
+				len += sprintf(str+len, " b%d", n.building);
+			if (all || n.status != f->status)
+				len += sprintf(str+len, " t%s",
+					n.status==play ? "yes" : "no");
+		}
+		str[len++] = '\n';
+	}
+	*f = n;
+	return len;
+}
+
+void feed_reset(struct player *p)
+{
+	int i;
+	for (i=0; i<pl_n; i++)
+		feed_player(p, i, NULL);
+}
+
+int feed_full(char *str, int i)
+{
+	struct feed_state *f = &feed_last[i];
+	if (f->status == off)
+		return 0;
+	if (f->status == bankrupt)
+		return sprintf(str, "Player %d is a bankrupt\n", i+1);
+	return sprintf(str, "Player %d %% %d %d %d %d %d %s\n", i+1,
+		f->money, f->products, f->material, f->factories,
+		f->building, (f->status==play) ? "yes" : "no");
+}
+
+/*the auction results of the delta feed are "s|b player count price"*/
+int feed_auction(char *str, const char *auc_res)
+{
+	int len = 0, pl, n, sum;
+	while (*auc_res) {
+		if (3 == sscanf(auc_res, "# Player %d sold %d products and "
+			"gained %d dollars", &pl, &n, &sum))
+			len += sprintf(str+len, "s%d %d %d\n", pl, n, sum/n);
+		else if (3 == sscanf(auc_res, "# Player %d bought %d "
+			"materials and spent %d dollars", &pl, &n, &sum))
+			len += sprintf(str+len, "b%d %d %d\n", pl, n, sum/n);
+		auc_res = strchr(auc_res, '\n')+1;
+	}
+	str[len] = '\0';
+	return len;
+}
+
+/*
+ * The digest tells the subscribers everything they used to ask for at
+ * the start of a month: the market, every player and the last auction.
+ * With k = -1 it is the start of the month and every subscriber gets
+ * either the whole digest or only what has changed since the last one;
+ * otherwise player k gets the whole digest at once. The changes are
+ * only good for a subscriber that has got the digest of the month
+ * before whole, any other one gets the whole digest.
+ */
+void send_digest(struct player *p, int k, struct market_status *m,
+	const char *auc_res)
+{
+	int i, len, size, snap, ok;
+	char *full, *delta = NULL;
+	long long t = trace_begin();
+	size = (pl_n+3)*AUC_LINE + strlen(auc_res);
+	if (k == -1) {
+		delta = malloc(size);
+		len = sprintf(delta, "Digest of month %%%d delta\n"
+			"%% %d %d %d %d %d\n",
+			game->month, game->pl_count, m->sell_n, m->min_price,
+			m->buy_n, m->max_price);
+		for (i=0; i<pl_n; i++)
+			len += feed_player(p, i, delta+len);
+		len += feed_auction(delta+len, auc_res);
+		strcpy(delta+len, "End of digest\n");
+	} else if (!feed_last)
+		feed_reset(p);
+	full = malloc(size);
+	len = sprintf(full, "Digest of month %%%d\n"
+		"%% %d %d %d %d %d\n",
+		game->month, game->pl_count, m->sell_n, m->min_price,
+		m->buy_n, m->max_price);
+	for (i=0; i<pl_n; i++)
+		len += feed_full(full+len, i);
+	strcpy(full+len, auc_res);
+	strcat(full, "End of digest\n");
+	snap = (game->month-1) % snapshot_months == 0;
+	for (i=0; i<pl_n; i++) {
+		if (k == -1 ? !p[i].subscribed : k != i)
+			continue;
+		if (game->pl[i].status != play
+			&& game->pl[i].status != end_turn)
+			continue;
+		if (delta && !snap && p[i].subscribed == delta_feed
+			&& p[i].fed && p[i].fed == game->month-1)
+			ok = print_msg(&p[i], delta);
+		else
+			ok = print_msg(&p[i], full);
+		p[i].fed = ok ? game->month : 0;
+		slice_end();
+	}
+	free(full);
+	free(delta);
+	trace_end("digest", t, game->month);
+}
+
+/*
+ * Sums, minima and maxima over the active players are counted once at
+ * the start of every month, so that a bot can get them by one command
+ * instead of asking about every player.
+ */
+
+enum { tot_money, tot_products, tot_material, tot_factories,
+	tot_building, tot_fields };
+
+const char *tot_names[] = { "money", "product", "material", "factories",
+	"building" };
+
+struct totals {
+	int sum[tot_fields], min[tot_fields], max[tot_fields];
+	int sold, sold_min, sold_max;
+	int bought, bought_min, bought_max;
+};
+
+struct totals tot;
+char *totals_text = NULL;
+
+void auction_totals(int sold, int ammount, int price)
+{
+	int *n = sold ? &tot.sold : &tot.bought;
+	int *min = sold ? &tot.sold_min : &tot.bought_min;
+	int *max = sold ? &tot.sold_max : &tot.bought_max;
+	if (ammount <= 0)
+		return;
+	if (!*n || price < *min)
+		*min = price;
+	if (!*n || price > *max)
+		*max = price;
+	*n += ammount;
+}
+
+void count_totals(struct player *p)
+{
+	int i, j, n = 0, len;
+	/*the first month has no auction behind it*/
+	if (game->month <= 1)
+		tot.sold = tot.bought = 0;
+	for (j=0; j<tot_fields; j++)
+		tot.sum[j] = tot.min[j] = tot.max[j] = 0;
+	for (i=0; i<pl_n; i++) {
+		struct firm *f = &game->pl[i];
+		int v[tot_fields];
+		if (f->status != play && f->status != end_turn)
+			continue;
+		v[tot_money] = f->money;
+		v[tot_products] = f->products;
+		v[tot_material] = f->material;
+		v[tot_factories] = f->factories;
+		v[tot_building] = game_building(f->building);
+		for (j=0; j<tot_fields; j++) {
+			tot.sum[j] += v[j];
+			if (!n || v[j] < tot.min[j])
+				tot.min[j] = v[j];
+			if (!n || v[j] > tot.max[j])
+				tot.max[j] = v[j];
+		}
+		n++;
+	}
+	if (!totals_text)
+		totals_text = malloc(MARKET_SIZE*2);
+	len = sprintf(totals_text, "Totals of month %%%d: sum min max\n",
+		game->month);
+	for (j=0; j<tot_fields; j++)
+		len += sprintf(totals_text+len, "%% %s %d %d %d\n",
+			tot_names[j], tot.sum[j], tot.min[j], tot.max[j]);
+	sprintf(totals_text+len, "Last auction: items min.price max.price\n"
+		"%% sold %d %d %d\n"
+		"%% bought %d %d %d\n"
+		"End of totals\n",
+		tot.sold, tot.sold_min, tot.sold_max,
+		tot.bought, tot.bought_min, tot.bought_max);
+}
+
+		
+void stats_market(struct room_stats *r, struct market_status *st,
+	struct auc *for_selling, struct auc *for_buying)
+{
+	r->level = st->level;
+	r->sell_queue = game_queue(for_selling);
+	r->buy_queue = game_queue(for_buying);
+}
+
+FILE *snap = NULL;
+int snap_broken = 0;
+
+void put_int(int v)
+{
+	fwrite(&v, sizeof(v), 1, snap);
+}
+
+int get_int(void)
+{
+	int v = 0;
+	if (fread(&v, sizeof(v), 1, snap) != 1)
+		snap_broken = 1;
+	return v;
+}
+
+void save_orders(struct auc *q)
+{
+	put_int(game_queue(q));
+	for (; q; q = q->next) {
+		put_int(q->req->player_n);
+		put_int(q->req->price);
+		put_int(q->req->count);
+	}
+}
+
+struct auc *load_orders(void)
+{
+	struct auc *first = NULL, **last = &first;
+	int i, n = get_int();
+	for (i=0; i<n && !snap_broken; i++) {
+		struct request *r = malloc(sizeof(struct request));
+		r->player_n = get_int();
+		r->price = get_int();
+		r->count = get_int();
+		if (r->player_n < 1 || r->player_n > pl_n) {
+			snap_broken = 1;
+			free(r);
+			break;
+		}
+		*last = malloc(sizeof(struct auc));
+		(*last)->req = r;
+		(*last)->next = NULL;
+		last = &(*last)->next;
+	}
+	return first;
+}
+
+void save_market(struct market_status *st, struct auc *for_selling,
+	struct auc *for_buying)
+{
+	fwrite(st, sizeof(*st), 1, snap);
+	save_orders(for_selling);
+	save_orders(for_buying);
+}
+
+void load_market(struct market_status *st, struct auc **for_selling,
+	struct auc **for_buying)
+{
+	if (fread(st, sizeof(*st), 1, snap) != 1)
+		snap_broken = 1;
+	*for_selling = load_orders();
+	*for_buying = load_orders();
+}
+
+/*
+ * The rules live in gamecore.c; what is below only turns commands into
+ * calls of the game and what the game reports into messages, log
+ * records and statistics.
+ */
+
+const char *lack_text[] = { "Not enough money\n", "Not enough material\n",
+	"Not enough factories\n", "Not enough product\n",
+	"Bank doesn't accept it\n" };
+
+/*the results of the last auction as the players are told them*/
+char *auc_res = NULL;
+int auc_size = 0;
+
+/*
+ * The market and the auction of the last PAST_MONTHS months, as
+ * `history N` sends them. A month is written out once, after its
+ * auction, behind the months before it, so that the last N months are
+ * the end of the text and go out as they are. The text is twice the
+ * size kept, and the months kept are moved to its start when it fills.
+ * A month takes at most half of the size, which holds a sale and a
+ * purchase of every player; the fills past that are left out and their
+ * number is the last field of the month's line.
+ */
+#define PAST_MONTHS 100
+#define PAST_SIZE (1 << 18)	/* kept at least, whatever the room */
+#define PAST_HEAD "History of the last months\n"
+#define PAST_END "End of history\n"
+
+struct past {
+	char *text;		/* ends with PAST_END after len */
+	int len;
+	int size;		/* kept; the text is twice as long */
+	int start[PAST_MONTHS];	/* a ring of the months kept, oldest first */
+	int first, n;
+	char *fills;		/* of the month being auctioned */
+	int fill_len, fill_size, dropped;
+} past;
+
+void past_reset(void)
+{
+	if (!past.text) {
+		past.size = 4*pl_n*AUC_LINE > PAST_SIZE ? 4*pl_n*AUC_LINE
+			: PAST_SIZE;
+		past.text = malloc(2*past.size + sizeof(PAST_END));
+	}
+	past.len = past.first = past.n = past.fill_len = past.dropped = 0;
+	strcpy(past.text, PAST_END);
+}
+
+/*the auction results of the delta feed, "s|b player count price"*/
+void past_fill(int k, int sold, int ammount, int price)
+{
+	if (!past.text)
+		past_reset();
+	if (past.fill_len + AUC_LINE > past.fill_size) {
+		past.fill_size = past.fill_size ? past.fill_size*2 : 4096;
+		past.fills = realloc(past.fills, past.fill_size);
+	}
+	if (past.fill_len + AUC_LINE > past.size/2) {
+		past.dropped++;
+		return;
+	}
+	past.fill_len += sprintf(past.fills + past.fill_len, "%c%d %d %d\n",
+		sold ? 's' : 'b', k+1, ammount, price);
+}
+
+void past_month(void)
+{
+	char line[AUC_LINE];
+	int len, i, off;
+	if (!past.text)
+		past_reset();
+	len = sprintf(line, "%% %d %d %d %d %d %d %d\n", game->month,
+		game->st.level, game->st.sell_n, game->st.min_price,
+		game->st.buy_n, game->st.max_price, past.dropped);
+	while (past.n && (past.n == PAST_MONTHS || past.len
+		- past.start[past.first] + len + past.fill_len > past.size)) {
+		past.first = (past.first+1) % PAST_MONTHS;
+		past.n--;
+	}
+	if (past.len + len + past.fill_len > 2*past.size) {
+		off = past.n ? past.start[past.first] : past.len;
+		memmove(past.text, past.text + off, past.len - off);
+		past.len -= off;
+		for (i=0; i<past.n; i++)
+			past.start[(past.first+i) % PAST_MONTHS] -= off;
+	}
+	past.start[(past.first+past.n) % PAST_MONTHS] = past.len;
+	past.n++;
+	memcpy(past.text + past.len, line, len);
+	memcpy(past.text + past.len + len, past.fills, past.fill_len);
+	past.len += len + past.fill_len;
+	strcpy(past.text + past.len, PAST_END);
+	past.fill_len = past.dropped = 0;
+}
+
+void print_history(struct player *p, int k, char **cmd)
+{
+	int n;
+	/*strtol gives LONG_MAX for the numbers too long for it*/
+	if (cmd[1]==NULL || !is_number(cmd[1]) || cmd[2]!=NULL
+		|| strtol(cmd[1], NULL, 10) > PAST_MONTHS) {
+		print_msg(&p[k], "Syntax error!\n");
+		return;
+	}
+	if (!past.text)
+		past_reset();
+	if ((n = atoi(cmd[1])) > past.n)
+		n = past.n;
+	print_msg(&p[k], PAST_HEAD);
+	print_msg(&p[k], past.text + (n ? past.start[(past.first+past.n-n)
+		% PAST_MONTHS] : past.len));
+}
+
+void auction_line(int k, int sold, int ammount, int price)
+{
+	char *str = malloc(AUC_LINE);
+	if (sold)
+		sprintf(str, "# Player %d sold %d products "
+			"and gained %d dollars\n", k+1, ammount, price*ammount);
+	else
+		sprintf(str, "# Player %d bought %d materials "
+			"and spent %d dollars\n", k+1, ammount, price*ammount);
+	strcat(auc_res, str);
+	free(str);
+	log_event(sold ? ev_sold : ev_bought, k+1, 2, ammount, price, 0);
+	rec_deal(k+1, sold ? hist_sell : hist_buy, ammount, price);
+	past_fill(k, sold, ammount, price);
+	auction_totals(sold, ammount, price);
+	slice_end();
+}
+
+void game_news(struct game *g, const struct game_event *e)
+{
+	void congratulate_winner(struct player *, int);
+	struct player *p = g->data;
+	int k = e->player, i;
+	char *str;
+	switch (e->type) {
+	case gev_refused:
+		print_msg(&p[k], lack_text[e->a0]);
+		break;
+	case gev_accepted:
+		print_msg(&p[k], "Accepted.\n");
+		break;
+	case gev_prod:
+		log_event(ev_prod, k+1, 1, e->a0, 0, 0);
+		break;
+	case gev_sell:
+	case gev_buy:
+		log_event(e->type == gev_sell ? ev_sell : ev_buy, k+1, 2,
+			e->a0, e->a1, 0);
+		break;
+	case gev_build:
+		log_event(ev_build, k+1, 1, e->a0, 0, 0);
+		break;
+	case gev_turn:
+		log_event(ev_turn, k+1, 0, 0, 0, 0);
+		break;
+	case gev_sold:
+	case gev_bought:
+		auction_line(k, e->type == gev_sold, e->a0, e->a1);
+		break;
+	case gev_bankrupt:
+		str = malloc(50);
+		sprintf(str, "Player %d has gone bust\n", k+1);
+		log_event(ev_bankrupt, k+1, 1, e->a0, 0, 0);
+		print_msg(&p[k], "YOU ARE BANKRUPT!!!!\n");
+		notify_all(p, str);
+		free(str);
+		break;
+	case gev_month:
+		log_event(ev_month, 0, 1, e->a0, 0, 0);
+		break;
+	case gev_winner:
+		congratulate_winner(p, k);
+		break;
+	case gev_over:
+		notify_all(p, "Game over :(\n");
+		for (i=0; i<pl_n; i++)
+			if (g->pl[i].status==bankrupt)
+				end(&p[i]);
+		break;
+	}
+}
+
+void request_prod(struct player *p, int k, char **cmd)
+{
+	int i;
+	if (cmd[1]==NULL || !is_number(cmd[1]) || cmd[2]!=NULL
+		|| (i = atoi(cmd[1])) < 0) {
+		print_msg(&p[k], "Syntax error!\n");
+		return;
+	}
+	game_prod(game, k, i);
+}
+
+void request_for_bank(struct player *p, int k, char **cmd)
+{
+	int count, price;
+	if (cmd[1]==NULL || !is_number(cmd[1]) || cmd[2]==NULL
+		|| !is_number(cmd[2]) || cmd[3]!=NULL
+		|| (count = atoi(cmd[1])) < 0
+		|| (price = atoi(cmd[2])) < 0) {
+		print_msg(&p[k], "Syntax error!\n");
+		return;
+	}
+	if (cmd[0][0]=='s')
+		game_sell(game, k, count, price);
+	else
+		game_buy(game, k, count, price);
+}
+
+void market_digest(struct player *p, int k)
+{
+	/*the first month has no auction behind it*/
+	send_digest(p, k, &game->st, auc_res && game->month > 1 ?
+		auc_res : "");
+}
+
+
+	
+void stats_publish(struct player *p)
+{
+	struct room_stats *r;
+	int i;
+	unsigned seq;
+	if (!stats || room_slot >= STATS_ROOMS)
+		return;
+	r = &stats->room[room_slot];
+	seq = r->seq;
+	__atomic_store_n(&r->seq, seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->id = room_id;
+	r->players = game->pl_count;
+	r->seats = pl_n;
+	r->started = game->started;
+	r->month = game->month;
+	r->pending_turns = 0;
+	for (i=0; i<pl_n; i++) {
+		if (game->pl[i].status == play)
+			r->pending_turns++;
+	}
+	r->month_end_ns = month_end_ns;
+	stats_market(r, &game->st, game->for_selling, game->for_buying);
+	__atomic_store_n(&r->seq, seq+2, __ATOMIC_RELEASE);
+}
+
+void execute(struct player *p, int k, char **cmd)
+{
+	if (strcmp(cmd[0], "help") == 0) {
+		print_msg(&p[k], "market \t\t information about market \n"
+			"player N \t information about player N\n"
+			"prod N \t\t make N units of product\n"
+			"buy N P \t try to buy N units of material "
+				"for P dollars \n"
+			"sell N P \t try to sell N units of product "
+				"for P dollars \n"
+			"build \t\t start building new factory\n"
+			"turn \t\t finish all the actions for this turn\n"
+			"subscribe \t get a digest at the start of "
+				"every month\n"
+			"delta \t\t get only what has changed "
+				"at the start of every month\n"
+			"snapshot \t get the whole digest now\n"
+			"totals \t\t sums, minima and maxima over "
+				"all players\n"
+			"history N \t the market and the auction of "
+				"the last N months\n"
+			"shm \t\t go on through shared memory "
+				"(same host only)\n"
+			"help \t\t get help about commands\n");
+		return;
+	}
+	if (strcmp(cmd[0], "subscribe") == 0
+		|| strcmp(cmd[0], "delta") == 0) {
+		p[k].subscribed = cmd[0][0] == 's' ? full_feed : delta_feed;
+		p[k].fed = 0;
+		print_msg(&p[k], p[k].subscribed == full_feed ?
+			"You will get a digest every month\n" :
+			"You will get the changes every month\n");
+		/*the month may have begun before the player subscribed*/
+		if (game->started)
+			market_digest(p, k);
+		return;
+	}
+	if (strcmp(cmd[0], "shm") == 0) {
+		shm_attach(&p[k]);
+		return;
+	}
+	if (strcmp(cmd[0], "snapshot") == 0) {
+		if (game->started)
+			market_digest(p, k);
+		else
+			print_msg(&p[k], "Game hasn't begun\n");
+		return;
+	}
+	if (game->started) {
+		if (game->pl[k].status == play) {
+			if (strcmp(cmd[0], "prod") == 0) {
+				request_prod(p, k, cmd);
+				return;
+			}
+			else if (strcmp(cmd[0], "buy") == 0
+					|| strcmp(cmd[0], "sell") == 0) {
+				request_for_bank(p, k, cmd);
+				return;
+			}
+			else if (strcmp(cmd[0], "build") == 0) {
+				game_build(game, k);
+				return;
+			}
+			else if (strcmp(cmd[0], "turn") == 0) {
+				game_turn(game, k);
+				return;
+			}
+		}
+		if (strcmp(cmd[0], "market") == 0)
+			print_market(p, k, &game->st);
+		else if (strcmp(cmd[0], "totals") == 0) {
+			/*a game taken over or restored has no totals yet*/
+			if (!totals_text)
+				count_totals(p);
+			print_msg(&p[k], totals_text);
+		}
+		else if (strcmp(cmd[0], "player") == 0)
+			print_player(p, k, cmd);
+		else if (strcmp(cmd[0], "history") == 0)
+			print_history(p, k, cmd);
+		else
+			print_msg(&p[k], "Illegal command\n");
+	} else {
+		print_msg(&p[k], "Game hasn't begun\n");
+	}
+}
+
+int recieve(struct player *p)
+{
+	int rc, buflen;
+	char *ptr;
+	ptr = p->buf + p->pos;
+	buflen = BUF_SIZE - p->pos;
+	if (p->rings) {
+		char bell[64];
+		if ((rc = ring_read(&p->rings->in, ptr, buflen)) > 0) {
+			p->pos += rc;
+			return rc;
+		}
+		/*the ring is empty, so the bot has rung or hung up*/
+		rc = recv(p->sd, bell, sizeof(bell), MSG_DONTWAIT);
+		return rc == 0 ? 0 : -1;
+	}
+	rc = read(p->sd, ptr, buflen);
+	if (rc != -1)
+		p->pos += rc;
+	return rc;
+}
+	
+void check_buf(struct player *p)
+{
+	if (p->pos+10 > BUF_SIZE)
+		p->pos = 0;
+}
+
+void new_month(struct player *p)
 {
-	int i;
 	char *mon = malloc(64);
-	sprintf(mon, "The month %d has begun\n", ++month);
+	sprintf(mon, "The month %d has begun\n", game->month);
 	notify_all(p, mon);
-	free(mon);	
-	bank(market_change, NULL, 0, NULL);
+	free(mon);
+	if (watched()) {
+		char str[MARKET_SIZE];
+		market_text(str, &game->st);
+		spectate(str);
+	}
+	count_totals(p);
+	market_digest(p, -1);
+}
+	
+void congratulate_winner(struct player *p, int k)
+{
+	char str[50];
+	int j;
+	log_event(ev_winner, k+1, 0, 0, 0, 0);
+	if (hist)
+		hist->winner = k+1;
+	sprintf(str, "You are winner!\n");
+	print_msg(&p[k], str);
+	sprintf(str, "Player %d has won the game."
+		" Congratulations!\n", k+1);
+	notify_all(p, str);
+	notify_all(p, "See you again!;)\n");
+	for (j=0; j<pl_n; j++) {
+		if (game->pl[j].status) {
+			shm_detach(&p[j]);
+			disconnect(p[j].sd);
+		}
+	}
+}
+
+void reset_game(struct player *p)
+{
+	void checkpoint(struct player *);
+	hist_end();
+	exp_end();
+	past_reset();
+	game_reset(game);
+	pl_init_all(p);
+	trace_flush();
+	stats_publish(p);
+	checkpoint(p);
+}
+
+void end_month(struct player *p)
+{
+	int n, mon = game->month;
+	long long t, step, t0 = stats ? now_ns() : 0;
+	t = trace_begin();
+	step = trace_begin();
+	/*every request yields at most one line of results*/
+	n = (game_queue(game->for_selling)+game_queue(game->for_buying))
+		*AUC_LINE+1;
+	if (n > auc_size) {
+		auc_res = realloc(auc_res, n);
+		auc_size = n;
+	}
+	auc_res[0] = '\0';
+	tot.sold = tot.bought = 0;
+	rec_orders();
+	game_auction(game);
+	past_month();
+	trace_end("auction", step, mon);
+	notify_all(p, auc_res);
+	step = trace_begin();
+	game_accounting(game);
+	rec_month();
+	hist_month();
+	exp_send();
+	trace_end("accounting", step, mon);
+	step = trace_begin();
+	if (!game_next_month(game)) {
+		trace_end("end_month", t, mon);
+		reset_game(p);
+		return;
+	}
+	trace_end("market_change", step, game->month);
+	new_month(p);
+	trace_end("end_month", t, mon);
+	if (stats) {
+		month_end_ns = now_ns() - t0;
+		stats_publish(p);
+	}
+}
+
+char *checkpoint_file = NULL;
+
+void save_game(struct player *p)
+{
+	int i;
+	struct build_f *b;
+	fwrite("GSC2", 4, 1, snap);
+	put_int(pl_n);
+	fwrite(game->rules->name, RULES_NAME, 1, snap);
+	put_int(game->month);
+	put_int(game->pl_count);
+	fwrite(&game->rng, sizeof(game->rng), 1, snap);
+	for (i=0; i<pl_n; i++) {
+		struct firm *f = &game->pl[i];
+		put_int(f->status);
+		put_int(f->money);
+		put_int(f->material);
+		put_int(f->products);
+		put_int(f->for_prod);
+		put_int(f->factories);
+		put_int(game_building(f->building));
+		for (b=f->building; b; b=b->next)
+			put_int(b->days);
+	}
+	save_market(&game->st, game->for_selling, game->for_buying);
+}
+
+/*
+ * The snapshot is written by a forked child, so the game goes on while
+ * it is being saved. A month whose predecessor is still being written
+ * is skipped.
+ */
+void checkpoint(struct player *p)
+{
+	static pid_t pid = 0;
+	char *tmp;
+	if (!checkpoint_file)
+		return;
+	if (!game->started) {
+		if (pid)
+			waitpid(pid, NULL, 0);
+		pid = 0;
+		unlink(checkpoint_file);
+		return;
+	}
+	if (pid && waitpid(pid, NULL, WNOHANG) == 0)
+		return;
+	if ((pid = fork()) == -1) {
+		perror("fork");
+		pid = 0;
+		return;
+	}
+	if (pid)
+		return;
+	tmp = malloc(strlen(checkpoint_file)+5);
+	sprintf(tmp, "%s.tmp", checkpoint_file);
+	if (!(snap = fopen(tmp, "w")))
+		_exit(1);
+	save_game(p);
+	if (fclose(snap) == 0)
+		rename(tmp, checkpoint_file);
+	_exit(0);
+}
+
+/*returns -1 if the snapshot is not one of this game*/
+int load_game(struct player *p)
+{
+	char magic[4], name[RULES_NAME] = "classic";
+	int i, j, n;
+	if (fread(magic, 4, 1, snap) != 1 || (memcmp(magic, "GSC1", 4) != 0
+		&& memcmp(magic, "GSC2", 4) != 0) || get_int() != pl_n)
+		return -1;
+	/*GSC1 was written before there were other rules than classic*/
+	if (magic[3] == '2' && (fread(name, RULES_NAME, 1, snap) != 1
+		|| !memchr(name, 0, RULES_NAME)))
+		return -1;
+	if (strcmp(name, game->rules->name) != 0)
+		return -1;
+	game->month = get_int();
+	game->pl_count = get_int();
+	if (fread(&game->rng, sizeof(game->rng), 1, snap) != 1)
+		snap_broken = 1;
+	for (i=0; i<pl_n && !snap_broken; i++) {
+		struct firm *f = &game->pl[i];
+		struct build_f **b = &f->building;
+		p[i].sd = -1;
+		f->status = get_int();
+		f->money = get_int();
+		f->material = get_int();
+		f->products = get_int();
+		f->for_prod = get_int();
+		f->factories = get_int();
+		n = get_int();
+		for (j=0; j<n && !snap_broken; j++) {
+			*b = malloc(sizeof(struct build_f));
+			(*b)->days = get_int();
+			(*b)->next = NULL;
+			b = &(*b)->next;
+		}
+	}
+	load_market(&game->st, &game->for_selling, &game->for_buying);
+	return 0;
+}
+
+/*players of a restored game have no socket until they come back*/
+void restore(struct player *p)
+{
+	if (!(snap = fopen(checkpoint_file, "r")))
+		return;
+	if (load_game(p) == -1) {
+		fprintf(stderr, "%s is not a checkpoint of this game\n",
+			checkpoint_file);
+		exit(1);
+	}
+	fclose(snap);
+	feed_reset(p);
+	if (snap_broken) {
+		fprintf(stderr, "%s is broken\n", checkpoint_file);
+		exit(1);
+	}
+	game->started = 1;
+}
+
+int find_away(struct player *p)
+{
+	int i;
+	for (i=0; i<pl_n; i++) {
+		if ((game->pl[i].status == play
+			|| game->pl[i].status == end_turn)
+			&& p[i].sd == -1)
+			return i;
+	}
+	return -1;
+}
+
+/*returns -1 if player left the game*/
+int something_to_do_with(struct player *p, int k)
+{
+	void run_commands(struct player *, int);
+	if (recieve(&p[k]) == 0)
+		return -1;
+	run_commands(p, k);
+	return 0;
+}
+void run_commands(struct player *p, int k)
+{
+	int len;
+	while ((len = has_string(p[k].buf, p[k].pos))) {
+		char **cmd = make_cmd(p[k].buf, len);
+		shift(&p[k], len);
+		if (*cmd) {
+			journal_cmd(p, k, cmd);
+			execute(p, k, cmd);
+			journal_end();
+			delete_cmd(cmd);
+		}
+		free(cmd);
+	}
+	check_buf(&p[k]);
+}
+
+void reject(int fd)
+{
+	const char mes[] = "Sorry, the game has already begun :(\n";
+	write(fd, mes, sizeof(mes)-1);
+	shutdown(fd, 2);
+	close(fd);
+}
+	
+/*
+ * With -i the sockets of the players are served by io_uring instead of
+ * poll: every listener has a multishot accept, every player a multishot
+ * recv into a ring of provided buffers. All the messages a player gets
+ * during a loop iteration go out by one send. A loop iteration submits
+ * and waits with a single io_uring_enter, and submits the sends of no
+ * more than URING_BATCH sockets, so that what the players have sent
+ * meanwhile is taken between the batches of a broadcast. The spectators have their
+ * thread either way.
+ */
+
+enum ur_op {
+	ur_accept, ur_recv, ur_send, ur_cancel, ur_poll
+};
+
+struct ur_conn {
+	unsigned gen;		/*user_data of a closed socket is stale*/
+	int seat;
+	int armed;
+	int dirty;
+	int closing;
+	int busy;
+	char *q, *fly;		/*being filled and being sent*/
+	int qlen, qcap, flen, fcap, foff;
+	struct msghdr *msg;
+};
+
+struct uring {
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned short br_tail;
+	struct ur_conn *conn;
+	int conn_n;
+	int *dirty;
+	int dirty_n, dirty_cap;
+	int cancelling;
+} ur;
+
+void *ur_map(int fd, size_t len, long long off)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, off);
+	if (p == MAP_FAILED) {
+		perror("io_uring mmap");
+		exit(1);
+	}
+	return p;
+}
+
+void ur_give_buf(int bid)
+{
+	struct io_uring_buf *b = &ur.br->bufs[ur.br_tail & (URING_BUFS-1)];
+	b->addr = (unsigned long)(ur.bufs + bid*URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	ur.br_tail++;
+	__atomic_store_n(&ur.br->tail, ur.br_tail, __ATOMIC_RELEASE);
+}
+
+void uring_init(void)
+{
+	struct io_uring_params par;
+	struct io_uring_buf_reg reg;
+	char *sq, *cq;
+	int i;
+	memset(&par, 0, sizeof(par));
+	par.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL
+		| IORING_SETUP_SINGLE_ISSUER;
+	par.cq_entries = URING_ENTRIES*16;
+	if ((ur.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &par)) == -1) {
+		perror("io_uring_setup");
+		exit(1);
+	}
+	sq = ur_map(ur.fd, par.sq_off.array + par.sq_entries*sizeof(unsigned),
+		IORING_OFF_SQ_RING);
+	cq = ur_map(ur.fd, par.cq_off.cqes
+		+ par.cq_entries*sizeof(struct io_uring_cqe),
+		IORING_OFF_CQ_RING);
+	ur.sq_entries = par.sq_entries;
+	ur.sq_head = (unsigned *)(sq + par.sq_off.head);
+	ur.sq_tail = (unsigned *)(sq + par.sq_off.tail);
+	ur.sq_mask = (unsigned *)(sq + par.sq_off.ring_mask);
+	ur.sq_array = (unsigned *)(sq + par.sq_off.array);
+	ur.cq_head = (unsigned *)(cq + par.cq_off.head);
+	ur.cq_tail = (unsigned *)(cq + par.cq_off.tail);
+	ur.cq_mask = (unsigned *)(cq + par.cq_off.ring_mask);
+	ur.cqes = (struct io_uring_cqe *)(cq + par.cq_off.cqes);
+	ur.sqes = ur_map(ur.fd, par.sq_entries*sizeof(struct io_uring_sqe),
+		IORING_OFF_SQES);
+	ur.br = mmap(NULL, URING_BUFS*sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ur.bufs = malloc(URING_BUFS*URING_BUF_SIZE);
+	if (ur.br == MAP_FAILED || !ur.bufs) {
+		perror("io_uring buffers");
+		exit(1);
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ur.br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, ur.fd, IORING_REGISTER_PBUF_RING,
+		&reg, 1) == -1) {
+		perror("IORING_REGISTER_PBUF_RING");
+		exit(1);
+	}
+	for (i=0; i<URING_BUFS; i++)
+		ur_give_buf(i);
+}
+
+struct ur_conn *ur_conn(int fd)
+{
+	if (fd >= ur.conn_n) {
+		int n = ur.conn_n ? ur.conn_n : 64;
+		while (n <= fd)
+			n *= 2;
+		ur.conn = realloc(ur.conn, n*sizeof(struct ur_conn));
+		memset(ur.conn + ur.conn_n, 0,
+			(n-ur.conn_n)*sizeof(struct ur_conn));
+		while (ur.conn_n < n)
+			ur.conn[ur.conn_n++].seat = -1;
+	}
+	return &ur.conn[fd];
+}
+
+/*returns -1 if the kernel has failed to take the requests*/
+int ur_enter(unsigned wait)
+{
+	unsigned pending = *ur.sq_tail
+		- __atomic_load_n(ur.sq_head, __ATOMIC_ACQUIRE);
+	if (!pending && !wait)
+		return 0;
+	return syscall(__NR_io_uring_enter, ur.fd, pending, wait,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+struct io_uring_sqe *ur_sqe(int op, int fd)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *ur.sq_tail, i;
+	if (tail - __atomic_load_n(ur.sq_head, __ATOMIC_ACQUIRE)
+		== ur.sq_entries)
+		ur_enter(0);
+	i = tail & *ur.sq_mask;
+	sqe = &ur.sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = fd;
+	sqe->user_data = (unsigned long long)ur_conn(fd)->gen << 32
+		| (unsigned)fd << 4 | op;
+	ur.sq_array[i] = i;
+	__atomic_store_n(ur.sq_tail, tail+1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+void ur_arm_accept(int ls)
+{
+	struct io_uring_sqe *sqe = ur_sqe(ur_accept, ls);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	ur_conn(ls)->armed = 1;
+}
+
+void ur_arm_poll(int fd)
+{
+	struct io_uring_sqe *sqe = ur_sqe(ur_poll, fd);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = POLLIN;
+	ur_conn(fd)->armed = 1;
+}
+
+void ur_arm_recv(int op, int fd)
+{
+	struct io_uring_sqe *sqe = ur_sqe(op, fd);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	ur_conn(fd)->armed = 1;
+}
+
+void ur_flush(int fd)
+{
+	struct ur_conn *c = ur_conn(fd);
+	struct io_uring_sqe *sqe;
+	if (c->foff == c->flen) {
+		char *t = c->fly;
+		int cap = c->fcap;
+		c->fly = c->q;
+		c->fcap = c->qcap;
+		c->flen = c->qlen;
+		c->foff = 0;
+		c->q = t;
+		c->qcap = cap;
+		c->qlen = 0;
+	}
+	sqe = ur_sqe(ur_send, fd);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->addr = (unsigned long)(c->fly + c->foff);
+	sqe->len = c->flen - c->foff;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	c->busy = 1;
+}
+
+void ur_mark(int fd)
+{
+	struct ur_conn *c = ur_conn(fd);
+	if (c->dirty)
+		return;
+	if (ur.dirty_n == ur.dirty_cap) {
+		ur.dirty_cap = ur.dirty_cap ? 2*ur.dirty_cap : 64;
+		ur.dirty = realloc(ur.dirty, ur.dirty_cap*sizeof(int));
+	}
+	ur.dirty[ur.dirty_n++] = fd;
+	c->dirty = 1;
+}
+
+void uring_write(int fd, const char *msg, int len)
+{
+	struct ur_conn *c = ur_conn(fd);
+	if (c->qlen + len > c->qcap) {
+		while (c->qlen + len > c->qcap)
+			c->qcap = c->qcap ? 2*c->qcap : 256;
+		c->q = realloc(c->q, c->qcap);
+	}
+	memcpy(c->q + c->qlen, msg, len);
+	c->qlen += len;
+	ur_mark(fd);
+}
+
+void ur_close(int fd)
+{
+	struct ur_conn *c = ur_conn(fd);
+	c->gen++;
+	c->seat = -1;
+	c->armed = 0;
+	c->closing = 0;
+	c->qlen = c->flen = c->foff = 0;
+	shutdown(fd, 2);
+	close(fd);
+}
+
+/*the socket is closed once what has been said to it is sent*/
+void uring_close(int fd)
+{
+	struct ur_conn *c = ur_conn(fd);
+	c->seat = -1;
+	if (c->busy || c->qlen || c->foff < c->flen)
+		c->closing = 1;
+	else
+		ur_close(fd);
+}
+
+/*a multishot request may stop at any time and is armed again here*/
+void uring_prepare(int ls, struct player *p)
+{
+	int connected(struct player *);
+	int i, n = ur.dirty_n;
+	if (ls != -1 && !ur_conn(ls)->armed)
+		ur_arm_accept(ls);
+	if (un_ls != -1 && !ur_conn(un_ls)->armed)
+		ur_arm_accept(un_ls);
+	if (up_ls != -1 && !ur_conn(up_ls)->armed)
+		ur_arm_poll(up_ls);
 	for (i=0; i<pl_n; i++) {
-		if (p[i].status == end_turn)
-			p[i].status = play;
+		struct ur_conn *c;
+		if (!connected(&p[i]))
+			continue;
+		c = ur_conn(p[i].sd);
+		c->seat = i;
+		if (!c->armed)
+			ur_arm_recv(ur_recv, p[i].sd);
+	}
+	/*the rest wait for the next pass, after the completions before them*/
+	if (n > URING_BATCH)
+		n = URING_BATCH;
+	for (i=0; i<n; i++) {
+		struct ur_conn *c = ur_conn(ur.dirty[i]);
+		c->dirty = 0;
+		if (c->busy)
+			continue;
+		if (c->qlen || c->foff < c->flen)
+			ur_flush(ur.dirty[i]);
+		else if (c->closing)
+			ur_close(ur.dirty[i]);
+	}
+	ur.dirty_n -= n;
+	memmove(ur.dirty, ur.dirty + n, ur.dirty_n*sizeof(int));
+}
+
+void ur_feed(struct player *p, int k, const char *data, int len)
+{
+	while (len > 0 && game->pl[k].status != off) {
+		int n = BUF_SIZE - p[k].pos < len ? BUF_SIZE - p[k].pos : len;
+		memcpy(p[k].buf + p[k].pos, data, n);
+		p[k].pos += n;
+		data += n;
+		len -= n;
+		run_commands(p, k);
+	}
+}
+
+void ur_complete(struct player *p, struct pollfd *fds,
+	unsigned long long data, int res, unsigned flags)
+{
+	void welcome(struct player *, int);
+	void leave(struct player *, int);
+	int op = data & 15, fd = (data >> 4) & 0xfffffff;
+	struct ur_conn *c = ur_conn(fd);
+	int stale = (unsigned)(data >> 32) != c->gen;
+	/*a new game may have been set up on the seats*/
+	if ((op == ur_recv || op == ur_send) && c->seat != -1
+		&& (p[c->seat].sd != fd || game->pl[c->seat].status == off))
+		c->seat = -1;
+	if ((flags & IORING_CQE_F_BUFFER) && op != ur_recv)
+		ur_give_buf(flags >> IORING_CQE_BUFFER_SHIFT);
+	switch (op) {
+	case ur_accept:
+		if (res >= 0)
+			welcome(p, res);
+		if (!(flags & IORING_CQE_F_MORE))
+			c->armed = 0;
+		break;
+	case ur_poll:
+		/*the main loop takes the upgrade socket as if it had polled*/
+		if (res > 0)
+			fds[1].revents = res;
+		if (!(flags & IORING_CQE_F_MORE))
+			c->armed = 0;
+		break;
+	case ur_recv:
+		if (flags & IORING_CQE_F_BUFFER) {
+			int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			if (!stale && c->seat != -1 && res > 0)
+				ur_feed(p, c->seat, ur.bufs + bid*URING_BUF_SIZE,
+					res);
+			ur_give_buf(bid);
+		}
+		if (stale || (flags & IORING_CQE_F_MORE))
+			break;
+		c->armed = 0;
+		/*out of buffers or cancelled it is just armed again*/
+		if (c->seat != -1 && res <= 0 && res != -ENOBUFS
+			&& res != -ECANCELED)
+			leave(p, c->seat);
+		break;
+	case ur_send:
+		c->busy = 0;
+		if (res > 0) {
+			c->foff += res;
+		} else if (res != -ECANCELED) {
+			/*the recv will see the socket closed*/
+			c->qlen = c->flen = c->foff = 0;
+			shutdown(fd, 2);
+		}
+		if (c->qlen || c->foff < c->flen || c->closing)
+			ur_mark(fd);
+		break;
+	case ur_cancel:
+		ur.cancelling = 0;
+	}
+}
+
+void uring_reap(struct player *p, struct pollfd *fds)
+{
+	unsigned head = *ur.cq_head;
+	while (head != __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ur.cqes[head & *ur.cq_mask];
+		unsigned long long data = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		__atomic_store_n(ur.cq_head, ++head, __ATOMIC_RELEASE);
+		ur_complete(p, fds, data, res, flags);
+		slice_end();
 	}
 }
-	
-void congratulate_winner(struct player *p)
+
+int uring_wait(int ls, struct player *p)
+{
+	int rc;
+	unsigned wait = *ur.cq_head
+		== __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE);
+	uring_prepare(ls, p);
+	if (ur.dirty_n)
+		wait = 0;
+	if (shm_count && (shm_spin(p) || !shm_sleep(p)))
+		wait = 0;
+	rc = ur_enter(wait);
+	if (shm_count)
+		shm_wake(p);
+	return rc;
+}
+
+void handle_rings(struct player *p)
 {
+	void leave(struct player *, int);
 	int i;
 	for (i=0; i<pl_n; i++) {
-		if (p[i].status == play || p[i].status == end_turn) {
-			char str[50];
-			sprintf(str, "You are winner!\n");
-			print_msg(&p[i], str);
-			sprintf(str, "Player %d has won the game."
-				" Congratulations!\n", i+1);
-			notify_all(p, str);
-			notify_all(p, "See you again!;)\n");
-			int j;
-			for (j=0; j<pl_n; j++) {
-				if (p[j].status) {
-					shutdown(p[j].sd, 2);
-					close(p[j].sd);
-				}
-			}
-			return;
+		if (p[i].rings && game->pl[i].status != off
+			&& !ring_empty(&p[i].rings->in)
+			&& something_to_do_with(p, i) == -1)
+			leave(p, i);
+	}
+}
+
+/*
+ * Before the sockets are handed over nothing may be left in flight:
+ * the requests are cancelled, what has come is handled and what is to
+ * be sent is written out.
+ */
+void uring_quiesce(struct player *p)
+{
+	struct io_uring_sqe *sqe = ur_sqe(ur_cancel, 0);
+	struct pollfd pfd[LISTENERS];
+	int i;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+	ur.cancelling = 1;
+	for (;;) {
+		int busy = ur.cancelling;
+		for (i=0; i<ur.conn_n; i++)
+			busy |= ur.conn[i].busy || ur.conn[i].armed;
+		if (!busy)
+			break;
+		if (ur_enter(1) == -1 && errno != EINTR) {
+			perror("io_uring_enter");
+			exit(1);
 		}
-	} 
+		uring_reap(p, pfd);
+	}
+	for (i=0; i<ur.conn_n; i++) {
+		struct ur_conn *c = &ur.conn[i];
+		if (c->foff < c->flen)
+			write(i, c->fly + c->foff, c->flen - c->foff);
+		if (c->qlen)
+			write(i, c->q, c->qlen);
+		c->qlen = c->flen = c->foff = 0;
+		if (c->closing)
+			ur_close(i);
+	}
 }
 
-void reset_game(struct player *p)
+/*
+ * fds[0] is the game socket, fds[1] the upgrade one, fds[2] the game's
+ * Unix socket, then there is a slot for every seat.
+ */
+int load_set(int ls, struct player *p, struct pollfd *fds)
 {
-	started = month = pl_count = 0;
-	pl_init_all(p);
+	int i, n = LISTENERS+pl_n;
+	/*poll may be skipped, so nothing must be left from the last one*/
+	for (i=0; i<n; i++)
+		fds[i].revents = 0;
+	fds[0].fd = ls;
+	fds[0].events = POLLIN;
+	fds[1].fd = up_ls;
+	fds[1].events = POLLIN;
+	fds[2].fd = un_ls;
+	fds[2].events = POLLIN;
+	for (i=0; i<pl_n; i++) {
+		fds[LISTENERS+i].fd = game->pl[i].status != off ? p[i].sd : -1;
+		fds[LISTENERS+i].events = POLLIN;
+	}
+	return n;
 }
 
-void end_month(struct player *p)
+void join(struct player *p, int fd)
+{
+	int first = game_seat(game);
+	journal_begin(jr_join, first, 0, 0, 0);
+	p[first].sd = fd;
+	p[first].subscribed = no_feed;
+	game_join(game, first);
+	log_event(ev_join, first+1, 0, 0, 0, 0);
+	greet(p, first);
+	if (game->pl_count == pl_n) {
+		unsigned seed = game_seed();
+		notify_all(p, "Let's play\n");
+		game_start(game, seed);
+		new_month(p);
+	}
+	journal_end();
+	stats_publish(p);
+}
+
+void leave(struct player *p, int k)
+{
+	journal_begin(jr_leave, k, 0, 0, 0);
+	end(&p[k]);
+	log_event(ev_leave, k+1, 0, 0, 0, 0);
+	notify_all(p, how_many_players());
+	journal_end();
+	stats_publish(p);
+}
+
+void resume(struct player *p, int k, int fd)
+{
+	p[k].sd = fd;
+	p[k].subscribed = no_feed;
+	log_event(ev_join, k+1, 0, 0, 0, 0);
+	greet(p, k);
+	stats_publish(p);
+}
+
+void handle_guest(int ls, struct player *p)
+{
+	void welcome(struct player *, int);
+	int fd;
+	if ((fd = accept(ls, NULL, NULL)) != -1)
+		welcome(p, fd);
+}
+void welcome(struct player *p, int fd)
+{
+	int k;
+	if (!game->started)
+		join(p, fd);
+	else if ((k = find_away(p)) != -1)
+		resume(p, k, fd);
+	else
+		reject(fd);
+}
+
+void handle_players(struct player *p, struct pollfd *fds)
 {
 	int i;
-	bank(do_auction, p, 0, NULL);
 	for (i=0; i<pl_n; i++) {
-		if (p[i].status == end_turn) {
-			p[i].products += p[i].for_prod;
-			p[i].for_prod = 0;
-			p[i].money -= 300*p[i].material + 500*p[i].products
-				+ 1000*p[i].factories;
-			handle_building(&p[i]);
-			if (p[i].money < 0) {
-				char *str = malloc(50);
-				sprintf(str, "Player %d has gone bust\n",
-					i+1);
-				p[i].status = bankrupt;
-				print_msg(&p[i], "YOU ARE BANKRUPT!!!!\n");
-				pl_count--;
-				notify_all(p, str);
-				free(str);
-			}
+		if ((fds[i].fd != -1 && fds[i].revents) || (p[i].rings
+			&& game->pl[i].status != off
+			&& !ring_empty(&p[i].rings->in))) {
+			if (something_to_do_with(p, i) == -1)
+				leave(p, i);
+			slice_end();
 		}
 	}
-	if (pl_count == 0) {
-		notify_all(p, "Game over :(\n");
-		for (i=0; i<pl_n; i++)
-			if (p[i].status==bankrupt)
-				end(&p[i]);
-		reset_game(p);
-		return;
-	} else if (pl_count == 1 && started == 1) {
-		congratulate_winner(p);
-		reset_game(p);
-		return;
+}
+
+void replay_cmd(struct player *p, struct jr_rec *r)
+{
+	char tok[2][16];
+	char *cmd[5];
+	int i;
+	cmd[0] = (char *)jr_cmds[r->type - jr_prod];
+	for (i=1; i<r->ntok; i++) {
+		if (i > 2)
+			cmd[i] = "0";
+		else {
+			if (r->arg[i-1] < 0)
+				strcpy(tok[i-1], "-");
+			else
+				sprintf(tok[i-1], "%d", r->arg[i-1]);
+			cmd[i] = tok[i-1];
+		}
 	}
-	new_month(p);
+	cmd[r->ntok] = NULL;
+	journal_cmd(p, r->player, cmd);
+	execute(p, r->player, cmd);
+	journal_end();
 }
 
-/*returns -1 if player left the game*/
-int something_to_do_with(struct player *p, int k)
+void replay(const char *file)
 {
-	int len;
-	if ((len = recieve(&p[k])) == 0) {
-		end(&p[k]);
-		return -1;
+	struct jr_header *h;
+	struct jr_rec *r, *e, *last;
+	struct player *p;
+	struct stat st;
+	char *map, name[RULES_NAME] = "classic";
+	int fd, months = 0, size;
+	long long t;
+	if ((fd = open(file, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		perror(file);
+		exit(1);
 	}
-	len = has_string(p[k].buf, p[k].pos);
-	if (len) {
-		char **cmd = make_cmd(p[k].buf, len);
-		shift(&p[k], len);
-		if (*cmd) {
-			execute(p, k, cmd);
-			delete_cmd(cmd);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	h = (struct jr_header *)map;
+	size = map != MAP_FAILED && st.st_size >= 4
+		&& memcmp(h->magic, "GSJ2", 4) == 0
+		? (int)offsetof(struct jr_header, rules) : (int)sizeof(*h);
+	if (map == MAP_FAILED || st.st_size < size
+		|| (memcmp(h->magic, "GSJ2", 4) != 0
+		&& memcmp(h->magic, "GSJ3", 4) != 0)
+		|| h->players < 1 || h->players > 1000
+		|| h->snapshot_months < 1) {
+		fprintf(stderr, "%s is not a journal\n", file);
+		exit(1);
+	}
+	close(fd);
+	if (size == sizeof(*h))
+		snprintf(name, sizeof(name), "%.*s", RULES_NAME-1, h->rules);
+	/*a set of the registry is known by its name, a file must be given*/
+	if (!rules && !(rules = rules_find(name))) {
+		fprintf(stderr, "%s was played by the %s rules, "
+			"give them with -f\n", file, name);
+		exit(1);
+	}
+	if (strcmp(rules->name, name) != 0) {
+		fprintf(stderr, "%s was played by the %s rules, not %s\n",
+			file, name, rules->name);
+		exit(1);
+	}
+	pl_n = h->players;
+	room_id = h->room;
+	snapshot_months = h->snapshot_months;
+	p = malloc(pl_n*sizeof(struct player));
+	pl_init_all(p);
+	game = game_new(pl_n, game_news, p);
+	game_set_rules(game, rules);
+	journal = malloc(sizeof(struct journal));
+	journal->fd = -1;
+	journal->base = p;
+	journal->active = 0;
+	r = (struct jr_rec *)(map + size);
+	/*a record cut short by a crash is simply not there*/
+	last = r + (st.st_size - size) / sizeof(*r);
+	t = now_ns();
+	for (; r<last; r++) {
+		for (e=r+1; e<last && (e->type==jr_drop || e->type==jr_seed);
+			e++) {
+			if (e->type == jr_seed)
+				journal->seed = e->arg[0];
 		}
-		free(cmd);
-	} else {
-		check_buf(&p[k]);
+		journal->next = r+1;
+		journal->end = e;
+		switch (r->type) {
+		case jr_join:
+			if (game_seat(game) != r->player) {
+				fprintf(stderr, "journal doesn't match "
+					"the game\n");
+				exit(1);
+			}
+			join(p, -1);
+			break;
+		case jr_leave:
+			leave(p, r->player);
+			break;
+		case jr_month:
+			journal_begin(jr_month, 0, 0, 0, 0);
+			end_month(p);
+			journal_end();
+			months++;
+			break;
+		case jr_drop:
+			if (r->arg[0] == -1)
+				end(&p[r->player]);
+			break;
+		case jr_seed:
+			break;
+		default:
+			replay_cmd(p, r);
+		}
+		if (game->pl_count == 0)
+			reset_game(p);
+	}
+	t = now_ns() - t;
+	printf("%ld records, %d months in %lld.%06lld s, "
+		"%.0f months/s, %.0f player-months/s\n",
+		(long)(last - (struct jr_rec *)(map + size)), months,
+		t/1000000000, t%1000000000/1000, months*1e9/t,
+		months*1e9/t*pl_n);
+	trace_flush();
+	hist_close();
+	exp_close();
+	log_close();
+}
+
+int create_unix_socket(const char *path, int backlog)
+{
+	struct sockaddr_un addr;
+	int ls;
+	if ((ls = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror("socket");
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+	unlink(path);
+	if (bind(ls, (struct sockaddr *)&addr, sizeof(addr)) == -1
+		|| listen(ls, backlog) == -1) {
+		perror(path);
+		exit(1);
+	}
+	return ls;
+}
+
+int send_fds(int sd, int *fd, int n)
+{
+	char c = 'F';
+	char ctl[CMSG_SPACE(HANDOVER_FDS*sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	while (n > 0) {
+		int k = n < HANDOVER_FDS ? n : HANDOVER_FDS;
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = &c;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctl;
+		msg.msg_controllen = CMSG_SPACE(k*sizeof(int));
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(k*sizeof(int));
+		memcpy(CMSG_DATA(cm), fd, k*sizeof(int));
+		if (sendmsg(sd, &msg, 0) != 1)
+			return -1;
+		fd += k;
+		n -= k;
 	}
 	return 0;
 }
 
-void reject(int fd)
+int recv_fds(int sd, int *fd, int n)
 {
-	const char mes[] = "Sorry, the game has already begun :(\n";
-	write(fd, mes, sizeof(mes)-1);
-	shutdown(fd, 2);
-	close(fd);
+	char c;
+	char ctl[CMSG_SPACE(HANDOVER_FDS*sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	while (n > 0) {
+		int k = n < HANDOVER_FDS ? n : HANDOVER_FDS;
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = &c;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctl;
+		msg.msg_controllen = sizeof(ctl);
+		if (recvmsg(sd, &msg, 0) != 1)
+			return -1;
+		cm = CMSG_FIRSTHDR(&msg);
+		if (!cm || cm->cmsg_type != SCM_RIGHTS
+			|| cm->cmsg_len != CMSG_LEN(k*sizeof(int)))
+			return -1;
+		memcpy(fd, CMSG_DATA(cm), k*sizeof(int));
+		fd += k;
+		n -= k;
+	}
+	return 0;
 }
-	
-int load_set(int ls, struct player *p, fd_set *set)
+
+int read_all(int sd, void *buf, int len)
+{
+	int rc, done = 0;
+	while (done < len) {
+		if ((rc = read(sd, (char *)buf+done, len-done)) <= 0)
+			return -1;
+		done += rc;
+	}
+	return 0;
+}
+
+int connected(struct player *p)
+{
+	struct player *base = game->data;
+	return game->pl[p - base].status != off && p->sd >= 0;
+}
+
+/*
+ * Besides the game itself the new process needs what is half done:
+ * unfinished command lines, subscriptions and what the subscribers
+ * were told last month.
+ */
+/*the history goes over to the new process with the game*/
+void past_save(void)
+{
+	int i, off = past.n ? past.start[past.first] : past.len;
+	put_int(past.n);
+	put_int(past.len - off);
+	fwrite(past.text + off, 1, past.len - off, snap);
+	for (i=0; i<past.n; i++)
+		put_int(past.start[(past.first+i) % PAST_MONTHS] - off);
+}
+
+void past_load(void)
+{
+	int i, n = get_int(), len = get_int();
+	past_reset();
+	if (n < 0 || n > PAST_MONTHS || len < 0 || len > past.size
+		|| fread(past.text, 1, len, snap) != len) {
+		snap_broken = 1;
+		return;
+	}
+	for (i=0; i<n; i++)
+		if ((past.start[i] = get_int()) < 0 || past.start[i] > len)
+			snap_broken = 1;
+	past.n = n;
+	past.len = len;
+	strcpy(past.text + len, PAST_END);
+}
+
+void save_handover(struct player *p)
 {
-	int max_d = ls;
 	int i;
-	FD_ZERO(set);
-	FD_SET(ls, set);
+	put_int(game->started);
+	save_game(p);
+	for (i=0; i<pl_n; i++) {
+		put_int(connected(&p[i]));
+		put_int(p[i].subscribed);
+		put_int(p[i].pos);
+		fwrite(p[i].buf, 1, p[i].pos, snap);
+		put_int(p[i].rings ? strlen(p[i].shm_name) : 0);
+		if (p[i].rings)
+			fwrite(p[i].shm_name, 1, strlen(p[i].shm_name), snap);
+	}
+	put_int(feed_last != NULL);
+	if (feed_last)
+		fwrite(feed_last, sizeof(struct feed_state), pl_n, snap);
+	past_save();
+	put_int(spec_ls != -1);
+	put_int(un_ls != -1);
+	put_int(spec_count);
+}
+
+/*returns 1 if the game now belongs to the new process*/
+int hand_over(int ls, struct player *p)
+{
+	int sd, i, n = 0, ok;
+	int *fd;
+	char *state, ack;
+	size_t len;
+	if ((sd = accept(up_ls, NULL, NULL)) == -1)
+		return 0;
+	if (use_uring)
+		uring_quiesce(p);
+	watch_stop();
+	journal_flush();
+	snap = open_memstream(&state, &len);
+	save_handover(p);
+	fclose(snap);
+	fd = malloc((3+pl_n+spec_count)*sizeof(int));
+	fd[n++] = ls;
+	if (spec_ls != -1)
+		fd[n++] = spec_ls;
+	if (un_ls != -1)
+		fd[n++] = un_ls;
 	for (i=0; i<pl_n; i++) {
-		if (p[i].status != off) {
-			FD_SET(p[i].sd, set);
-			if (p[i].sd > max_d)
-				max_d = p[i].sd;
+		if (connected(&p[i]))
+			fd[n++] = p[i].sd;
+	}
+	for (i=0; i<spec_top; i++) {
+		if (spec[i].sd != -1)
+			fd[n++] = spec[i].sd;
+	}
+	i = len;
+	/*if the new process fails before it is ready, this one goes on*/
+	ok = write(sd, &i, sizeof(i)) == sizeof(i)
+		&& write(sd, state, len) == len
+		&& send_fds(sd, fd, n) == 0
+		&& read(sd, &ack, 1) == 1;
+	free(fd);
+	free(state);
+	close(sd);
+	if (!ok)
+		watch_start();
+	return ok;
+}
+
+/*returns the game socket of the server taken over or -1 if none runs*/
+int take_over(struct player *p)
+{
+	struct sockaddr_un addr;
+	int sd, i, len, n, has_spec, has_un, spec_n, ls;
+	int *fd;
+	char *state;
+	long long t = now_ns();
+	if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror("socket");
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, upgrade_path, sizeof(addr.sun_path)-1);
+	if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(sd);
+		return -1;
+	}
+	if (read_all(sd, &len, sizeof(len)) == -1 || len < 0
+		|| !(state = malloc(len))
+		|| read_all(sd, state, len) == -1) {
+		fprintf(stderr, "can't take over the game\n");
+		exit(1);
+	}
+	snap = fmemopen(state, len, "r");
+	game->started = get_int();
+	if (load_game(p) == -1) {
+		fprintf(stderr, "the running game has other rules\n");
+		exit(1);
+	}
+	n = 1;
+	for (i=0; i<pl_n && !snap_broken; i++) {
+		if (get_int()) {
+			p[i].sd = n++;
 		}
+		p[i].subscribed = get_int();
+		p[i].pos = get_int();
+		if (p[i].pos < 0 || p[i].pos > BUF_SIZE
+			|| fread(p[i].buf, 1, p[i].pos, snap) != p[i].pos)
+			snap_broken = 1;
+		/*the rings live on in the same segment*/
+		if ((len = get_int()) > 0) {
+			char name[40] = "";
+			if (len >= (int)sizeof(name)
+				|| fread(name, 1, len, snap) != len
+				|| shm_map(&p[i], name) == -1)
+				snap_broken = 1;
+		}
+	}
+	if (get_int()) {
+		feed_last = malloc(pl_n*sizeof(struct feed_state));
+		if (fread(feed_last, sizeof(struct feed_state), pl_n, snap)
+			!= pl_n)
+			snap_broken = 1;
+	}
+	past_load();
+	has_spec = get_int();
+	has_un = get_int();
+	spec_n = get_int();
+	fclose(snap);
+	free(state);
+	if (snap_broken) {
+		fprintf(stderr, "can't take over the game\n");
+		exit(1);
+	}
+	/*the players' sd are their places among the descriptors for now*/
+	fd = malloc((n+has_spec+has_un+spec_n)*sizeof(int));
+	if (recv_fds(sd, fd, n+has_spec+has_un+spec_n) == -1) {
+		fprintf(stderr, "can't take over the game\n");
+		exit(1);
 	}
-	return max_d;
+	ls = fd[0];
+	if (has_un)
+		un_ls = fd[1+has_spec];
+	for (i=0; i<pl_n; i++) {
+		if (p[i].sd > 0)
+			p[i].sd = fd[p[i].sd + has_spec + has_un];
+	}
+	if (has_spec) {
+		spec_init(fd[1]);
+		for (i=0; i<spec_n; i++)
+			spec_add(fd[n+1+has_un+i]);
+	}
+	free(fd);
+	write(sd, "R", 1);
+	close(sd);
+	t = now_ns() - t;
+	fprintf(stderr, "took over %d connections in %lld.%03lld ms\n",
+		n-1+spec_n, t/1000000, t%1000000/1000);
+	return ls;
 }
 
-void handle_guest(int ls, struct player *p)
+/*
+ * With -m the process only seats players: it queues the clients that
+ * connect, and as soon as a pool holds enough of them for a room it forks
+ * a new process that plays the game with them and exits when the game is
+ * over. A client may name its pool by sending "tag name" first; one that
+ * says nothing for TAG_WAIT_MS goes to the untagged pool. A pool that
+ * has waited for -m milliseconds starts a smaller room.
+ */
+
+struct guest {
+	int sd;
+	long long since;
+	int pos;
+	char buf[BUF_SIZE];
+	struct guest *next;
+};
+
+struct pool {
+	char tag[TAG_SIZE];
+	int n;
+	struct guest *first, *last;
+};
+
+struct pool fresh = { "", 0, NULL, NULL };
+struct pool pools[POOLS];
+pid_t rooms[ROOMS_MAX];
+int guests = 0, last_room = 0;
+
+void pool_add(struct pool *pl, struct guest *g)
+{
+	g->next = NULL;
+	if (pl->last)
+		pl->last->next = g;
+	else
+		pl->first = g;
+	pl->last = g;
+	pl->n++;
+}
+
+/*takes the first n guests out of the pool*/
+struct guest *pool_take(struct pool *pl, int n)
+{
+	struct guest *g = pl->first, *last = NULL;
+	int i;
+	for (i=0; i<n; i++) {
+		last = pl->first;
+		pl->first = last->next;
+	}
+	last->next = NULL;
+	if (!pl->first)
+		pl->last = NULL;
+	pl->n -= n;
+	return g;
+}
+
+void pool_remove(struct pool *pl, struct guest *g)
+{
+	struct guest **pp = &pl->first, *prev = NULL;
+	while (*pp != g) {
+		prev = *pp;
+		pp = &(*pp)->next;
+	}
+	*pp = g->next;
+	if (pl->last == g)
+		pl->last = prev;
+	pl->n--;
+}
+
+/*returns NULL if there is no room for one more pool*/
+struct pool *find_pool(const char *tag)
+{
+	struct pool *free_pl = NULL;
+	int i;
+	for (i=0; i<POOLS; i++) {
+		if (strcmp(pools[i].tag, tag) == 0 && (i == 0 || pools[i].n))
+			return &pools[i];
+		if (i && !pools[i].n && !free_pl)
+			free_pl = &pools[i];
+	}
+	if (free_pl)
+		strcpy(free_pl->tag, tag);
+	return free_pl;
+}
+
+void turn_away(struct guest *g, const char *mes)
 {
+	write(g->sd, mes, strlen(mes));
+	shutdown(g->sd, 2);
+	close(g->sd);
+	free(g);
+	guests--;
+}
+
+void guest_accept(int ls)
+{
+	struct guest *g;
 	int fd;
-	if ((fd = accept(ls, NULL, NULL)) != -1) {
-		if (!started) {
-			int first = find_free_index(p);
-			p[first].sd = fd;
-			p[first].status = play;
-			pl_count++;
-			greet(p, first);
-			if (pl_count == pl_n) {
-				started = 1;
-				notify_all(p, "Let's play\n");
-				new_month(p);
-			}
-		} else {
-			reject(fd);
+	while ((fd = accept(ls, NULL, NULL)) != -1) {
+		g = malloc(sizeof(struct guest));
+		g->sd = fd;
+		g->since = now_ns();
+		g->pos = 0;
+		pool_add(&fresh, g);
+		guests++;
+	}
+}
+
+/*
+ * A guest settles in a pool on its first line or after TAG_WAIT_MS;
+ * returns 0 if it is turned away
+ */
+int guest_settle(struct guest *g)
+{
+	struct pool *pl = &pools[0];
+	char *tag = g->buf+4;
+	int len = has_string(g->buf, g->pos);
+	pool_remove(&fresh, g);
+	if (len && strncmp(g->buf, "tag ", 4) == 0) {
+		if (strlen(tag) >= TAG_SIZE || !(pl = find_pool(tag))) {
+			turn_away(g, "Sorry, no such pool :(\n");
+			return 0;
+		}
+		memmove(g->buf, g->buf+len, g->pos-len);
+		g->pos -= len;
+	} else if (len) {
+		/*not a tag: the room gets the line as it came*/
+		g->buf[len-1] = '\n';
+	}
+	pool_add(pl, g);
+	return 1;
+}
+
+/*returns 0 if the guest has gone*/
+int guest_read(struct pool *pl, struct guest *g)
+{
+	int rc = read(g->sd, g->buf+g->pos, BUF_SIZE-g->pos);
+	if (rc <= 0) {
+		pool_remove(pl, g);
+		close(g->sd);
+		free(g);
+		guests--;
+		return 0;
+	}
+	g->pos += rc;
+	if (pl == &fresh && !guest_settle(g))
+		return 0;
+	/*the room would drop an overfull buffer anyway*/
+	if (g->pos == BUF_SIZE)
+		g->pos = 0;
+	return 1;
+}
+
+/*
+ * returns 0 in the new room, 1 in the matchmaker and -1 if there are
+ * too many rooms already
+ */
+int open_room(struct pool *pl, int n, struct guest **seated)
+{
+	struct guest *g;
+	pid_t pid;
+	int slot, i;
+	for (slot=0; slot<ROOMS_MAX && rooms[slot]; slot++)
+		;
+	if (slot == ROOMS_MAX)
+		return -1;
+	*seated = pool_take(pl, n);
+	if (trace)
+		fflush(trace->f);
+	if ((pid = fork()) == -1) {
+		perror("fork");
+		exit(1);
+	}
+	last_room++;
+	if (pid) {
+		rooms[slot] = pid;
+		if (stats && slot >= stats->rooms && slot < STATS_ROOMS)
+			stats->rooms = slot+1;
+		while ((g = *seated)) {
+			*seated = g->next;
+			close(g->sd);
+			free(g);
+			guests--;
 		}
-	}		
+		return 1;
+	}
+	signal(SIGCHLD, SIG_DFL);
+	room_id = last_room;
+	room_slot = slot;
+	pl_n = n;
+	for (i=0; i<=POOLS; i++) {
+		struct pool *other = i ? &pools[i-1] : &fresh;
+		for (g=other->first; g; g=g->next)
+			close(g->sd);
+	}
+	log_fork();
+	hist_fork();
+	exp_fork();
+	trace_room();
+	return 0;
 }
 
-void handle_players(struct player *p, fd_set *set)
+void reap_rooms(void)
 {
+	pid_t pid;
 	int i;
-	for (i=0; i<pl_n; i++) {
-		if (FD_ISSET(p[i].sd, set)) {
-			if (something_to_do_with(p, i) == -1) {
-				char *msg = how_many_players();
-				notify_all(p, msg);
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		for (i=0; i<ROOMS_MAX; i++) {
+			if (rooms[i] == pid)
+				rooms[i] = 0;
+		}
+	}
+}
+
+/*returns 0 if the room has to be opened now*/
+int pool_due(struct pool *pl, long long now, int *timeout)
+{
+	long long left;
+	if (pl != &fresh && pl->n >= pl_n)
+		return 0;
+	if (pl->n < (pl == &fresh ? 1 : 2))
+		return 1;
+	left = pl->first->since - now
+		+ (pl == &fresh ? TAG_WAIT_MS : match_wait) * 1000000LL;
+	if (left <= 0)
+		return 0;
+	if (*timeout == -1 || left/1000000+1 < *timeout)
+		*timeout = left/1000000+1;
+	return 1;
+}
+
+void wake(int sig)
+{
+}
+
+/*returns the guests in a new room and NULL in the matchmaker on exit*/
+struct guest *matchmake(int ls)
+{
+	struct pollfd *fds = NULL;
+	struct guest **who = NULL, *seated;
+	struct sigaction sa;
+	int cap = 0;
+	/*poll has to return when a room is over*/
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wake;
+	sigaction(SIGCHLD, &sa, NULL);
+	fcntl(ls, F_SETFL, O_NONBLOCK);
+	if (un_ls != -1)
+		fcntl(un_ls, F_SETFL, O_NONBLOCK);
+	strcpy(pools[0].tag, "");
+	while (!quit) {
+		int i, j, n = 2, timeout = -1;
+		long long now = now_ns();
+		while (!pool_due(&fresh, now, &timeout))
+			guest_settle(fresh.first);
+		for (i=0; i<POOLS; i++) {
+			struct pool *pl = &pools[i];
+			while (!pool_due(pl, now, &timeout)) {
+				int rc = open_room(pl, pl->n < pl_n ?
+					pl->n : pl_n, &seated);
+				if (rc == 0)
+					return seated;
+				if (rc == -1)
+					break;
+			}
+		}
+		if (guests+2 > cap) {
+			cap = 2*(guests+2);
+			fds = realloc(fds, cap*sizeof(struct pollfd));
+			who = realloc(who, cap*sizeof(struct guest *));
+		}
+		fds[0].fd = ls;
+		fds[0].events = POLLIN;
+		fds[1].fd = un_ls;
+		fds[1].events = POLLIN;
+		for (i=0; i<=POOLS; i++) {
+			struct pool *pl = i ? &pools[i-1] : &fresh;
+			struct guest *g;
+			for (g=pl->first; g; g=g->next) {
+				fds[n].fd = g->sd;
+				fds[n].events = POLLIN;
+				who[n++] = g;
+			}
+		}
+		if (poll(fds, n, timeout) == -1) {
+			if (errno == EINTR) {
+				reap_rooms();
+				continue;
+			}
+			perror("poll");
+			exit(1);
+		}
+		reap_rooms();
+		/*a guest may only move towards the end of the lists*/
+		for (i=0, j=2; i<=POOLS && j<n; i++) {
+			struct pool *pl = i ? &pools[i-1] : &fresh;
+			struct guest *g, *next;
+			for (g=pl->first; g && j<n && who[j]==g; g=next, j++) {
+				next = g->next;
+				if (fds[j].revents)
+					guest_read(pl, g);
 			}
 		}
+		if (fds[0].revents)
+			guest_accept(ls);
+		if (fds[1].revents)
+			guest_accept(un_ls);
+	}
+	return NULL;
+}
+
+/*the new room takes its guests in order as if they had just come*/
+void seat_guests(struct player *p, struct guest *g)
+{
+	int i;
+	struct guest *next;
+	for (i=0; g; g=next, i++) {
+		next = g->next;
+		join(p, g->sd);
+		memcpy(p[i].buf, g->buf, g->pos);
+		p[i].pos = g->pos;
+		free(g);
+	}
+	for (i=0; i<pl_n; i++) {
+		if (game->pl[i].status != off && p[i].pos)
+			run_commands(p, i);
 	}
 }
 
+void stop(int sig)
+{
+	quit = 1;
+}
+
 int main(int argc, char **argv)
 {
-	int port, ls;
+	int port, ls, opt, spec_port = 0, taken;
+	int group_rows = EXP_GROUP_ROWS, file_groups = EXP_FILE_GROUPS;
+	struct sigaction sa;
 	struct player *players;
-	srand(time(NULL));
+	struct pollfd *fds;
+	struct guest *seated = NULL;
+	char *journal_file = NULL, *replay_file = NULL;
 	signal(SIGPIPE, SIG_IGN);
+	/*without SA_RESTART, so that io_uring_enter returns too*/
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	while ((opt = getopt(argc, argv, "t:s:l:a:e:g:n:j:r:c:w:k:u:x:im:q:f:d:")) != -1) {
+		switch (opt) {
+		case 't':
+			trace_open(optarg);
+			break;
+		case 's':
+			stats_open(optarg);
+			break;
+		case 'l':
+			log_open(optarg);
+			break;
+		case 'a':
+			hist_open(optarg);
+			break;
+		case 'e':
+			exp_open(optarg);
+			break;
+		case 'g':
+			if (!is_number(optarg)
+				|| (group_rows = atoi(optarg)) < 1)
+				argc = 0;
+			break;
+		case 'n':
+			if (!is_number(optarg)
+				|| (file_groups = atoi(optarg)) < 1)
+				argc = 0;
+			break;
+		case 'j':
+			journal_file = optarg;
+			break;
+		case 'r':
+			replay_file = optarg;
+			break;
+		case 'c':
+			checkpoint_file = optarg;
+			break;
+		case 'w':
+			if (!is_number(optarg) || (spec_port = atoi(optarg)) < 1)
+				argc = 0;
+			break;
+		case 'k':
+			if (!is_number(optarg)
+				|| (snapshot_months = atoi(optarg)) < 1)
+				argc = 0;
+			break;
+		case 'u':
+			upgrade_path = optarg;
+			break;
+		case 'x':
+			unix_path = optarg;
+			break;
+		case 'i':
+			use_uring = 1;
+			break;
+		case 'm':
+			if (!is_number(optarg) || (match_wait = atoi(optarg)) < 1)
+				argc = 0;
+			break;
+		case 'q':
+			if (!is_number(optarg) || (quantum = atoi(optarg)) < 1)
+				argc = 0;
+			quantum *= 1000;
+			break;
+		case 'f':
+			if (!(rules = rules_pick(optarg)))
+				exit(1);
+			break;
+		case 'd':
+			if (!is_number(optarg))
+				argc = 0;
+			seed_arg = optarg;
+			break;
+		default:
+			argc = 0;
+		}
+	}
+	if (exporter) {
+		exporter->group_rows = group_rows;
+		exporter->file_groups = file_groups;
+		/*a replay has no players to keep waiting*/
+		exp_start(replay_file != NULL);
+	}
+	if (replay_file) {
+		replay(replay_file);
+		return 0;
+	}
+	argv += optind-1;
+	argc -= optind-1;
 	if (argc < 3 || !is_number(argv[1]) || !is_number(argv[2])
 		|| (pl_n = atoi(argv[1])) < 0 || pl_n > 1000
-		|| (port = atoi(argv[2])) < 1) {
-		fprintf(stderr, "Usage: ./server players port\n");
+		|| (port = atoi(argv[2])) < 1 || (match_wait
+		&& (pl_n < 2 || checkpoint_file || spec_port || upgrade_path))) {
+		fprintf(stderr, "Usage: ./server [-t trace.json] "
+			"[-s shm_name] [-l log] [-a archive]\n"
+			"                [-e export [-g group_rows] "
+			"[-n file_groups]] [-j journal]\n"
+			"                [-c checkpoint] [-w watch_port] "
+			"[-k months] [-u upgrade_socket]\n"
+			"                [-x unix_socket] [-i] [-q quantum_us] "
+			"[-f rules] [-d seed] players port\n"
+			"       ./server [-t trace.json] [-s shm_name] [-l log] "
+			"[-a archive]\n"
+			"                [-e export [-g group_rows] "
+			"[-n file_groups]] [-j journal]\n"
+			"                [-x unix_socket] [-i] [-q quantum_us] "
+			"[-f rules] [-d seed] -m wait_ms room_size port\n"
+			"       ./server [-t trace.json] [-l log] [-a archive] "
+			"[-e export ...] [-f rules] -r journal\n"
+			"rules: classic rich, or a file of rules\n");
 		exit(1);
 	}
+	if (!rules)
+		rules = rules_find("classic");
 	players = malloc(pl_n*sizeof(struct player));
 	pl_init_all(players);
-	ls = create_listening_socket(port);
-	pl_count = 0;
-	while (1) {
-		int i;
-		fd_set read_fds;
-		int max_d = load_set(ls, players, &read_fds);
-		if (select(max_d+1, &read_fds, NULL, NULL, NULL) == -1) {
-			perror("select");
+	game = game_new(pl_n, game_news, players);
+	game_set_rules(game, rules);
+	ls = upgrade_path ? take_over(players) : -1;
+	taken = ls != -1;
+	if (!taken) {
+		if (checkpoint_file)
+			restore(players);
+		ls = create_listening_socket(port);
+		if (spec_port)
+			spec_init(create_listening_socket(spec_port));
+	}
+	if (unix_path && un_ls == -1)
+		un_ls = create_unix_socket(unix_path, SOMAXCONN);
+	if (upgrade_path)
+		up_ls = create_unix_socket(upgrade_path, 1);
+	if (match_wait) {
+		if (!(seated = matchmake(ls))) {
+			hist_close();
+			exp_close();
+			log_close();
+			return 0;
+		}
+		close(ls);
+		if (un_ls != -1)
+			close(un_ls);
+		ls = un_ls = -1;
+		players = realloc(players, pl_n*sizeof(struct player));
+		pl_init_all(players);
+		game_free(game);
+		game = game_new(pl_n, game_news, players);
+		game_set_rules(game, rules);
+	}
+	stats_publish(players);
+	if (journal_file)
+		journal_open(journal_file, players, taken);
+	if (seated)
+		seat_guests(players, seated);
+	fds = malloc((LISTENERS+pl_n)*sizeof(struct pollfd));
+	if (use_uring)
+		uring_init();
+	watch_start();
+	while (!quit) {
+		int n = load_set(ls, players, fds);
+		if ((use_uring ? uring_wait(ls, players) :
+			wait_events(players, fds, n)) == -1) {
+			if (errno == EINTR && quit)
+				break;
+			if (errno == EINTR)
+				continue;
+			perror("poll");
 			exit(1);
 		}
-		if (FD_ISSET(ls, &read_fds))
-			handle_guest(ls, players);
-		handle_players(players, &read_fds);
-		if (pl_count == 0) {
+		slice_start();
+		if (use_uring) {
+			uring_reap(players, fds);
+			handle_rings(players);
+		} else {
+			if (fds[0].revents)
+				handle_guest(ls, players);
+			if (fds[2].revents)
+				handle_guest(un_ls, players);
+			handle_players(players, fds+LISTENERS);
+		}
+		if (fds[1].revents && hand_over(ls, players)) {
+			/*the game goes on in the new server*/
+			if (hist)
+				hist->months_sent = 0;
+			break;
+		}
+		if (game->pl_count == 0) {
+			/*a room opened by the matchmaker plays one game only*/
+			if (match_wait)
+				break;
 			reset_game(players);
 			continue;
 		}
-		
-		for (i=0; i<pl_n; i++) {
-			if (players[i].status == play)
+		if (!game_waiting(game)) {
+			journal_begin(jr_month, 0, 0, 0, 0);
+			end_month(players);
+			journal_end();
+			journal_flush();
+			checkpoint(players);
+			if (match_wait && !game->started)
 				break;
 		}
-		if (i == pl_n)
-			end_month(players);
 	}
+	/*the last words to the players may not have been sent yet*/
+	if (use_uring)
+		uring_quiesce(players);
+	watch_stop();
+	journal_flush();
+	trace_flush();
+	hist_close();
+	exp_close();
+	log_close();
 	return 0;
 }
@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "gamecore.h"
+#include "gamebatch.h"
+
+/*
+ * Plays whole games in one process through gamecore, every player being
+ * a C++ strategy instead of a bot on a socket. Nothing is printed while
+ * the games go on, so that the speed of the rules alone is measured.
+ */
+
+const int months_max = 1000;
+const struct game_rules *rules;		/* NULL for the classic ones */
+
+class Game {
+	struct game *g;
+	int *sold, *bought;
+	int units_sold, min_sold_price;
+	int winner;
+	static void News(struct game *g, const struct game_event *e);
+public:
+	Game(int players);
+	~Game() { game_free(g); delete[] sold; delete[] bought; }
+	void Start(unsigned seed);
+	bool EndMonth();
+	int Index() const { return 0; }
+	int Players() const { return g->pl_n; }
+	int Active() const { return g->pl_count; }
+	int Month() const { return g->month; }
+	int Winner() const { return winner; }
+	int Status(int k) const { return g->pl[k].status; }
+	int Money(int k) const { return g->pl[k].money; }
+	int Material(int k) const { return g->pl[k].material; }
+	int Products(int k) const { return g->pl[k].products; }
+	int Factories(int k) const { return g->pl[k].factories; }
+	int MinPrice() const { return g->st.min_price; }
+	int MaxPrice() const { return g->st.max_price; }
+	int Supply() const { return g->st.sell_n; }
+	int Demand() const { return g->st.buy_n; }
+	/* what happened at the last auction */
+	int Sold(int k) const { return sold[k]; }
+	int Bought(int k) const { return bought[k]; }
+	int UnitsSold() const { return units_sold; }
+	int MinSoldPrice() const { return min_sold_price; }
+	int SumProducts() const;
+	bool Prod(int k, int n) { return game_prod(g, k, n) == 0; }
+	bool Sell(int k, int n, int price)
+		{ return game_sell(g, k, n, price) == 0; }
+	bool Buy(int k, int n, int price)
+		{ return game_buy(g, k, n, price) == 0; }
+	bool Build(int k) { return game_build(g, k) == 0; }
+	bool Turn(int k) { return game_turn(g, k) == 0; }
+};
+
+Game::Game(int players) : units_sold(0), min_sold_price(0), winner(-1)
+{
+	g = game_new(players, News, this);
+	if (rules)
+		game_set_rules(g, rules);
+	sold = new int[players];
+	bought = new int[players];
+}
+
+void Game::News(struct game *g, const struct game_event *e)
+{
+	Game *game = (Game *)g->data;
+	switch (e->type) {
+	case gev_sold:
+		game->sold[e->player] += e->a0;
+		if (!game->units_sold || e->a1 < game->min_sold_price)
+			game->min_sold_price = e->a1;
+		game->units_sold += e->a0;
+		break;
+	case gev_bought:
+		game->bought[e->player] += e->a0;
+		break;
+	case gev_winner:
+		game->winner = e->player;
+		break;
+	default:
+		break;
+	}
+}
+
+void Game::Start(unsigned seed)
+{
+	int i;
+	game_reset(g);
+	for (i=0; i<g->pl_n; i++)
+		game_join(g, i);
+	memset(sold, 0, g->pl_n*sizeof(int));
+	memset(bought, 0, g->pl_n*sizeof(int));
+	units_sold = min_sold_price = 0;
+	winner = -1;
+	game_start(g, seed);
+}
+
+/* returns false when the game is over */
+bool Game::EndMonth()
+{
+	memset(sold, 0, g->pl_n*sizeof(int));
+	memset(bought, 0, g->pl_n*sizeof(int));
+	units_sold = min_sold_price = 0;
+	return game_end_month(g) != 0;
+}
+
+int Game::SumProducts() const
+{
+	int i, sum = 0;
+	for (i=0; i<g->pl_n; i++) {
+		if (g->pl[i].status == play || g->pl[i].status == end_turn)
+			sum += g->pl[i].products;
+	}
+	return sum;
+}
+
+/* one game of a batch, seen as strategies see a Game */
+class Lane {
+	struct batch *b;
+	int g, base;
+public:
+	Lane(struct batch *bt, int game)
+		: b(bt), g(game), base(game*bt->pl_n) {}
+	int Index() const { return b->id[g]; }
+	int Players() const { return b->pl_n; }
+	int Active() const { return b->pl_count[g]; }
+	int Month() const { return b->month[g]; }
+	int Status(int k) const { return b->status[base+k]; }
+	int Money(int k) const { return b->money[base+k]; }
+	int Material(int k) const { return b->material[base+k]; }
+	int Products(int k) const { return b->products[base+k]; }
+	int Factories(int k) const { return b->factories[base+k]; }
+	int MinPrice() const { return b->min_price[g]; }
+	int MaxPrice() const { return b->max_price[g]; }
+	int Supply() const { return b->sell_n[g]; }
+	int Demand() const { return b->buy_n[g]; }
+	int Sold(int k) const { return b->sold[base+k]; }
+	int Bought(int k) const { return b->bought[base+k]; }
+	int UnitsSold() const { return b->units_sold[g]; }
+	int MinSoldPrice() const { return b->min_sold[g]; }
+	int SumProducts() const;
+	bool Prod(int k, int n) { return batch_prod(b, base+k, n) == 0; }
+	bool Sell(int k, int n, int price)
+		{ return batch_sell(b, base+k, n, price) == 0; }
+	bool Buy(int k, int n, int price)
+		{ return batch_buy(b, base+k, n, price) == 0; }
+	bool Build(int k) { return batch_build(b, base+k) == 0; }
+};
+
+int Lane::SumProducts() const
+{
+	int k, sum = 0;
+	for (k=0; k<b->pl_n; k++) {
+		if (b->status[base+k] == play)
+			sum += b->products[base+k];
+	}
+	return sum;
+}
+
+class Strategy {
+public:
+	virtual ~Strategy() {}
+	virtual const char *Name() const = 0;
+	/* games is the size of the batch, 1 for a single game */
+	virtual void NewGame(int games) {}
+	/* makes the moves of player me for this month but the turn */
+	virtual void Move(Game& game, int me) = 0;
+	/* the same in every game of the batch still going on */
+	virtual void Move(struct batch *b, int me) = 0;
+};
+
+/* every strategy plays a Game and a Lane by the same template */
+template <class S>
+void play_batch(S *s, struct batch *b, int me)
+{
+	int g;
+	for (g=0; g<b->running; g++) {
+		Lane lane(b, g);
+		if (lane.Status(me) == play)
+			s->Play(lane, me);
+	}
+}
+
+/* does what the fool script does */
+class Fool: public Strategy {
+public:
+	const char *Name() const { return "fool"; }
+	void Move(Game& game, int me) { Play(game, me); }
+	void Move(struct batch *b, int me) { play_batch(this, b, me); }
+	template <class G> void Play(G& game, int me);
+};
+
+template <class G>
+void Fool::Play(G& game, int me)
+{
+	int to_prod = 2;
+	if (to_prod > game.Material(me))
+		to_prod = game.Material(me);
+	game.Prod(me, to_prod);
+	game.Sell(me, game.Products(me), game.MaxPrice());
+	game.Buy(me, 2, game.MinPrice());
+}
+
+/* does what the clever script does */
+class Clever: public Strategy {
+	int *fail;
+public:
+	Clever() : fail(0) {}
+	~Clever() { delete[] fail; }
+	const char *Name() const { return "clever"; }
+	void NewGame(int games)
+		{ delete[] fail; fail = new int[games](); }
+	void Move(Game& game, int me) { Play(game, me); }
+	void Move(struct batch *b, int me) { play_batch(this, b, me); }
+	template <class G> void Play(G& game, int me);
+};
+
+template <class G>
+void Clever::Play(G& game, int me)
+{
+	int& failed = fail[game.Index()];
+	int to_sell_price = game.MaxPrice();
+	int sold_min_price = game.MinSoldPrice();
+	int to_prod, to_buy;
+	if (game.Sold(me) == 0
+		|| (game.Bought(me) == 0 && game.Material(me) == 0))
+		failed++;
+	else
+		failed = 0;
+	if (sold_min_price == 0)
+		sold_min_price = 10000;
+	if (game.SumProducts() > game.Demand()) {
+		if (game.UnitsSold() == game.Demand())
+			to_sell_price = sold_min_price-1;
+		else
+			to_sell_price--;
+		to_sell_price -= failed*10;
+	}
+	game.Sell(me, game.Products(me), to_sell_price);
+	for (to_prod=0; to_prod*(2300+game.MinPrice()) < game.Money(me)
+		&& to_prod < game.Factories(me); to_prod++)
+		;
+	if (to_prod > game.Material(me))
+		to_prod = game.Material(me);
+	game.Prod(me, to_prod);
+	to_buy = game.Factories(me) - game.Material(me) + to_prod;
+	if (to_buy > 0)
+		game.Buy(me, to_buy, game.MinPrice());
+	if (game.Money(me) >= 20000)
+		game.Build(me);
+}
+
+Strategy *make_strategy(const char *name)
+{
+	if (strcmp(name, "fool") == 0)
+		return new Fool;
+	if (strcmp(name, "clever") == 0)
+		return new Clever;
+	return 0;
+}
+
+struct tally {
+	int n;			/* strategies taking the seats in turn */
+	int *wins;
+	int lost, unfinished;
+	long long months, player_months;
+};
+
+void play_games(Strategy **seat, int players, int games, unsigned seed,
+	struct tally *t)
+{
+	int i, k;
+	Game game(players);
+	for (i=0; i<games; i++) {
+		game.Start(seed + i);
+		for (k=0; k<players; k++)
+			seat[k]->NewGame(1);
+		do {
+			for (k=0; k<players; k++) {
+				if (game.Status(k) != play)
+					continue;
+				seat[k]->Move(game, k);
+				game.Turn(k);
+				t->player_months++;
+			}
+			t->months++;
+		} while (game.EndMonth() && game.Month() <= months_max);
+		if (game.Winner() != -1)
+			t->wins[game.Winner() % t->n]++;
+		else if (game.Active() > 0)
+			t->unfinished++;
+		else
+			t->lost++;
+	}
+}
+
+/* game i is played as play_games would play it */
+void play_batches(Strategy **seat, int players, int games, int size,
+	unsigned seed, struct tally *t)
+{
+	int i, g, k, month;
+	struct batch *b = batch_new(size, players);
+	for (i=0; i<games; i+=size) {
+		if (games-i < size) {
+			batch_free(b);
+			b = batch_new(size = games-i, players);
+		}
+		if (rules)
+			b->rules = rules;
+		batch_start(b, seed + i);
+		for (k=0; k<players; k++)
+			seat[k]->NewGame(size);
+		month = 1;
+		do {
+			for (k=0; k<players; k++)
+				seat[k]->Move(b, k);
+			for (g=0; g<b->running; g++) {
+				t->months++;
+				t->player_months += b->pl_count[g];
+			}
+			month++;
+		} while (batch_month(b) > 0 && month <= months_max);
+		for (g=0; g<size; g++) {
+			if (b->winner[g] != -1)
+				t->wins[b->winner[g] % t->n]++;
+			else if (b->started[g])
+				t->unfinished++;
+			else
+				t->lost++;
+		}
+	}
+	batch_free(b);
+}
+
+int main(int argc, char **argv)
+{
+	int players, games, k, opt, batch = 0;
+	unsigned seed = time(0);
+	long long t;
+	struct timespec t0, t1;
+	struct tally tl;
+	while ((opt = getopt(argc, argv, "s:b:f:")) != -1) {
+		if (opt == 's')
+			seed = strtoul(optarg, 0, 10);
+		else if (opt == 'b')
+			batch = atoi(optarg);
+		else if (opt == 'f') {
+			if (!(rules = rules_pick(optarg)))
+				return 1;
+		} else
+			argc = 0;
+	}
+	argv += optind-1;
+	argc -= optind-1;
+	if (argc < 3 || (players = atoi(argv[1])) < 1
+		|| (games = atoi(argv[2])) < 1 || batch < 0) {
+		fprintf(stderr, "Usage: ./gamesim [-s seed] [-b batch_size] "
+			"[-f rules] players games [strategy ...]\n"
+			"strategies: fool clever (clever by default)\n"
+			"rules: classic rich, or a file of rules\n");
+		return 1;
+	}
+	tl.n = argc > 3 ? argc-3 : 1;
+	Strategy **seat = new Strategy*[players];
+	tl.wins = new int[tl.n];
+	for (k=0; k<players; k++) {
+		const char *name = argc > 3 ? argv[3 + k%tl.n] : "clever";
+		if (!(seat[k] = make_strategy(name))) {
+			fprintf(stderr, "no such strategy: %s\n", name);
+			return 1;
+		}
+	}
+	memset(tl.wins, 0, tl.n*sizeof(int));
+	tl.lost = tl.unfinished = 0;
+	tl.months = tl.player_months = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (batch)
+		play_batches(seat, players, games, batch, seed, &tl);
+	else
+		play_games(seat, players, games, seed, &tl);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	t = (t1.tv_sec-t0.tv_sec)*1000000000LL + t1.tv_nsec-t0.tv_nsec;
+	for (k=0; k<tl.n && k<players; k++)
+		printf("%s (seat %d of every %d): %d wins\n", seat[k]->Name(),
+			k+1, tl.n, tl.wins[k]);
+	printf("%d games lost by everybody, %d unfinished after %d "
+		"months\n", tl.lost, tl.unfinished, months_max);
+	printf("%d games, %lld months, %lld player-months in %lld.%06lld s, "
+		"%.0f games/s, %.0f player-months/s\n", games, tl.months,
+		tl.player_months, t/1000000000, t%1000000000/1000, games*1e9/t,
+		tl.player_months*1e9/t);
+	for (k=0; k<players; k++)
+		delete seat[k];
+	delete[] seat;
+	delete[] tl.wins;
+	return 0;
+}
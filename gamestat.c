@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "gamestat.h"
+
+void read_room(struct room_stats *from, struct room_stats *to)
+{
+	unsigned s1, s2;
+	do {
+		s1 = __atomic_load_n(&from->seq, __ATOMIC_ACQUIRE);
+		memcpy(to, from, sizeof(struct room_stats));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&from->seq, __ATOMIC_RELAXED);
+	} while ((s1 & 1) || s1 != s2);
+}
+
+void print_room(struct room_stats *r)
+{
+	printf("room %d: %s, players %d/%d, month %d, level %d\n"
+		"\tpending turns %d, sell queue %d, buy queue %d, "
+		"last month-end %lld.%03lld us\n",
+		r->id, r->started ? "playing" : "waiting",
+		r->players, r->seats, r->month, r->level,
+		r->pending_turns, r->sell_queue, r->buy_queue,
+		r->month_end_ns/1000, r->month_end_ns%1000);
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : STATS_NAME;
+	struct game_stats *stats;
+	struct room_stats r;
+	int fd, i, rooms;
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1) {
+		perror(name);
+		exit(1);
+	}
+	stats = mmap(NULL, sizeof(struct game_stats), PROT_READ,
+		MAP_SHARED, fd, 0);
+	if (stats == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+	if (__atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC) {
+		fprintf(stderr, "%s is not a gameserv stats page\n", name);
+		exit(1);
+	}
+	rooms = stats->rooms;
+	printf("rooms: %d\n", rooms);
+	for (i=0; i<rooms && i<STATS_ROOMS; i++) {
+		read_room(&stats->room[i], &r);
+		print_room(&r);
+	}
+	return 0;
+}
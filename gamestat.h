@@ -0,0 +1,33 @@
+#ifndef GAMESTAT_H
+#define GAMESTAT_H
+
+#define STATS_NAME "/gameserv"
+#define STATS_MAGIC 0x67616d65
+#define STATS_ROOMS 64
+
+/*
+ * Every room has its own sequence counter: it is odd while the server
+ * is rewriting the room, so a reader has to retry until it sees the same
+ * even value before and after copying the room out.
+ */
+struct room_stats {
+	unsigned seq;
+	int id;
+	int players;
+	int seats;
+	int started;
+	int month;
+	int level;
+	int pending_turns;
+	int sell_queue;
+	int buy_queue;
+	long long month_end_ns;
+};
+
+struct game_stats {
+	unsigned magic;
+	int rooms;
+	struct room_stats room[STATS_ROOMS];
+};
+
+#endif
@@ -0,0 +1,571 @@
+/*
+ * Plays a tournament of two-player games between strategies and bot
+ * scripts and prints a leaderboard. gamesim.cpp is built right into
+ * this file: the strategies it knows play in the worker processes
+ * themselves through gamecore, any other entrant is a gamebot script
+ * and its games are played over a Unix socket by a server of the
+ * worker and a gamebot for each seat, the strategies too then playing
+ * by their scripts. The ratings are Elo, updated as every game comes
+ * back from the workers.
+ */
+
+#define main gamesim_main
+#include "gamesim.cpp"
+#undef main
+
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define RATING_START 1500.0
+#define RATING_K 16.0
+#define WORKER_TASKS 4		/* games given to a worker at a time */
+#define SERVER_PORT 7300
+#define SERVER_WAIT_MS 2000
+#define BOT_LINE 64
+
+struct entrant {
+	const char *name;
+	const char *script;	/* 0 if a strategy of gamesim only */
+	bool builtin;
+	double rating;
+	int games, wins, draws, losses;
+	double score;		/* 1 a win, 1/2 a draw */
+	double square;		/* the sum of the squares of the scores */
+	bool bye;
+	bool *met;
+};
+
+struct task {
+	int id;
+	int seat[2];		/* entrants */
+	unsigned seed;
+};
+
+enum outcome { first_won, second_won, drawn, timed_out };
+
+struct result {
+	int id;
+	int seat[2];
+	int outcome;
+	int worker;
+};
+
+struct worker {
+	pid_t pid;
+	int tasks;		/* pipe to the worker */
+	int busy;
+};
+
+struct entrant *ent;
+int ent_n;
+const char *bot_path = "./gamebot", *server_path = "./server";
+const char *rules_arg = "classic";	/* given to the servers as it is */
+int bot_timeout = 60, base_port = SERVER_PORT;
+
+/* the worker's own */
+pid_t server_pid = 0;
+char server_sock[108];
+Strategy **engine;
+Game *engine_game;
+
+long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+long long now_ms()
+{
+	return now_ns() / 1000000;
+}
+
+/* a game of two strategies in this process, as gamesim plays it */
+int play_inside(const struct task *t)
+{
+	Game& game = *engine_game;
+	Strategy *seat[2] = { engine[t->seat[0]], engine[t->seat[1]] };
+	int k;
+	game.Start(t->seed);
+	for (k=0; k<2; k++)
+		seat[k]->NewGame(1);
+	do {
+		for (k=0; k<2; k++) {
+			if (game.Status(k) != play)
+				continue;
+			seat[k]->Move(game, k);
+			game.Turn(k);
+		}
+	} while (game.EndMonth() && game.Month() <= months_max);
+	if (game.Winner() == -1)
+		return drawn;
+	return game.Winner() == 0 ? first_won : second_won;
+}
+
+/* a server for every game, so that the seed of the task is its seed */
+void start_server(int worker, unsigned seed)
+{
+	char port[16], seed_arg[16];
+	long long start = now_ms();
+	struct stat st;
+	snprintf(server_sock, sizeof(server_sock), "/tmp/gametour.%d.%d",
+		(int)getppid(), worker);
+	snprintf(port, sizeof(port), "%d", base_port + worker);
+	snprintf(seed_arg, sizeof(seed_arg), "%u", seed);
+	unlink(server_sock);
+	if (!(server_pid = fork())) {
+		int fd = open("/dev/null", O_WRONLY);
+		dup2(fd, 1);
+		execl(server_path, server_path, "-f", rules_arg, "-d", seed_arg,
+			"-x", server_sock, "2", port, (char *)0);
+		perror(server_path);
+		_exit(1);
+	}
+	while (stat(server_sock, &st) == -1) {
+		if (now_ms() - start > SERVER_WAIT_MS) {
+			fprintf(stderr, "%s has not started\n", server_path);
+			exit(1);
+		}
+		usleep(1000);
+	}
+	/* it binds the socket a moment before it listens */
+	usleep(10000);
+}
+
+void stop_server()
+{
+	kill(server_pid, SIGTERM);
+	waitpid(server_pid, 0, 0);
+	unlink(server_sock);
+	server_pid = 0;
+}
+
+pid_t start_bot(const char *script, int *out)
+{
+	char addr[128];
+	int fd[2];
+	pid_t pid;
+	snprintf(addr, sizeof(addr), "unix:%s", server_sock);
+	if (pipe(fd) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	if (!(pid = fork())) {
+		dup2(fd[1], 1);
+		close(fd[0]);
+		close(fd[1]);
+		execl(bot_path, bot_path, addr, script, (char *)0);
+		perror(bot_path);
+		_exit(1);
+	}
+	close(fd[1]);
+	*out = fd[0];
+	return pid;
+}
+
+/*
+ * returns 1 if the bot has told it has won, -1 if it has lost, 0 if it
+ * has said nothing of it yet; a bot prints a lot, only its lines count
+ */
+int bot_said(int fd, char *line, int *len)
+{
+	char buf[4096];
+	int n, i, said = 0;
+	if ((n = read(fd, buf, sizeof(buf))) <= 0)
+		return n == 0 ? 2 : 0;
+	for (i=0; i<n; i++) {
+		if (buf[i] != '\n') {
+			if (*len < BOT_LINE-1)
+				line[(*len)++] = buf[i];
+			continue;
+		}
+		line[*len] = '\0';
+		if (strcmp(line, "I am awesome") == 0)
+			said = 1;
+		else if (strcmp(line, "I am loser") == 0)
+			said = -1;
+		*len = 0;
+	}
+	return said;
+}
+
+/* a game of two gamebots on the worker's server */
+int play_outside(const struct task *t, int worker)
+{
+	struct pollfd fds[2];
+	char line[2][BOT_LINE];
+	int len[2] = { 0, 0 }, said[2] = { 0, 0 };
+	int k, left = 2, rc;
+	pid_t pid[2];
+	long long deadline = now_ms() + bot_timeout*1000LL;
+	start_server(worker, t->seed);
+	for (k=0; k<2; k++) {
+		pid[k] = start_bot(ent[t->seat[k]].script, &fds[k].fd);
+		fds[k].events = POLLIN;
+		/* seats go in the order of joining, and a bot says OK
+		 * once it has its seat */
+		if (k == 0 && poll(fds, 1, SERVER_WAIT_MS) == 1) {
+			rc = bot_said(fds[0].fd, line[0], &len[0]);
+			if (rc == 2) {
+				close(fds[0].fd);
+				fds[0].fd = -1;
+				left--;
+			} else if (rc) {
+				said[0] = rc;
+			}
+		}
+	}
+	while (left && now_ms() < deadline) {
+		if (poll(fds, 2, deadline - now_ms()) <= 0)
+			continue;
+		for (k=0; k<2; k++) {
+			if (fds[k].fd == -1 || !fds[k].revents)
+				continue;
+			rc = bot_said(fds[k].fd, line[k], &len[k]);
+			if (rc == 2) {
+				close(fds[k].fd);
+				fds[k].fd = -1;
+				left--;
+			} else if (rc) {
+				said[k] = rc;
+			}
+		}
+	}
+	for (k=0; k<2; k++) {
+		if (fds[k].fd != -1) {
+			kill(pid[k], SIGKILL);
+			close(fds[k].fd);
+		}
+		waitpid(pid[k], 0, 0);
+	}
+	stop_server();
+	if (said[0] == 1 || said[1] == -1)
+		return first_won;
+	if (said[1] == 1 || said[0] == -1)
+		return second_won;
+	return left ? timed_out : drawn;
+}
+
+void work(int worker, int tasks, int results)
+{
+	struct task t;
+	struct result r;
+	int i;
+	engine = new Strategy*[ent_n];
+	for (i=0; i<ent_n; i++)
+		engine[i] = ent[i].builtin ? make_strategy(ent[i].name) : 0;
+	engine_game = new Game(2);
+	while (read(tasks, &t, sizeof(t)) == sizeof(t)) {
+		r.id = t.id;
+		r.seat[0] = t.seat[0];
+		r.seat[1] = t.seat[1];
+		r.worker = worker;
+		if (engine[t.seat[0]] && engine[t.seat[1]])
+			r.outcome = play_inside(&t);
+		else
+			r.outcome = play_outside(&t, worker);
+		if (write(results, &r, sizeof(r)) != sizeof(r))
+			break;
+	}
+	_exit(0);
+}
+
+void rate(const struct result *r)
+{
+	struct entrant *a = &ent[r->seat[0]], *b = &ent[r->seat[1]];
+	double expected, score;
+	score = r->outcome == first_won ? 1 : r->outcome == second_won ? 0
+		: 0.5;
+	expected = 1 / (1 + pow(10, (b->rating - a->rating) / 400));
+	a->rating += RATING_K * (score - expected);
+	b->rating -= RATING_K * (score - expected);
+	a->games++;
+	b->games++;
+	a->score += score;
+	b->score += 1 - score;
+	a->square += score*score;
+	b->square += (1-score)*(1-score);
+	if (score == 1) {
+		a->wins++;
+		b->losses++;
+	} else if (score == 0) {
+		a->losses++;
+		b->wins++;
+	} else {
+		a->draws++;
+		b->draws++;
+	}
+	a->met[r->seat[1]] = b->met[r->seat[0]] = true;
+}
+
+struct tourney {
+	struct worker *w;
+	int w_n;
+	int results;		/* the read end */
+	struct task *queue;
+	int queued, sent, done;
+	int timeouts;
+	unsigned seed;
+	int games_per_pair;
+};
+
+void add_pair(struct tourney *tr, int a, int b)
+{
+	int i;
+	for (i=0; i<tr->games_per_pair; i++) {
+		struct task *t = &tr->queue[tr->queued];
+		t->id = tr->queued++;
+		/* the seats are taken in turn */
+		t->seat[0] = i%2 ? b : a;
+		t->seat[1] = i%2 ? a : b;
+		t->seed = tr->seed + t->id;
+	}
+}
+
+void send_tasks(struct tourney *tr, struct worker *w)
+{
+	while (w->busy < WORKER_TASKS && tr->sent < tr->queued) {
+		if (write(w->tasks, &tr->queue[tr->sent], sizeof(struct task))
+			!= sizeof(struct task)) {
+			perror("worker");
+			exit(1);
+		}
+		tr->sent++;
+		w->busy++;
+	}
+}
+
+/* plays every game queued, rating the results in the order they come */
+void play_queue(struct tourney *tr)
+{
+	struct result r;
+	int i;
+	for (i=0; i<tr->w_n; i++)
+		send_tasks(tr, &tr->w[i]);
+	while (tr->done < tr->queued) {
+		if (read(tr->results, &r, sizeof(r)) != sizeof(r)) {
+			fprintf(stderr, "a worker has gone\n");
+			exit(1);
+		}
+		tr->done++;
+		if (r.outcome == timed_out)
+			tr->timeouts++;
+		rate(&r);
+		tr->w[r.worker].busy--;
+		send_tasks(tr, &tr->w[r.worker]);
+	}
+}
+
+int by_standing(const void *x, const void *y)
+{
+	const struct entrant *a = *(struct entrant * const *)x;
+	const struct entrant *b = *(struct entrant * const *)y;
+	if (a->score != b->score)
+		return a->score < b->score ? 1 : -1;
+	return a->rating < b->rating ? 1 : a->rating > b->rating ? -1 : 0;
+}
+
+/*
+ * pairs the entrants of close standing who have not met yet, from the
+ * top down; an odd one out at the bottom sits the round out
+ */
+void swiss_round(struct tourney *tr)
+{
+	struct entrant **order = new struct entrant*[ent_n];
+	bool *paired = new bool[ent_n]();
+	int i, j, a, b, left = ent_n;
+	for (i=0; i<ent_n; i++)
+		order[i] = &ent[i];
+	qsort(order, ent_n, sizeof(*order), by_standing);
+	if (left % 2) {
+		for (i=ent_n-1; i>0 && order[i]->bye; i--)
+			;
+		order[i]->bye = true;
+		paired[i] = true;
+	}
+	for (i=0; i<ent_n; i++) {
+		if (paired[i])
+			continue;
+		a = order[i] - ent;
+		for (j=i+1; j<ent_n && (paired[j] || order[i]->met[order[j]
+			- ent]); j++)
+			;
+		/* everybody left has been met: take the next one anyway */
+		if (j == ent_n)
+			for (j=i+1; j<ent_n && paired[j]; j++)
+				;
+		if (j == ent_n)
+			break;
+		b = order[j] - ent;
+		paired[i] = paired[j] = true;
+		add_pair(tr, a, b);
+	}
+	delete[] order;
+	delete[] paired;
+}
+
+/* the error of the rating from the spread of the scores, 95% */
+double margin(const struct entrant *e)
+{
+	double p = e->score / e->games;
+	double var = e->square / e->games - p*p;
+	if (p <= 0 || p >= 1)
+		return INFINITY;
+	return 1.96 * sqrt(var / e->games) * 400 / (log(10) * p * (1-p));
+}
+
+void print_board()
+{
+	struct entrant **order = new struct entrant*[ent_n];
+	int i;
+	for (i=0; i<ent_n; i++)
+		order[i] = &ent[i];
+	qsort(order, ent_n, sizeof(*order), by_standing);
+	printf("rank %-20s %6s %6s %6s %6s %6s %7s %6s\n", "entrant",
+		"rating", "+-95%", "games", "wins", "draws", "losses",
+		"score");
+	for (i=0; i<ent_n; i++) {
+		struct entrant *e = order[i];
+		double m = e->games ? margin(e) : INFINITY;
+		printf("%4d %-20s %6.0f ", i+1, e->name, e->rating);
+		if (isinf(m))
+			printf("%6s", "-");
+		else
+			printf("%6.0f", m);
+		printf(" %6d %6d %6d %7d %5.1f%%\n", e->games, e->wins,
+			e->draws, e->losses,
+			e->games ? 100 * e->score / e->games : 0.0);
+	}
+	delete[] order;
+}
+
+/* returns false if the entrant can be played neither way */
+bool enter(struct entrant *e, const char *arg)
+{
+	Strategy *s = make_strategy(arg);
+	const char *slash = strrchr(arg, '/');
+	e->builtin = s != 0;
+	delete s;
+	e->name = slash ? slash+1 : arg;
+	e->script = access(arg, R_OK) == 0 ? arg : 0;
+	e->rating = RATING_START;
+	e->met = new bool[ent_n]();
+	return e->builtin || e->script;
+}
+
+int main(int argc, char **argv)
+{
+	struct tourney tr;
+	int opt, i, j, fd[2], rounds = 0, jobs = 0;
+	bool outside = false;
+	long long t;
+	memset(&tr, 0, sizeof(tr));
+	tr.seed = time(0);
+	tr.games_per_pair = 2;
+	while ((opt = getopt(argc, argv, "s:r:n:j:b:e:t:p:f:")) != -1) {
+		switch (opt) {
+		case 's':	tr.seed = strtoul(optarg, 0, 10); break;
+		case 'r':	rounds = atoi(optarg); break;
+		case 'n':	tr.games_per_pair = atoi(optarg); break;
+		case 'j':	jobs = atoi(optarg); break;
+		case 'b':	bot_path = optarg; break;
+		case 'e':	server_path = optarg; break;
+		case 't':	bot_timeout = atoi(optarg); break;
+		case 'p':	base_port = atoi(optarg); break;
+		case 'f':	rules_arg = optarg; break;
+		default:	argc = 0;
+		}
+	}
+	if (optind+2 > argc || rounds < 0 || tr.games_per_pair < 1
+		|| jobs < 0 || bot_timeout < 1 || base_port < 1) {
+		fprintf(stderr, "Usage: ./gametour [-s seed] [-r swiss_rounds] "
+			"[-n games_per_pair] [-j jobs]\n"
+			"                  [-b gamebot] [-e server] "
+			"[-t bot_timeout_s] [-p port] [-f rules]\n"
+			"                  entrant entrant [entrant ...]\n"
+			"entrants: fool clever (played inside), or gamebot "
+			"scripts\n");
+		return 1;
+	}
+	if (!(rules = rules_pick(rules_arg)))
+		return 1;
+	ent_n = argc - optind;
+	ent = new struct entrant[ent_n]();
+	for (i=0; i<ent_n; i++) {
+		if (!enter(&ent[i], argv[optind+i])) {
+			fprintf(stderr, "no such strategy or script: %s\n",
+				argv[optind+i]);
+			return 1;
+		}
+		outside = outside || !ent[i].builtin;
+	}
+	/* against a bot a strategy plays by its script */
+	for (i=0; outside && i<ent_n; i++) {
+		if (!ent[i].script) {
+			fprintf(stderr, "%s has no script to play the bots "
+				"with\n", ent[i].name);
+			return 1;
+		}
+	}
+	if (!jobs)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	signal(SIGPIPE, SIG_IGN);
+	/* the bots and servers of the workers keep none of the pipes */
+	if (pipe2(fd, O_CLOEXEC) == -1) {
+		perror("pipe");
+		return 1;
+	}
+	tr.results = fd[0];
+	tr.w_n = jobs;
+	tr.w = new struct worker[jobs]();
+	for (i=0; i<jobs; i++) {
+		int task[2];
+		if (pipe2(task, O_CLOEXEC) == -1) {
+			perror("pipe");
+			return 1;
+		}
+		if (!(tr.w[i].pid = fork())) {
+			/* or the workers before would never see the end */
+			for (j=0; j<i; j++)
+				close(tr.w[j].tasks);
+			close(task[1]);
+			close(fd[0]);
+			work(i, task[0], fd[1]);
+		}
+		close(task[0]);
+		tr.w[i].tasks = task[1];
+	}
+	close(fd[1]);
+	i = rounds ? rounds * (ent_n/2) : ent_n * (ent_n-1) / 2;
+	tr.queue = new struct task[i * tr.games_per_pair];
+	t = now_ns();
+	if (rounds) {
+		for (i=0; i<rounds; i++) {
+			swiss_round(&tr);
+			play_queue(&tr);
+		}
+	} else {
+		for (i=0; i<ent_n; i++)
+			for (j=i+1; j<ent_n; j++)
+				add_pair(&tr, i, j);
+		play_queue(&tr);
+	}
+	t = now_ns() - t;
+	for (i=0; i<jobs; i++)
+		close(tr.w[i].tasks);
+	while (wait(0) > 0)
+		;
+	print_board();
+	printf("%d games by %d workers in %lld.%06lld s, %.0f games/min",
+		tr.done, jobs, t/1000000000, t%1000000000/1000,
+		tr.done*6e10/t);
+	if (tr.timeouts)
+		printf(", %d timed out and counted as draws", tr.timeouts);
+	printf("\n");
+	return 0;
+}